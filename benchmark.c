@@ -0,0 +1,427 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h> // memcpy
+#include <math.h> // sqrt
+#include <getopt.h> // getopt
+
+#include "emulate.h"
+#include "tools.h"
+#include "opcodes.h"
+#include "emulator_timeline.h"
+
+// Runs guest programs headless for a fixed number of cycles and reports
+// emulated MHz, instructions per second and wall time per engine, see
+// benchmark.zsh:
+//
+//     benchmark run [-c cycles] [-w warmup] [-n repeats] -o results.json name:program:input...
+//     benchmark compare [-t percent] baseline.json results.json
+//
+// A case without program runs the boot rom, input is an rx timeline as
+// written by `emulator -r`. Every repeat starts from the same state after
+// init, so instructions and tx bytes are the same in every repeat, and are
+// compared against the baseline to catch a benchmark that no longer does the
+// same work.
+//
+// compare fails on a case that lost more than percent of its MHz only when the
+// 95% confidence intervals of the two runs don't overlap, a larger drop inside
+// the noise is reported but passes.
+
+#define PROGRAM_START 0x1000
+#define PROGRAM_SIZE (0x10000 - PROGRAM_START)
+
+typedef struct {
+    uint64_t instructions;
+    uint64_t tx_bytes;
+} Work;
+
+typedef Work (*Engine)(uint8_t control[CONTROL_ROM_SIZE], uint8_t alu[ALU_ROM_SIZE], State *state, Timeline *input, uint64_t cycles);
+
+// The emulator's own loop without the debugging features, serial output is
+// counted and dropped.
+static Work engine_cycle(uint8_t control[CONTROL_ROM_SIZE], uint8_t alu[ALU_ROM_SIZE], State *state, Timeline *input, uint64_t cycles) {
+    Work work = {0};
+
+    for (uint64_t i = 0; i < cycles; ++i) {
+        if (emulate_next_cycle(false, control, alu, state)) {
+            ++work.instructions;
+
+            if (state->tx_bits == 9) {
+                state->tx_bits = 0;
+                ++work.tx_bytes;
+            }
+
+            timeline_inject(input, state);
+        }
+    }
+
+    return work;
+}
+
+static const struct {
+    const char *name;
+    Engine run;
+} ENGINES[] = {
+    { "cycle", engine_cycle },
+};
+
+#define N_ENGINES (sizeof(ENGINES) / sizeof(ENGINES[0]))
+
+static bool read_file(const char *filepath, size_t size, uint8_t *data, size_t *read_bytes) {
+    FILE *file = fopen(filepath, "r");
+
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s\n", filepath);
+        return false;
+    }
+
+    *read_bytes = fread(data, 1, size, file);
+    fclose(file);
+
+    return true;
+}
+
+// Same as the emulator, a jump to the program replaces the boot rom.
+static bool load_program(const char *filepath, State *state) {
+    static uint8_t program[PROGRAM_SIZE];
+    size_t program_size;
+
+    if (!read_file(filepath, PROGRAM_SIZE, program, &program_size)) return false;
+
+    state->mem[0] = O_JMP_I16;
+    state->mem[1] = PROGRAM_START >> 8;
+    state->mem[2] = PROGRAM_START & 0xff;
+
+    memcpy(state->mem + PROGRAM_START, program, program_size);
+
+    return true;
+}
+
+typedef struct {
+    double mean;
+    double stddev;
+    double ci95; // Half width of the 95% confidence interval of the mean.
+} Summary;
+
+// Two sided 95% quantiles of Student's t for 1..30 degrees of freedom.
+static const double T95[30] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+
+static Summary summarize(const double *values, int n) {
+    Summary summary = {0};
+
+    for (int i = 0; i < n; ++i) summary.mean += values[i];
+    summary.mean /= n;
+
+    if (n < 2) return summary;
+
+    double sum_squares = 0;
+    for (int i = 0; i < n; ++i) sum_squares += (values[i] - summary.mean) * (values[i] - summary.mean);
+
+    summary.stddev = sqrt(sum_squares / (n - 1));
+    summary.ci95 = (n - 1 <= 30 ? T95[n - 2] : 1.960) * summary.stddev / sqrt(n);
+
+    return summary;
+}
+
+static void write_summary(FILE *f, const char *name, Summary summary) {
+    fprintf(f, ", \"%s\": %.6g, \"%s_stddev\": %.6g, \"%s_ci95\": %.6g", name, summary.mean, name, summary.stddev, name, summary.ci95);
+}
+
+static int run(int argc, char **argv) {
+    uint64_t cycles = 30000000;
+    int warmup = 1;
+    int repeats = 5;
+    const char *output_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:w:n:o:")) != -1) {
+        switch (opt) {
+        case 'c': cycles = strtoull(optarg, NULL, 10); break;
+        case 'w': warmup = atoi(optarg); break;
+        case 'n': repeats = atoi(optarg); break;
+        case 'o': output_path = optarg; break;
+        default: return 2;
+        }
+    }
+
+    if (output_path == NULL || optind == argc || cycles == 0 || warmup < 0 || repeats < 1) return 2;
+
+    static uint8_t control[CONTROL_ROM_SIZE];
+    static uint8_t alu[ALU_ROM_SIZE];
+
+    if (!read_rom("./build/custom-cpu_control.bin", CONTROL_ROM_SIZE, control) ||
+        !read_rom("./build/custom-cpu_alu.bin",     ALU_ROM_SIZE,     alu)) return 1;
+
+    static State init_state;
+
+    while (!(init_state.f & F_I))
+        emulate_next_cycle(false, control, alu, &init_state);
+
+    FILE *f = fopen(output_path, "w");
+
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s\n", output_path);
+        return 1;
+    }
+
+    fprintf(f, "{\"cycles\": %llu, \"warmup\": %d, \"repeats\": %d, \"results\": [\n", (unsigned long long)cycles, warmup, repeats);
+
+    double *mhz = malloc((size_t)repeats * sizeof(double));
+    double *instructions_per_s = malloc((size_t)repeats * sizeof(double));
+    double *wall_s = malloc((size_t)repeats * sizeof(double));
+    bool first = true;
+
+    printf("%-14s %-8s %12s %10s %14s %9s\n", "case", "engine", "MHz", "+-95%", "instructions/s", "wall s");
+
+    for (int i = optind; i < argc; ++i) {
+        // name:program:input, program and input may be empty.
+        char spec[1024];
+        snprintf(spec, sizeof(spec), "%s", argv[i]);
+
+        char *name = spec;
+        char *program = strchr(name, ':');
+        char *input = program != NULL ? strchr(program + 1, ':') : NULL;
+
+        if (program == NULL || input == NULL) {
+            fprintf(stderr, "expected name:program:input, got %s\n", argv[i]);
+            return 2;
+        }
+
+        *program++ = 0;
+        *input++ = 0;
+
+        static State start_state;
+        start_state = init_state;
+
+        if (*program != 0 && !load_program(program, &start_state)) return 1;
+
+        Timeline timeline = { .end = UINT64_MAX };
+
+        if (*input != 0 && !timeline_read(input, &timeline)) return 1;
+
+        for (size_t e = 0; e < N_ENGINES; ++e) {
+            static State state;
+            Work work = {0};
+
+            for (int r = -warmup; r < repeats; ++r) {
+                state = start_state;
+                timeline.cursor = 0;
+
+                uint64_t start = now_ns();
+                Work repeat_work = ENGINES[e].run(control, alu, &state, &timeline, cycles);
+                double seconds = (double)(now_ns() - start) / 1e9;
+
+                if (r < 0) continue;
+
+                if (r > 0 && (repeat_work.instructions != work.instructions || repeat_work.tx_bytes != work.tx_bytes)) {
+                    fprintf(stderr, "%s: %s did different work in repeat %d\n", name, ENGINES[e].name, r);
+                    return 1;
+                }
+
+                work = repeat_work;
+                wall_s[r] = seconds;
+                mhz[r] = (double)cycles / seconds / 1e6;
+                instructions_per_s[r] = (double)work.instructions / seconds;
+            }
+
+            Summary mhz_summary = summarize(mhz, repeats);
+            Summary instructions_summary = summarize(instructions_per_s, repeats);
+            Summary wall_summary = summarize(wall_s, repeats);
+
+            printf("%-14s %-8s %12.2f %10.2f %14.0f %9.3f\n",
+                name, ENGINES[e].name, mhz_summary.mean, mhz_summary.ci95, instructions_summary.mean, wall_summary.mean);
+
+            // One result per line, compare relies on it.
+            fprintf(f, "%s  {\"name\": \"%s\", \"engine\": \"%s\", \"instructions\": %llu, \"tx_bytes\": %llu",
+                first ? "" : ",\n", name, ENGINES[e].name, (unsigned long long)work.instructions, (unsigned long long)work.tx_bytes);
+            write_summary(f, "mhz", mhz_summary);
+            write_summary(f, "instructions_per_s", instructions_summary);
+            write_summary(f, "wall_s", wall_summary);
+            fprintf(f, "}");
+
+            first = false;
+        }
+
+        free(timeline.events);
+    }
+
+    fprintf(f, "\n]}\n");
+    fclose(f);
+
+    free(mhz);
+    free(instructions_per_s);
+    free(wall_s);
+
+    printf("results written to %s\n", output_path);
+
+    return 0;
+}
+
+typedef struct {
+    char name[64];
+    char engine[16];
+    unsigned long long instructions;
+    double mhz;
+    double mhz_ci95;
+} Result;
+
+static bool parse_string(const char *line, const char *key, char *value, size_t size) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\": \"", key);
+
+    const char *start = strstr(line, pattern);
+    if (start == NULL) return false;
+
+    start += strlen(pattern);
+    const char *end = strchr(start, '"');
+    if (end == NULL || (size_t)(end - start) >= size) return false;
+
+    memcpy(value, start, (size_t)(end - start));
+    value[end - start] = 0;
+
+    return true;
+}
+
+static bool parse_number(const char *line, const char *key, double *value) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+
+    const char *start = strstr(line, pattern);
+    if (start == NULL) return false;
+
+    *value = strtod(start + strlen(pattern), NULL);
+
+    return true;
+}
+
+// Reads the results of a file written by run.
+static Result *read_results(const char *path, size_t *n) {
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return NULL;
+    }
+
+    Result *results = NULL;
+    size_t capacity = 0;
+    char line[4096];
+
+    *n = 0;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        Result result;
+        double instructions;
+
+        if (!parse_string(line, "name", result.name, sizeof(result.name))) continue;
+
+        if (!parse_string(line, "engine", result.engine, sizeof(result.engine)) ||
+            !parse_number(line, "instructions", &instructions) ||
+            !parse_number(line, "mhz", &result.mhz) ||
+            !parse_number(line, "mhz_ci95", &result.mhz_ci95)) {
+            fprintf(stderr, "%s: malformed result %s", path, line);
+            fclose(f);
+            free(results);
+            return NULL;
+        }
+
+        result.instructions = (unsigned long long)instructions;
+
+        if (*n == capacity) {
+            capacity = capacity == 0 ? 16 : 2 * capacity;
+            results = realloc(results, capacity * sizeof(Result));
+
+            if (results == NULL) {
+                fprintf(stderr, "Failed to grow results\n");
+                exit(1);
+            }
+        }
+
+        results[(*n)++] = result;
+    }
+
+    fclose(f);
+
+    return results;
+}
+
+static int compare(int argc, char **argv) {
+    double threshold = 5;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+        case 't': threshold = strtod(optarg, NULL); break;
+        default: return 2;
+        }
+    }
+
+    if (argc - optind != 2) return 2;
+
+    size_t n_baseline, n_results;
+    Result *baseline = read_results(argv[optind], &n_baseline);
+    Result *results = read_results(argv[optind + 1], &n_results);
+
+    if (baseline == NULL || results == NULL) return 1;
+
+    int regressions = 0;
+
+    printf("%-14s %-8s %12s %12s %8s\n", "case", "engine", "baseline MHz", "MHz", "change");
+
+    for (size_t i = 0; i < n_results; ++i) {
+        const Result *result = &results[i];
+        const Result *base = NULL;
+
+        for (size_t j = 0; j < n_baseline; ++j)
+            if (strcmp(baseline[j].name, result->name) == 0 && strcmp(baseline[j].engine, result->engine) == 0)
+                base = &baseline[j];
+
+        if (base == NULL) {
+            printf("%-14s %-8s %12s %12.2f\n", result->name, result->engine, "-", result->mhz);
+            continue;
+        }
+
+        double change = 100.0 * (result->mhz - base->mhz) / base->mhz;
+        bool overlap = result->mhz + result->mhz_ci95 >= base->mhz - base->mhz_ci95;
+        const char *verdict = "";
+
+        if (change < -threshold && !overlap) {
+            verdict = " regression";
+            ++regressions;
+        } else if (change < -threshold) {
+            verdict = " within noise";
+        }
+
+        printf("%-14s %-8s %12.2f %12.2f %+7.1f%%%s%s\n", result->name, result->engine, base->mhz, result->mhz, change,
+            verdict, result->instructions != base->instructions ? " (different work)" : "");
+    }
+
+    free(baseline);
+    free(results);
+
+    if (regressions > 0) {
+        fprintf(stderr, "%d regressions beyond %.1f%%\n", regressions, threshold);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int status = 2;
+
+    if (argc >= 2 && strcmp(argv[1], "run") == 0) status = run(argc - 1, argv + 1);
+    else if (argc >= 2 && strcmp(argv[1], "compare") == 0) status = compare(argc - 1, argv + 1);
+
+    if (status == 2) {
+        fprintf(stderr, "usage: %s run [-c cycles] [-w warmup] [-n repeats] -o results.json name:program:input...\n", argv[0]);
+        fprintf(stderr, "       %s compare [-t percent] baseline.json results.json\n", argv[0]);
+    }
+
+    return status;
+}
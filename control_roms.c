@@ -1,9 +1,13 @@
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "control_roms.h"
@@ -17,6 +21,68 @@
 
 #define S0_FETCH (OE_MEM | S_C(1 /*LD_O*/) | INC_M)
 
+// Part of every cache key, build_control_roms.zsh passes a hash of the
+// generator's sources. Without one each compile is a new generator.
+#ifndef CONTROL_ROMS_VERSION
+#define CONTROL_ROMS_VERSION __DATE__ " " __TIME__
+#endif
+
+#define HASH_INIT 0xcbf29ce484222325
+
+#define PARALLEL_MAX_THREADS 256
+
+typedef void (*ParallelFn)(void *context, uint32_t begin, uint32_t end);
+
+typedef struct {
+    ParallelFn fn;
+    void *context;
+    uint32_t n;
+    uint32_t block;
+    atomic_uint next;
+} Parallel;
+
+static int parallel_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n < 1 ? 1 : n > PARALLEL_MAX_THREADS ? PARALLEL_MAX_THREADS : (int)n;
+}
+
+static void *parallel_thread(void *arg) {
+    Parallel *parallel = arg;
+
+    for (;;) {
+        uint32_t begin = atomic_fetch_add(&parallel->next, parallel->block);
+
+        if (begin >= parallel->n) break;
+
+        uint32_t end = parallel->n - begin < parallel->block ? parallel->n : begin + parallel->block;
+
+        parallel->fn(parallel->context, begin, end);
+    }
+
+    return NULL;
+}
+
+// Runs fn over [0, n) in blocks taken in turn by one thread per core.
+static void parallel_for(uint32_t n, uint32_t block, ParallelFn fn, void *context) {
+    Parallel parallel = { .fn = fn, .context = context, .n = n, .block = block };
+    pthread_t threads[PARALLEL_MAX_THREADS];
+    int n_threads = parallel_threads();
+
+    atomic_init(&parallel.next, 0);
+
+    for (int i = 0; i < n_threads; ++i) {
+        int result = pthread_create(&threads[i], NULL, parallel_thread, &parallel);
+
+        if (result != 0) {
+            fprintf(stderr, "Failed to start thread, reason: %s\n", strerror(result));
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < n_threads; ++i) pthread_join(threads[i], NULL);
+}
+
 typedef enum {
     A_BOOT   = 0,
     A_ADD    = 1,
@@ -119,104 +185,146 @@ static uint8_t alu_signals(uint8_t ls, uint8_t rs, A op) {
     }
 }
 
-static void test_alu(uint8_t alu[ALU_ROM_SIZE]) {
-    for (int ls = 0; ls < 0x100; ++ls) {
-    for (int rs = 0; rs < 0x100; ++rs) {
-    for (uint8_t op = 0; op < 0x8; ++op) {
-        uint8_t q = alu[(op << 16) | (rs << 8) | ls];
+// Expected value of one ALU row, op and rs fixed, and the bits of it that are
+// defined. Each loop is free of branches so it vectorizes.
+static uint8_t test_alu_expected(A op, uint8_t rs, uint8_t expected[0x100]) {
+    switch (op) {
 
-        uint8_t zf = (q >> 0) & 1;
-        uint8_t cf = (q >> 1) & 1;
-        uint8_t sf = (q >> 2) & 1;
-        uint8_t initf = (q >> 3) & 1;
+    case A_BOOT:
+        for (int ls = 0; ls < 0x100; ++ls) expected[ls] = 0;
+        return 0;
 
-        switch ((A)op) {
+    case A_ADD:
+        for (int ls = 0; ls < 0x100; ++ls) expected[ls] = (uint8_t)(ls + rs);
+        return 0xff;
 
-        case A_BOOT: break;
+    case A_ADD_F:
+        for (int ls = 0; ls < 0x100; ++ls) {
+            int q = ls + rs;
 
-        case A_ADD:
-            assert(q == (uint8_t)(ls + rs));
-            break;
+            expected[ls] = (uint8_t)(F_I | ((q >> 8) << 1) | ((q & 0x80) >> 5) | ((q & 0xff) == 0));
+        }
+        return 0x0f;
 
-        case A_ADD_F:
-            assert((ls + rs) > 0xff            ? cf : !cf);
-            assert((((ls + rs) & 0xff) == 0)   ? zf : !zf);
-            assert((((ls + rs) & 0xff) & 0x80) ? sf : !sf);
-            assert(initf == 1);
-            break;
+    case A_NAND:
+        for (int ls = 0; ls < 0x100; ++ls) expected[ls] = (uint8_t)~(ls & rs);
+        return 0xff;
 
-        case A_NAND:
-            assert(q == (uint8_t)(~(ls & rs)));
-            break;
+    case A_OR:
+        for (int ls = 0; ls < 0x100; ++ls) expected[ls] = (uint8_t)(ls | rs);
+        return 0xff;
 
-        case A_OR:
-            assert(q == (uint8_t)(ls | rs));
-            break;
+    case A_UNARY:
+        switch ((AU)rs) {
 
-        case A_UNARY: {
-            switch ((AU)rs) {
+        case AU_SHR:
+            for (int ls = 0; ls < 0x100; ++ls) expected[ls] = (uint8_t)(ls >> 1);
+            return 0xff;
 
-            case AU_SHR:
-                assert(q == (ls >> 1));
-                break;
+        // Sign is always clear.
+        case AU_SHR_F:
+            for (int ls = 0; ls < 0x100; ++ls) expected[ls] = (uint8_t)(F_I | ((ls & 1) << 1) | ((ls >> 1) == 0));
+            return 0x0f;
 
-            case AU_SHR_F: {
-                uint8_t expected_c = ls & 1;
-
-                assert(cf == expected_c);
-                assert(((ls >> 1) == 0)   ? zf : !zf);
-                assert(((ls >> 1) & 0x80) ? sf : !sf);
-                assert(initf == 1);
-            } break;
-
-            case AU_FLAGS: {
-                 assert(q == ((ls & 0x07) | F_I));
-             } break;
-
-            case AU_BOOT_F: {
-                assert(zf == 1);
-                assert(cf == 0);
-                assert(sf == 1);
-                assert(initf == 0);
-            } break;
-
-            case AU_OR_BIT:
-
-            default: {
-                if (rs >= AU_OR_BIT && rs < (AU_OR_BIT + 0x40)) {
-                    assert(q == (uint8_t)(((ls >> (rs & 0x7)) & 1) << ((rs >> 3) & 0x7)));
-                } else {
-                    assert(zf == 1);
-                    assert(initf == 0);
-                }
-            } break;
-            }
-        } break;
+        case AU_FLAGS:
+            for (int ls = 0; ls < 0x100; ++ls) expected[ls] = (uint8_t)((ls & 0x07) | F_I);
+            return 0xff;
 
-        case A_LS:
-            assert(q == ls);
-            break;
+        case AU_BOOT_F:
+            for (int ls = 0; ls < 0x100; ++ls) expected[ls] = F_S | F_Z;
+            return 0x0f;
 
-        case A_RS:
-            assert(q == rs);
-            break;
+        case AU_OR_BIT:
+
+        default:
+            if (rs >= AU_OR_BIT && rs < (AU_OR_BIT + 0x40)) {
+                int read_pos = rs & 0x7;
+                int write_pos = (rs >> 3) & 0x7;
 
+                for (int ls = 0; ls < 0x100; ++ls) expected[ls] = (uint8_t)(((ls >> read_pos) & 1) << write_pos);
+                return 0xff;
+            } else {
+                for (int ls = 0; ls < 0x100; ++ls) expected[ls] = F_Z;
+                return F_I | F_Z;
+            }
         }
+
+    case A_LS:
+        for (int ls = 0; ls < 0x100; ++ls) expected[ls] = (uint8_t)ls;
+        return 0xff;
+
+    case A_RS:
+        for (int ls = 0; ls < 0x100; ++ls) expected[ls] = rs;
+        return 0xff;
+
     }
+}
+
+typedef struct {
+    const uint8_t *alu;
+    atomic_int failed; // Index of an entry that failed, or -1.
+} TestAlu;
+
+// Checks rows [begin, end), a row is every ls for one op:rs.
+static void test_alu_rows(void *context, uint32_t begin, uint32_t end) {
+    TestAlu *test = context;
+    uint8_t expected[0x100];
+
+    for (uint32_t row = begin; row < end; ++row) {
+        const uint8_t *q = &test->alu[row << 8];
+        uint8_t mask = test_alu_expected((A)(row >> 8), (uint8_t)row, expected);
+        uint8_t differences = 0;
+
+        for (int ls = 0; ls < 0x100; ++ls) differences |= (q[ls] ^ expected[ls]) & mask;
+
+        if (differences == 0) continue;
+
+        for (int ls = 0; ls < 0x100; ++ls)
+            if ((q[ls] ^ expected[ls]) & mask) {
+                int none = -1;
+                atomic_compare_exchange_strong(&test->failed, &none, (int)(row << 8) | ls);
+                break;
+            }
     }
+}
+
+static void test_alu(uint8_t alu[ALU_ROM_SIZE]) {
+    TestAlu test = { .alu = alu };
+
+    atomic_init(&test.failed, -1);
+
+    parallel_for(ALU_ROM_SIZE >> 8, 64, test_alu_rows, &test);
+
+    int failed = atomic_load(&test.failed);
+
+    if (failed >= 0) {
+        uint8_t expected[0x100];
+        uint8_t ls = (uint8_t)(failed & 0xff);
+        uint8_t rs = (uint8_t)((failed >> 8) & 0xff);
+        A op = (A)(failed >> 16);
+        uint8_t mask = test_alu_expected(op, rs, expected);
+
+        fprintf(stderr, "ALU op %d, rs %02x, ls %02x is %02x, expected %02x in bits %02x\n", op, rs, ls, alu[failed], expected[ls], mask);
+        exit(1);
     }
 }
 
-static void fill_alu(uint8_t alu[ALU_ROM_SIZE]) {
-    for (uint32_t i = 0; i < ALU_ROM_SIZE; ++i) {
-        uint8_t ls = (i >> 0)  & 0xff;
-        uint8_t rs = (i >> 8)  & 0xff;
-        uint8_t op = (i >> 16) & 0x7;
+static void fill_alu_rows(void *context, uint32_t begin, uint32_t end) {
+    uint8_t *alu = context;
+
+    for (uint32_t row = begin; row < end; ++row) {
+        uint8_t rs = row & 0xff;
+        A op = (A)((row >> 8) & 0x7);
 
-        alu[i] = alu_signals(ls, rs, op);
+        for (int ls = 0; ls < 0x100; ++ls)
+            alu[(row << 8) | (uint32_t)ls] = alu_signals((uint8_t)ls, rs, op);
     }
 }
 
+static void fill_alu(uint8_t alu[ALU_ROM_SIZE]) {
+    parallel_for(ALU_ROM_SIZE >> 8, 64, fill_alu_rows, alu);
+}
+
 static void fill_alu_boot_rom(uint8_t alu[ALU_ROM_SIZE], uint8_t boot_rom[BOOT_ROM_SIZE]) {
     for (uint32_t i = 0; i < BOOT_ROM_SIZE; ++i) {
         // Assumes rs:ls (MH:ML) is the first 16 bits of the rom address.
@@ -722,9 +830,9 @@ static uint16_t instr_or_r8_cf(C r8, bool cf_set, uint8_t s) {
         case 0x3: return OE_ALU | LD_MEM          | S_C(r8)      | SEL_C | LD_C;
         case 0x4: return OE_MEM | LD_ML           | S_C(1)       | SEL_C | LD_C;
         case 0x5: return OE_C   | LD_MH           | S_C(A_OR)    | SEL_C | LD_C;
-        case 0x6: return OE_ALU | LD_T            | S_C(0)       | SEL_C | LD_C; // T = ML or MH
-        case 0x7: return OE_C   | LD_MH           | S_C(A_ADD_F) | SEL_C | LD_C;
-        case 0x8: return OE_ALU | LD_F            | S_C(r8)      | SEL_C | LD_C;
+        case 0x6: return OE_ALU | (LD_T | LD_ML)  | S_C(0)       | SEL_C | LD_C; // T, ML = ML or MH
+        case 0x7: return OE_C   | LD_MH           | S_C(A_ADD_F) | SEL_C | LD_C; // MH = 0
+        case 0x8: return OE_ALU | LD_F            | S_C(r8)      | SEL_C | LD_C; // F  = 0 + (ML or MH)
         case 0x9: return OE_T   | LD_MEM          | S_C(C_T_ML)  | SEL_C | LD_C;
         case 0xa: return OE_MEM | LD_ML           | S_C(C_T_MH)  | SEL_C | LD_C;
         case 0xb: return OE_MEM | LD_MH                          | SEL_M | LD_C;
@@ -738,9 +846,9 @@ static uint16_t instr_or_r8_cf(C r8, bool cf_set, uint8_t s) {
         case 0x3: return OE_ALU | LD_MEM          | S_C(r8)      | SEL_C | LD_C;
         case 0x4: return OE_MEM | LD_ML           | S_C(0)       | SEL_C | LD_C;
         case 0x5: return OE_C   | LD_MH           | S_C(A_OR)    | SEL_C | LD_C;
-        case 0x6: return OE_ALU | LD_T            | S_C(0)       | SEL_C | LD_C; // T = ML or MH
-        case 0x7: return OE_C   | LD_MH           | S_C(A_ADD_F) | SEL_C | LD_C;
-        case 0x8: return OE_ALU | LD_F            | S_C(r8)      | SEL_C | LD_C;
+        case 0x6: return OE_ALU | (LD_T | LD_ML)  | S_C(0)       | SEL_C | LD_C; // T, ML = ML or MH
+        case 0x7: return OE_C   | LD_MH           | S_C(A_ADD_F) | SEL_C | LD_C; // MH = 0
+        case 0x8: return OE_ALU | LD_F            | S_C(r8)      | SEL_C | LD_C; // F  = 0 + (ML or MH)
         case 0x9: return OE_T   | LD_MEM          | S_C(C_T_ML)  | SEL_C | LD_C;
         case 0xa: return OE_MEM | LD_ML           | S_C(C_T_MH)  | SEL_C | LD_C;
         case 0xb: return OE_MEM | LD_MH                          | SEL_M | LD_C;
@@ -1101,8 +1209,10 @@ static uint16_t control_signals(uint8_t s, uint8_t f, uint8_t o) {
     return OE_C;
 }
 
-static void fill_control(uint8_t control[CONTROL_ROM_SIZE]) {
-    for (int i = 0; i < CONTROL_ROM_SIZE; ++i) {
+static void fill_control_block(void *context, uint32_t begin, uint32_t end) {
+    uint8_t *control = context;
+
+    for (uint32_t i = begin; i < end; ++i) {
         uint8_t o = (i >> 0)  & 0xff;
         uint8_t s = (i >> 8)  & 0xf;
         uint8_t f = (i >> 12) & 0xf;
@@ -1121,6 +1231,10 @@ static void fill_control(uint8_t control[CONTROL_ROM_SIZE]) {
     }
 }
 
+static void fill_control(uint8_t control[CONTROL_ROM_SIZE]) {
+    parallel_for(CONTROL_ROM_SIZE, 0x1000, fill_control_block, control);
+}
+
 static const char* customasm_rule_from_opcode(O o) {
     switch (o) {
 
@@ -1301,6 +1415,106 @@ static void combined_customasm_rules(int n, char buffer[n]) {
     }
 }
 
+// FNV-1a, 64 bits. The multiply by the prime 2^40 + 0x1b3 is done in 32 bit
+// halves so nothing wraps, -fsanitize=integer traps on that.
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+
+        uint64_t lo = hash & 0xffffffff;
+        uint64_t hi = hash >> 32;
+        uint64_t lo_product = lo * 0x1b3;
+
+        hi = (hi * 0x1b3 + (lo_product >> 32) + ((lo & 0xffffff) << 8)) & 0xffffffff;
+        hash = (hi << 32) | (lo_product & 0xffffffff);
+    }
+
+    return hash;
+}
+
+static uint64_t hash_file(uint64_t hash, const char *filename) {
+    FILE *file = fopen(filename, "r");
+
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s, reason: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+
+    uint8_t buffer[4096];
+    size_t n;
+
+    hash = hash_bytes(hash, filename, strlen(filename) + 1);
+
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) hash = hash_bytes(hash, buffer, n);
+
+    if (ferror(file)) {
+        fprintf(stderr, "Failed to read %s, reason: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+
+    fclose(file);
+
+    return hash;
+}
+
+static int is_boot_source(const struct dirent *entry) {
+    size_t length = strlen(entry->d_name);
+
+    return length > 4 && (strcmp(entry->d_name + length - 4, ".asm") == 0 || strcmp(entry->d_name + length - 4, ".inc") == 0);
+}
+
+// Everything customasm reads for the boot rom: the generated instruction
+// rules, every rom/*.asm and rom/*.inc in name order, and the generator.
+static uint64_t hash_boot_sources(const char *rules_filename, const char *rom_path) {
+    uint64_t hash = hash_bytes(HASH_INIT, CONTROL_ROMS_VERSION, sizeof(CONTROL_ROMS_VERSION));
+    struct dirent **entries;
+    char filename[256];
+
+    hash = hash_file(hash, rules_filename);
+
+    int n = scandir(rom_path, &entries, is_boot_source, alphasort);
+
+    if (n < 0) {
+        fprintf(stderr, "Failed to list %s, reason: %s\n", rom_path, strerror(errno));
+        exit(1);
+    }
+
+    for (int i = 0; i < n; ++i) {
+        snprintf(filename, sizeof(filename), "%s/%s", rom_path, entries[i]->d_name);
+        hash = hash_file(hash, filename);
+        free(entries[i]);
+    }
+
+    free(entries);
+
+    return hash;
+}
+
+// True if filename exists with exactly these contents. Outputs that would not
+// change are left alone so their timestamps stay stable.
+static bool is_file_content(const char *filename, const void *contents, size_t size) {
+    FILE *file = fopen(filename, "r");
+
+    if (file == NULL) return false;
+
+    uint8_t buffer[4096];
+    const uint8_t *expected = contents;
+    size_t at = 0;
+    size_t n;
+    bool same = true;
+
+    while (same && (n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        same = n <= size - at && memcmp(buffer, expected + at, n) == 0;
+        at += n;
+    }
+
+    fclose(file);
+
+    return same && at == size;
+}
+
 static void write_customasm(const char *filename_prefix, const char *link_path, const char *filename, bool link) {
     char contents[4096*2];
 
@@ -1355,23 +1569,25 @@ static void write_customasm(const char *filename_prefix, const char *link_path,
 
     snprintf(buffer, 256, "%s.inc", filename_prefix);
 
-    FILE *file = fopen(buffer, "w");
+    if (!is_file_content(buffer, contents, content_len)) {
+        FILE *file = fopen(buffer, "w");
 
-    if (file == NULL) {
-        fprintf(stderr, "Failed to open %s, reason: %s\n", buffer, strerror(errno));
-        exit(1);
-    }
+        if (file == NULL) {
+            fprintf(stderr, "Failed to open %s, reason: %s\n", buffer, strerror(errno));
+            exit(1);
+        }
 
-    size_t write_result = fwrite(contents, content_len, 1, file);
+        size_t write_result = fwrite(contents, content_len, 1, file);
 
-    if (write_result != 1) {
-        fprintf(stderr, "Failed to write to file %s, reason: %s\n", buffer, strerror(errno));
-        exit(1);
-    }
+        if (write_result != 1) {
+            fprintf(stderr, "Failed to write to file %s, reason: %s\n", buffer, strerror(errno));
+            exit(1);
+        }
 
-    if (fclose(file) != 0) {
-        fprintf(stderr, "Failed to close file %s, reason: %s\n", buffer, strerror(errno));
-        exit(1);
+        if (fclose(file) != 0) {
+            fprintf(stderr, "Failed to close file %s, reason: %s\n", buffer, strerror(errno));
+            exit(1);
+        }
     }
 
     if (link) {
@@ -1425,6 +1641,8 @@ static bool read_rom(size_t size, uint8_t rom[size], const char *filename) {
 }
 
 static void write_rom(size_t size, uint8_t rom[size], const char *filename) {
+    if (is_file_content(filename, rom, size)) return;
+
     FILE *file = fopen(filename, "w");
 
     if (file == NULL) {
@@ -1445,28 +1663,92 @@ static void write_rom(size_t size, uint8_t rom[size], const char *filename) {
     }
 }
 
-static bool is_alu_identical(uint8_t a[ALU_ROM_SIZE], uint8_t b[ALU_ROM_SIZE]) {
-    for (int i = 0; i < ALU_ROM_SIZE; ++i)
-        if (a[i] != b[i]) return false;
+// Intel HEX of rom[offset, offset + size), minipro writes only the bytes in
+// it. The extended linear address record carries A16 and up.
+static void write_sector_hex(const char *filename, const uint8_t *rom, uint32_t offset, uint32_t size) {
+    FILE *file = fopen(filename, "w");
 
-    return true;
-}
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s, reason: %s\n", filename, strerror(errno));
+        exit(1);
+    }
 
-static bool is_control0_identical(uint8_t a[CONTROL_ROM_SIZE], uint8_t b[CONTROL_ROM_SIZE]) {
-    for (int i = 0; i < (CONTROL_ROM_SIZE >> 1); ++i)
-        if (a[i] != b[i]) return false;
+    for (uint32_t address = offset; address < offset + size; address += 16) {
+        if (address == offset || (address & 0xffff) == 0) {
+            uint8_t hi = (uint8_t)(address >> 24), lo = (uint8_t)(address >> 16);
 
-    return true;
+            fprintf(file, ":02000004%02X%02X%02X\n", hi, lo, (uint8_t)(0x100 - ((0x06 + hi + lo) & 0xff)));
+        }
+
+        uint32_t sum = 0x10 + ((address >> 8) & 0xff) + (address & 0xff);
+
+        fprintf(file, ":10%04X00", address & 0xffff);
+
+        for (uint32_t i = 0; i < 16; ++i) {
+            fprintf(file, "%02X", rom[address + i]);
+            sum += rom[address + i];
+        }
+
+        fprintf(file, "%02X\n", (uint8_t)(0x100 - (sum & 0xff)));
+    }
+
+    fprintf(file, ":00000001FF\n");
+
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Failed to close file %s, reason: %s\n", filename, strerror(errno));
+        exit(1);
+    }
 }
 
-static bool is_control1_identical(uint8_t a[CONTROL_ROM_SIZE], uint8_t b[CONTROL_ROM_SIZE]) {
-    for (int i = 0; i < (CONTROL_ROM_SIZE >> 1); ++i)
-        if (a[i | (1 << 16)] != b[i | (1 << 16)]) return false;
+// Appends a line per run of changed sectors to patch, and writes the run to
+// sectors/<chip>-<offset>.hex. A run that only clears bits of what is burned
+// is "program", it can be written over the chip without an erase. Anything
+// else, or without a burned image, is "erase".
+static int diff_sectors(const char *chip, const uint8_t *burned, const uint8_t *rom, uint32_t offset, uint32_t size, char *patch, size_t patch_size) {
+    int n = 0;
+    uint32_t run_start = 0;
+    bool in_run = false;
+    bool run_erase = false;
+
+    for (uint32_t sector = offset; sector <= offset + size; sector += ROM_SECTOR_SIZE) {
+        bool changed = sector < offset + size
+                    && (burned == NULL || memcmp(&burned[sector], &rom[sector], ROM_SECTOR_SIZE) != 0);
+
+        if (changed) {
+            ++n;
+
+            if (!in_run) {
+                run_start = sector;
+                run_erase = burned == NULL;
+            }
 
-    return true;
+            for (uint32_t i = sector; i < sector + ROM_SECTOR_SIZE && !run_erase; ++i)
+                run_erase = (rom[i] & ~burned[i]) != 0;
+        } else if (in_run) {
+            char hex[64];
+            char line[128];
+
+            snprintf(hex, sizeof(hex), "sectors/%s-0x%05x.hex", chip, run_start);
+            write_sector_hex(hex, rom, run_start, sector - run_start);
+
+            snprintf(line, sizeof(line), "%s 0x%05x 0x%05x %s %s\n", chip, run_start, sector - run_start,
+                run_erase ? "erase" : "program", hex);
+
+            if (strlcat(patch, line, patch_size) >= patch_size) {
+                fprintf(stderr, "Sector list too big\n");
+                exit(1);
+            }
+        }
+
+        in_run = changed;
+    }
+
+    return n;
 }
 
 #include "control_roms_test_instructions.h"
+#include "control_roms_test_reference.h"
+#include "control_roms_lint.h"
 
 int main(void) {
     uint8_t alu[ALU_ROM_SIZE];
@@ -1477,11 +1759,34 @@ int main(void) {
     uint8_t boot_rom[0x1000] = {0};
 
     write_customasm("custom-cpu", "./build/", "../custom-cpu.inc", false);
-    compile_boot_program("boot.asm", "rom/boot.bin");
 
-    if (!read_rom(BOOT_ROM_SIZE, boot_rom, "rom/boot.bin")) {
-        fprintf(stderr, "Failed to read boot rom, reason: %s\n", strerror(errno));
-        exit(1);
+    // Boot roms are cached by the hash of their sources, customasm only runs
+    // for sources not seen before.
+    char cached_boot_rom[64];
+
+    snprintf(cached_boot_rom, sizeof(cached_boot_rom), "rom/cache/boot-%016llx.bin",
+        (unsigned long long)hash_boot_sources("custom-cpu.inc", "../rom"));
+
+    printf("%-32s", "boot rom");
+
+    if (read_rom(BOOT_ROM_SIZE, boot_rom, cached_boot_rom)) {
+        printf("cached\n");
+        write_rom(BOOT_ROM_SIZE, boot_rom, "rom/boot.bin");
+    } else {
+        printf("compiled\n");
+        compile_boot_program("boot.asm", "rom/boot.bin");
+
+        if (!read_rom(BOOT_ROM_SIZE, boot_rom, "rom/boot.bin")) {
+            fprintf(stderr, "Failed to read boot rom, reason: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        if (mkdir("rom/cache", 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Failed to create rom/cache, reason: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        write_rom(BOOT_ROM_SIZE, boot_rom, cached_boot_rom);
     }
 
     fill_alu_boot_rom(alu, boot_rom);
@@ -1489,25 +1794,64 @@ int main(void) {
     uint8_t control[CONTROL_ROM_SIZE];
 
     fill_control(control);
+    lint_control(control);
 
-    test_instructions(control, alu);
+    // The tests only depend on the roms and the generator, they are skipped
+    // when both are the same as the last run that passed.
+    uint64_t roms_hash = hash_bytes(HASH_INIT, CONTROL_ROMS_VERSION, sizeof(CONTROL_ROMS_VERSION));
+    char verified[32];
 
-    uint8_t burned_alu[ALU_ROM_SIZE];
+    roms_hash = hash_bytes(roms_hash, alu, ALU_ROM_SIZE);
+    roms_hash = hash_bytes(roms_hash, control, CONTROL_ROM_SIZE);
+
+    int verified_len = snprintf(verified, sizeof(verified), "%016llx\n", (unsigned long long)roms_hash);
 
-    if (read_rom(ALU_ROM_SIZE, burned_alu, "custom-cpu_alu.bin.burned")) {
-        if (!is_alu_identical(burned_alu, alu)) printf("ALU needs to re-burned.\n");
+    if (is_file_content("control_roms.verified", verified, (size_t)verified_len)) {
+        printf("%-32s%s\n", "instruction tests", "skipped, roms verified before");
+    } else {
+        test_instructions(control, alu);
+        test_reference(control, alu);
+
+        write_rom((size_t)verified_len, (uint8_t *)verified, "control_roms.verified");
     }
 
+    // Sectors that differ from what was last burned, for burn_alu.zsh and
+    // burn_control.zsh to skip chips that are unchanged.
+    char sectors[16384] = "# chip offset size erase|program hex, of each run of changed 4 KiB sectors\n";
+
+    if (mkdir("sectors", 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create sectors, reason: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    uint8_t burned_alu[ALU_ROM_SIZE];
+    bool has_burned_alu = read_rom(ALU_ROM_SIZE, burned_alu, "custom-cpu_alu.bin.burned");
+
+    int alu_sectors = diff_sectors("ALU", has_burned_alu ? burned_alu : NULL, alu, 0, ALU_ROM_SIZE, sectors, sizeof(sectors));
+
+    if (has_burned_alu && alu_sectors > 0) printf("ALU needs to re-burned, %d of %d sectors changed.\n", alu_sectors, ALU_ROM_SIZE / ROM_SECTOR_SIZE);
+
     write_rom(ALU_ROM_SIZE, alu, "custom-cpu_alu.bin");
 
+    // Both control chips are burned with the whole image, A16 selects the half
+    // each of them uses.
     uint8_t burned_control[CONTROL_ROM_SIZE];
+    bool has_burned_control = read_rom(CONTROL_ROM_SIZE, burned_control, "custom-cpu_control.bin.burned");
+
+    for (int chip = 0; chip < 2; ++chip) {
+        char name[16];
+
+        snprintf(name, sizeof(name), "CONTROL%d", chip);
 
-    if (read_rom(CONTROL_ROM_SIZE, burned_control, "custom-cpu_control.bin.burned")) {
-        if (!is_control0_identical(burned_control, control)) printf("CONTROL0 needs to re-burned.\n");
-        if (!is_control1_identical(burned_control, control)) printf("CONTROL1 needs to re-burned.\n");
+        int n = diff_sectors(name, has_burned_control ? burned_control : NULL, control,
+            (uint32_t)chip << 16, CONTROL_ROM_SIZE >> 1, sectors, sizeof(sectors));
+
+        if (has_burned_control && n > 0) printf("%s needs to re-burned, %d of %d sectors changed.\n", name, n, (CONTROL_ROM_SIZE >> 1) / ROM_SECTOR_SIZE);
     }
 
     write_rom(CONTROL_ROM_SIZE, control, "custom-cpu_control.bin");
 
+    write_rom(strlen(sectors), (uint8_t *)sectors, "custom-cpu.sectors");
+
     return 0;
 }
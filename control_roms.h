@@ -34,4 +34,6 @@ typedef enum {
 #define ALU_ROM_SIZE     (1 << 19)
 #define BOOT_ROM_SIZE    0x1000
 
+#define ROM_SECTOR_SIZE  0x1000 // Smallest erasable unit of the SST39SF010/040
+
 #endif
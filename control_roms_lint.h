@@ -0,0 +1,346 @@
+// Microcode lint, reports steps that cost cycles without an effect on the
+// next instruction. Only reports, the roms are written either way.
+
+// What a step reads or loads, the register file slots are each their own.
+#define LINT_C        (1 << 0)
+#define LINT_T        (1 << 1)
+#define LINT_ML       (1 << 2)
+#define LINT_MH       (1 << 3)
+#define LINT_REG(r)   (1 << (4 + ((r) & 0x7)))
+#define LINT_REGS     (0xff << 4)
+
+// Live at the end of every instruction. C selects M for the fetch, A to E
+// and T are the registers. T and the scratch slots are added by
+// lint_live_out when an instruction reads them before it loads them.
+#define LINT_LIVE_OUT (LINT_C | LINT_ML | LINT_MH | (0x3f << 4))
+
+#define LINT_MAX_FINDINGS 256
+
+static const char *LINT_REG_NAME[8] = {"A", "B", "C", "D", "E", "T", "T_ML", "T_MH"};
+
+typedef struct {
+    uint16_t reads;
+    uint16_t loads;      // Overwritten for sure.
+    uint16_t increments; // INC_M, ML and MH only when ML wraps.
+    bool has_effect;     // Memory through M, io, opcode or flags.
+} LintStep;
+
+typedef struct {
+    char text[96];
+    int cycles;
+    uint8_t flags;       // One bit per value of F_Z | F_C | F_S.
+} LintFinding;
+
+typedef struct {
+    uint16_t signals[16];
+    LintStep steps[16];
+    uint16_t live_after[16];
+    bool is_live[16];
+    uint8_t end;         // Step with C_LD_S, or 15.
+    bool has_ld_s;
+} LintInstr;
+
+static uint16_t lint_signals(const uint8_t control[CONTROL_ROM_SIZE], uint8_t o, uint8_t f, uint8_t s) {
+    uint16_t address = (uint16_t)((f << 12) | (s << 8) | o);
+
+    return (uint16_t)((control[(1 << 16) | address] << 8) | control[address]) ^ S_ACTIVE_LOW_MASK;
+}
+
+// C selects M after the fetch, its low bits are only known after a LD_C
+// of the instruction.
+static LintStep lint_step(uint16_t signals, uint8_t *c) {
+    LintStep step = {0};
+
+    bool sel_c = *c & 0x8;
+    uint16_t mem = sel_c ? LINT_REG(*c) : (LINT_ML | LINT_MH);
+
+    if (signals & OE_MEM) step.reads |= LINT_C | mem | (sel_c ? 0 : LINT_REGS);
+    if (signals & OE_T)   step.reads |= LINT_T;
+    if (signals & OE_C)   step.reads |= LINT_C;
+    if (signals & OE_ALU) step.reads |= LINT_C | LINT_ML | LINT_MH;
+
+    if (signals & OE_IO) {
+        step.reads |= LINT_C;
+        step.has_effect = true;
+    }
+
+    if (signals & LD_MEM) {
+        step.reads |= LINT_C | (sel_c ? 0 : mem);
+
+        if (sel_c) step.loads |= LINT_REG(*c);
+        else step.has_effect = true;
+    }
+
+    if (signals & LD_T)  step.loads |= LINT_T;
+    if (signals & LD_ML) step.loads |= LINT_ML;
+    if (signals & LD_MH) step.loads |= LINT_MH;
+    if (signals & LD_F)  step.has_effect = true;
+
+    if ((signals & INC_M) && !(signals & LD_ML)) {
+        step.reads |= LINT_ML | LINT_MH;
+        step.increments |= (signals & LD_MH) ? LINT_ML : (LINT_ML | LINT_MH);
+    }
+
+    if (signals & LD_C) {
+        step.loads |= LINT_C;
+
+        *c = (uint8_t)(((signals & SEL_C) ? 8 : 0) | ((signals >> 12) & 0x7));
+    } else if (IS_LD_O(signals) || IS_LD_IO(signals)) {
+        step.has_effect = true;
+    }
+
+    return step;
+}
+
+// Steps back to front, a step is live when it has an effect or loads what
+// a live step after it reads. Reads of dead steps keep nothing alive.
+static void lint_liveness(LintInstr *instr, uint16_t live_out) {
+    uint16_t live = live_out;
+
+    for (int s = instr->end; s > 0; --s) {
+        const LintStep *step = &instr->steps[s];
+
+        instr->live_after[s] = live;
+        instr->is_live[s] = step->has_effect || ((step->loads | step->increments) & live);
+
+        if (instr->is_live[s]) live = (uint16_t)((live & ~step->loads) | step->reads);
+    }
+
+    instr->live_after[0] = live;
+}
+
+static void lint_decode(const uint8_t control[CONTROL_ROM_SIZE], uint8_t o, uint8_t f, LintInstr *instr) {
+    uint8_t c = 0;
+
+    instr->end = 15;
+    instr->has_ld_s = false;
+
+    for (uint8_t s = 1; s < 16; ++s) {
+        instr->signals[s] = lint_signals(control, o, f, s);
+
+        if (s > instr->end) continue;
+
+        instr->steps[s] = lint_step(instr->signals[s], &c);
+
+        if (IS_LD_S(instr->signals[s])) {
+            instr->end = s;
+            instr->has_ld_s = true;
+        }
+    }
+}
+
+// T and the scratch slots of the register file are only live across
+// instructions when one of them is read before it is loaded, like the
+// return address CALL_I16_BEGIN leaves for CALL_I16_END.
+static uint16_t lint_live_out(const uint8_t control[CONTROL_ROM_SIZE]) {
+    uint16_t live_out = LINT_LIVE_OUT;
+
+    for (int o = 0; o < 0x100; ++o) {
+        if (customasm_rule_from_opcode((O)o) == NULL) continue;
+
+        for (uint8_t f = F_I; f < 0x10; ++f) {
+            LintInstr instr;
+
+            lint_decode(control, (uint8_t)o, f, &instr);
+            lint_liveness(&instr, 0xffff);
+
+            uint16_t loaded = 0;
+
+            for (int s = 1; s <= instr.end; ++s) {
+                if (!instr.is_live[s]) continue;
+
+                live_out |= (uint16_t)(instr.steps[s].reads & ~loaded);
+                loaded |= instr.steps[s].loads;
+            }
+        }
+    }
+
+    return live_out;
+}
+
+static void lint_add(LintFinding findings[LINT_MAX_FINDINGS], int *n, uint8_t f, int cycles, const char *text) {
+    for (int i = 0; i < *n; ++i) {
+        if (strcmp(findings[i].text, text) == 0) {
+            findings[i].flags |= (uint8_t)(1 << (f & 0x7));
+            return;
+        }
+    }
+
+    if (*n == LINT_MAX_FINDINGS) {
+        fprintf(stderr, "Too many lint findings\n");
+        exit(1);
+    }
+
+    LintFinding *finding = &findings[(*n)++];
+
+    snprintf(finding->text, sizeof(finding->text), "%s", text);
+    finding->cycles = cycles;
+    finding->flags = (uint8_t)(1 << (f & 0x7));
+}
+
+// What a load of a dead step is lost to, the first live step after it that
+// loads it again, or the end of the instruction.
+static int lint_dead_loads(const LintInstr *instr, uint8_t s, char *buffer, size_t size) {
+    uint16_t dead = (uint16_t)((instr->steps[s].loads | instr->steps[s].increments) & ~instr->live_after[s]);
+    int len = 0;
+
+    for (int bit = 0; bit < 12 && dead != 0; ++bit) {
+        uint16_t r = (uint16_t)(1 << bit);
+
+        if (!(dead & r)) continue;
+
+        dead &= (uint16_t)~r;
+
+        char what[16];
+
+        if      (r == LINT_C)  snprintf(what, sizeof(what), "C");
+        else if (r == LINT_T)  snprintf(what, sizeof(what), "T");
+        else if (r == LINT_ML) snprintf(what, sizeof(what), "ML");
+        else if (r == LINT_MH) snprintf(what, sizeof(what), "MH");
+        else snprintf(what, sizeof(what), "%s", LINT_REG_NAME[bit - 4]);
+
+        int by = 0;
+
+        for (int after = s + 1; after <= instr->end && by == 0; ++after)
+            if (instr->is_live[after] && (instr->steps[after].loads & r)) by = after;
+
+        int n = by != 0
+            ? snprintf(buffer + len, size - (size_t)len, ", %s overwritten at step %x", what, by)
+            : snprintf(buffer + len, size - (size_t)len, ", %s never read", what);
+
+        if (n < 0 || (size_t)(len + n) >= size) break;
+
+        len += n;
+    }
+
+    return len;
+}
+
+static int lint_instr(const LintInstr *instr, uint8_t f, LintFinding findings[LINT_MAX_FINDINGS], int *n) {
+    char text[96];
+    char dead[80];
+    int cycles = 0;
+
+    uint8_t last = 0;
+
+    for (uint8_t s = 1; s <= instr->end; ++s)
+        if (instr->is_live[s]) last = s;
+
+    for (uint8_t s = 1; s < last; ++s) {
+        dead[0] = '\0';
+        lint_dead_loads(instr, s, dead, sizeof(dead));
+
+        if (!instr->is_live[s]) {
+            snprintf(text, sizeof(text), "step %x has no effect%s", s, dead);
+            lint_add(findings, n, f, 1, text);
+            ++cycles;
+        } else if (dead[0] != '\0') {
+            snprintf(text, sizeof(text), "step %x loads a value that is lost%s", s, dead);
+            lint_add(findings, n, f, 0, text);
+        }
+    }
+
+    // C_LD_S can share the last live step unless that step uses S_C itself.
+    uint16_t last_signals = instr->signals[last];
+    bool shares_ld_s = last > 0 && !(last_signals & (LD_C | S_C0 | S_C1 | S_C2));
+    uint8_t end = last == 0 ? 1 : shares_ld_s ? last : (uint8_t)(last + 1);
+
+    if (end < instr->end) {
+        int wasted = instr->end - end;
+
+        if (instr->has_ld_s) snprintf(text, sizeof(text), "C_LD_S at step %x could be at step %x", instr->end, end);
+        else snprintf(text, sizeof(text), "no C_LD_S, runs 16 steps, could end at step %x", end);
+
+        lint_add(findings, n, f, wasted, text);
+        cycles += wasted;
+    }
+
+    // Microcode left after C_LD_S, words without a load are the default.
+    uint8_t first = 0;
+    uint8_t after = 0;
+
+    for (uint8_t s = (uint8_t)(instr->end + 1); s < 16; ++s) {
+        uint8_t c = 0;
+        LintStep step = lint_step(instr->signals[s], &c);
+
+        if (!step.has_effect && !step.loads && !step.increments) continue;
+
+        if (first == 0) first = s;
+        after = s;
+    }
+
+    if (first != 0) {
+        snprintf(text, sizeof(text), "steps %x to %x after C_LD_S are never run", first, after);
+        lint_add(findings, n, f, 0, text);
+    }
+
+    return cycles;
+}
+
+// Findings of every instruction for each value of the flags, written to
+// the report. Returns the cycles wasted, the flags wasting most counted.
+static int lint_opcode(const uint8_t control[CONTROL_ROM_SIZE], uint8_t o, uint16_t live_out, char *report, size_t report_size, int *n_findings) {
+    LintFinding findings[LINT_MAX_FINDINGS];
+    int n = 0;
+    int cycles = 0;
+
+    for (uint8_t f = F_I; f < 0x10; ++f) {
+        LintInstr instr;
+
+        lint_decode(control, o, f, &instr);
+        lint_liveness(&instr, live_out);
+
+        int instr_cycles = lint_instr(&instr, f, findings, &n);
+
+        if (instr_cycles > cycles) cycles = instr_cycles;
+    }
+
+    char name[32];
+
+    reference_name(o, name);
+
+    for (int i = 0; i < n; ++i) {
+        char line[192];
+        int len = snprintf(line, sizeof(line), "%02x %-24s %2d  %s", o, name, findings[i].cycles, findings[i].text);
+
+        if (findings[i].flags != 0xff) {
+            len += snprintf(line + len, sizeof(line) - (size_t)len, ", flags");
+
+            for (int f = 0; f < 8; ++f)
+                if (findings[i].flags & (1 << f)) len += snprintf(line + len, sizeof(line) - (size_t)len, " %x", f | F_I);
+        }
+
+        snprintf(line + len, sizeof(line) - (size_t)len, "\n");
+
+        if (strlcat(report, line, report_size) >= report_size) {
+            fprintf(stderr, "Lint report too big\n");
+            exit(1);
+        }
+    }
+
+    *n_findings += n;
+
+    return cycles;
+}
+
+static void lint_control(const uint8_t control[CONTROL_ROM_SIZE]) {
+    printf("%-32s", "microcode lint");
+
+    static char report[1 << 17];
+
+    snprintf(report, sizeof(report), "# opcode, instruction, cycles wasted each time it runs, finding\n");
+
+    uint16_t live_out = lint_live_out(control);
+    int n_findings = 0;
+    int cycles = 0;
+
+    for (int o = 0; o < 0x100; ++o) {
+        if (customasm_rule_from_opcode((O)o) == NULL) continue;
+
+        cycles += lint_opcode(control, (uint8_t)o, live_out, report, sizeof(report), &n_findings);
+    }
+
+    write_rom(strlen(report), (uint8_t *)report, "control_roms.lint");
+
+    printf("%d findings, %d cycles, see control_roms.lint\n", n_findings, cycles);
+}
@@ -0,0 +1,389 @@
+// Reference model of the instruction set, one instruction at a time, written
+// from what each instruction means rather than from its microcode. The
+// differential test in control_roms_test_reference.h runs every opcode
+// through both and compares.
+//
+// The architectural state is the pc, the flags, the io ports and memory. The
+// registers A..E and T live at 0xfff0..0xfff5 and SP at 0xffff. The stack is
+// the page at 0xff00, SP points at the next free byte and the stack grows up.
+// 0xfff6 and 0xfff7 are scratch for the microcode and undefined after every
+// instruction.
+//
+// The model never writes memory, writes are kept apart from the memory it
+// reads so one memory image serves every case.
+
+#define REFERENCE_MAX_WRITES 8
+#define REFERENCE_SP 0xffff
+
+typedef enum {
+    R_A = 0,
+    R_B = 1,
+    R_C = 2,
+    R_D = 3,
+    R_E = 4,
+    R_T = 5,
+} R;
+
+typedef struct {
+    const uint8_t *mem; // Memory before the instruction.
+    uint16_t pc;
+    uint8_t f;
+    uint8_t in[4];      // What a read of each port returns.
+    uint8_t out[4];
+    bool out_written[4];
+
+    int n_writes;
+    uint16_t write_address[REFERENCE_MAX_WRITES];
+    uint8_t write_value[REFERENCE_MAX_WRITES];
+} Reference;
+
+static uint8_t reference_read(const Reference *ref, uint16_t address) {
+    for (int i = ref->n_writes - 1; i >= 0; --i)
+        if (ref->write_address[i] == address) return ref->write_value[i];
+
+    return ref->mem[address];
+}
+
+static void reference_write(Reference *ref, uint16_t address, uint8_t value) {
+    for (int i = 0; i < ref->n_writes; ++i)
+        if (ref->write_address[i] == address) {
+            ref->write_value[i] = value;
+            return;
+        }
+
+    assert(ref->n_writes < REFERENCE_MAX_WRITES);
+
+    ref->write_address[ref->n_writes] = address;
+    ref->write_value[ref->n_writes] = value;
+    ++ref->n_writes;
+}
+
+static uint8_t reference_get(const Reference *ref, R r) {
+    return reference_read(ref, (uint16_t)(0xfff0 | r));
+}
+
+static void reference_set(Reference *ref, R r, uint8_t value) {
+    reference_write(ref, (uint16_t)(0xfff0 | r), value);
+}
+
+static uint8_t reference_fetch(Reference *ref) {
+    return reference_read(ref, ref->pc++);
+}
+
+// Immediates are big endian.
+static uint16_t reference_fetch16(Reference *ref) {
+    uint8_t hi = reference_fetch(ref);
+    uint8_t lo = reference_fetch(ref);
+
+    return (uint16_t)((hi << 8) | lo);
+}
+
+static void reference_push(Reference *ref, uint8_t value) {
+    uint8_t sp = reference_read(ref, REFERENCE_SP);
+
+    reference_write(ref, (uint16_t)(0xff00 | sp), value);
+    reference_write(ref, REFERENCE_SP, (uint8_t)(sp + 1));
+}
+
+static uint8_t reference_pop(Reference *ref) {
+    uint8_t sp = (uint8_t)(reference_read(ref, REFERENCE_SP) - 1);
+    uint8_t value = reference_read(ref, (uint16_t)(0xff00 | sp));
+
+    reference_write(ref, REFERENCE_SP, sp);
+
+    return value;
+}
+
+static uint8_t reference_flags(uint8_t q, bool cf) {
+    return (uint8_t)(F_I | (q == 0 ? F_Z : 0) | (cf ? F_C : 0) | ((q & 0x80) ? F_S : 0));
+}
+
+// Z, C and S of ls + rs.
+static uint8_t reference_add(Reference *ref, uint8_t ls, uint8_t rs) {
+    uint8_t q = (uint8_t)(ls + rs);
+
+    ref->f = reference_flags(q, ls + rs > 0xff);
+
+    return q;
+}
+
+// Z and S of q, C cleared.
+static uint8_t reference_logic(Reference *ref, uint8_t q) {
+    ref->f = reference_flags(q, false);
+
+    return q;
+}
+
+static void reference_jump(Reference *ref, bool jump) {
+    uint16_t target = reference_fetch16(ref);
+
+    if (jump) ref->pc = target;
+}
+
+// Runs the instruction at pc. Returns false for what is not an instruction on
+// its own: the end of call, which call runs, and bit moves with an operand
+// the assembler never emits.
+static bool reference_step(Reference *ref) {
+    uint8_t o = reference_fetch(ref);
+    bool zf = ref->f & F_Z;
+    bool cf = ref->f & F_C;
+    bool sf = ref->f & F_S;
+
+    switch ((O)o) {
+
+    case O_NOP:
+    case O_NOP2:
+    case O_DEBUG:
+        break;
+
+    case O_DEBUG_I16_N: ref->pc = (uint16_t)(ref->pc + 4); break;
+
+    case O_IN_A_0: reference_set(ref, R_A, ref->in[0]); break;
+    case O_IN_A_1: reference_set(ref, R_A, ref->in[1]); break;
+    case O_IN_A_2: reference_set(ref, R_A, ref->in[2]); break;
+    case O_IN_A_3: reference_set(ref, R_A, ref->in[3]); break;
+
+    case O_OUT_0_A:
+    case O_OUT_1_A:
+    case O_OUT_2_A:
+    case O_OUT_3_A: {
+        int port = o - O_OUT_0_A;
+        ref->out[port] = reference_get(ref, R_A);
+        ref->out_written[port] = true;
+    } break;
+
+    case O_OUT_0_I8:
+    case O_OUT_1_I8:
+    case O_OUT_2_I8:
+    case O_OUT_3_I8: {
+        int port = o - O_OUT_0_I8;
+        ref->out[port] = reference_fetch(ref);
+        ref->out_written[port] = true;
+    } break;
+
+    case O_LD_A_I8: reference_set(ref, R_A, reference_fetch(ref)); break;
+    case O_LD_B_I8: reference_set(ref, R_B, reference_fetch(ref)); break;
+    case O_LD_C_I8: reference_set(ref, R_C, reference_fetch(ref)); break;
+    case O_LD_D_I8: reference_set(ref, R_D, reference_fetch(ref)); break;
+    case O_LD_E_I8: reference_set(ref, R_E, reference_fetch(ref)); break;
+    case O_LD_T_I8: reference_set(ref, R_T, reference_fetch(ref)); break;
+
+    case O_LD_BC_I16:
+        reference_set(ref, R_B, reference_fetch(ref));
+        reference_set(ref, R_C, reference_fetch(ref));
+        break;
+
+    case O_LD_DE_I16:
+        reference_set(ref, R_D, reference_fetch(ref));
+        reference_set(ref, R_E, reference_fetch(ref));
+        break;
+
+    case O_LD_A_FLAGS: reference_set(ref, R_A, ref->f); break;
+    case O_LD_FLAGS_A: ref->f = reference_get(ref, R_A) & 0x0f; break;
+
+    case O_LD_A_B: reference_set(ref, R_A, reference_get(ref, R_B)); break;
+    case O_LD_A_C: reference_set(ref, R_A, reference_get(ref, R_C)); break;
+    case O_LD_A_D: reference_set(ref, R_A, reference_get(ref, R_D)); break;
+    case O_LD_A_E: reference_set(ref, R_A, reference_get(ref, R_E)); break;
+    case O_LD_B_A: reference_set(ref, R_B, reference_get(ref, R_A)); break;
+    case O_LD_B_C: reference_set(ref, R_B, reference_get(ref, R_C)); break;
+    case O_LD_B_E: reference_set(ref, R_B, reference_get(ref, R_E)); break;
+    case O_LD_C_A: reference_set(ref, R_C, reference_get(ref, R_A)); break;
+    case O_LD_C_B: reference_set(ref, R_C, reference_get(ref, R_B)); break;
+    case O_LD_D_A: reference_set(ref, R_D, reference_get(ref, R_A)); break;
+    case O_LD_E_A: reference_set(ref, R_E, reference_get(ref, R_A)); break;
+    case O_LD_E_B: reference_set(ref, R_E, reference_get(ref, R_B)); break;
+
+    case O_LD_AT_BC_A:
+    case O_LD_AT_BC_E:
+    case O_LD_AT_DE_A: {
+        R hi = o == O_LD_AT_DE_A ? R_D : R_B;
+        R lo = o == O_LD_AT_DE_A ? R_E : R_C;
+        R r  = o == O_LD_AT_BC_E ? R_E : R_A;
+        uint16_t address = (uint16_t)((reference_get(ref, hi) << 8) | reference_get(ref, lo));
+
+        reference_write(ref, address, reference_get(ref, r));
+    } break;
+
+    // Absolute addressing goes through T, which is left with the high byte
+    // of the address.
+    case O_LD_AT_I16_A:
+    case O_LD_AT_I16_B:
+    case O_LD_AT_I16_C: {
+        R r = o == O_LD_AT_I16_A ? R_A : o == O_LD_AT_I16_B ? R_B : R_C;
+        uint16_t address = reference_fetch16(ref);
+
+        reference_set(ref, R_T, (uint8_t)(address >> 8));
+        reference_write(ref, address, reference_get(ref, r));
+    } break;
+
+    case O_LD_A_AT_I16:
+    case O_LD_B_AT_I16:
+    case O_LD_C_AT_I16: {
+        R r = o == O_LD_A_AT_I16 ? R_A : o == O_LD_B_AT_I16 ? R_B : R_C;
+        uint16_t address = reference_fetch16(ref);
+
+        reference_set(ref, R_T, (uint8_t)(address >> 8));
+        reference_set(ref, r, reference_read(ref, address));
+    } break;
+
+    case O_LD_B_AT_DE_INC:
+    case O_LD_C_AT_DE_INC:
+    case O_LD_AT_DE_INC_A:
+    case O_LD_AT_DE_INC_I8: {
+        uint16_t de = (uint16_t)((reference_get(ref, R_D) << 8) | reference_get(ref, R_E));
+
+        if      (o == O_LD_B_AT_DE_INC)  reference_set(ref, R_B, reference_read(ref, de));
+        else if (o == O_LD_C_AT_DE_INC)  reference_set(ref, R_C, reference_read(ref, de));
+        else if (o == O_LD_AT_DE_INC_A)  reference_write(ref, de, reference_get(ref, R_A));
+        else                             reference_write(ref, de, reference_fetch(ref));
+
+        ++de;
+        reference_set(ref, R_E, (uint8_t)de);
+        reference_set(ref, R_D, (uint8_t)(de >> 8));
+    } break;
+
+    case O_JMP_I16: reference_jump(ref, true); break;
+    case O_JZ_I16:  reference_jump(ref, zf); break;
+    case O_JNZ_I16: reference_jump(ref, !zf); break;
+    case O_JC_I16:  reference_jump(ref, cf); break;
+    case O_JNC_I16: reference_jump(ref, !cf); break;
+    case O_JS_I16:  reference_jump(ref, sf); break;
+    case O_JBE_I16: reference_jump(ref, zf || !cf); break;
+    case O_JAE_I16: reference_jump(ref, zf || cf); break;
+
+    // Decrement adds 0xff, carry is set unless it wrapped around.
+    case O_DEC_A: reference_set(ref, R_A, reference_add(ref, reference_get(ref, R_A), 0xff)); break;
+    case O_DEC_B: reference_set(ref, R_B, reference_add(ref, reference_get(ref, R_B), 0xff)); break;
+    case O_DEC_C: reference_set(ref, R_C, reference_add(ref, reference_get(ref, R_C), 0xff)); break;
+    case O_DEC_D: reference_set(ref, R_D, reference_add(ref, reference_get(ref, R_D), 0xff)); break;
+    case O_DEC_E: reference_set(ref, R_E, reference_add(ref, reference_get(ref, R_E), 0xff)); break;
+    case O_DEC_T: reference_set(ref, R_T, reference_add(ref, reference_get(ref, R_T), 0xff)); break;
+
+    // Borrows when carry is clear, the high byte of a 16 bit decrement.
+    case O_DECC_D:
+        if (!cf) reference_set(ref, R_D, reference_add(ref, reference_get(ref, R_D), 0xff));
+        break;
+
+    case O_INC_A: reference_set(ref, R_A, reference_add(ref, reference_get(ref, R_A), 1)); break;
+    case O_INC_B: reference_set(ref, R_B, reference_add(ref, reference_get(ref, R_B), 1)); break;
+    case O_INC_C: reference_set(ref, R_C, reference_add(ref, reference_get(ref, R_C), 1)); break;
+    case O_INC_D: reference_set(ref, R_D, reference_add(ref, reference_get(ref, R_D), 1)); break;
+
+    case O_INCC_B:
+        if (cf) reference_set(ref, R_B, reference_add(ref, reference_get(ref, R_B), 1));
+        break;
+
+    case O_SHL_A: reference_set(ref, R_A, reference_add(ref, reference_get(ref, R_A), reference_get(ref, R_A))); break;
+    case O_SHL_B: reference_set(ref, R_B, reference_add(ref, reference_get(ref, R_B), reference_get(ref, R_B))); break;
+    case O_SHL_E: reference_set(ref, R_E, reference_add(ref, reference_get(ref, R_E), reference_get(ref, R_E))); break;
+
+    case O_SHLC_B:
+    case O_SHLC_C:
+    case O_SHLC_D:
+    case O_SHLC_E: {
+        R r = (R)(R_B + (o - O_SHLC_B));
+        uint8_t value = reference_get(ref, r);
+
+        reference_set(ref, r, (uint8_t)(reference_add(ref, value, value) | cf));
+    } break;
+
+    case O_SHR_A:
+    case O_SHR_B: {
+        R r = o == O_SHR_A ? R_A : R_B;
+        uint8_t value = reference_get(ref, r);
+
+        reference_set(ref, r, (uint8_t)(value >> 1));
+        ref->f = reference_flags((uint8_t)(value >> 1), value & 1);
+    } break;
+
+    case O_AND_A_I8: reference_set(ref, R_A, reference_logic(ref, reference_get(ref, R_A) & reference_fetch(ref))); break;
+    case O_OR_A_I8:  reference_set(ref, R_A, reference_logic(ref, reference_get(ref, R_A) | reference_fetch(ref))); break;
+    case O_OR_A_B:   reference_set(ref, R_A, reference_logic(ref, reference_get(ref, R_A) | reference_get(ref, R_B))); break;
+
+    case O_OR_A_CF: reference_set(ref, R_A, reference_logic(ref, (uint8_t)(reference_get(ref, R_A) | cf))); break;
+
+    case O_ADD_A_I8: reference_set(ref, R_A, reference_add(ref, reference_get(ref, R_A), reference_fetch(ref))); break;
+    case O_ADD_B_I8: reference_set(ref, R_B, reference_add(ref, reference_get(ref, R_B), reference_fetch(ref))); break;
+    case O_ADD_C_I8: reference_set(ref, R_C, reference_add(ref, reference_get(ref, R_C), reference_fetch(ref))); break;
+    case O_ADD_E_I8: reference_set(ref, R_E, reference_add(ref, reference_get(ref, R_E), reference_fetch(ref))); break;
+
+    case O_ADD_A_B: reference_set(ref, R_A, reference_add(ref, reference_get(ref, R_A), reference_get(ref, R_B))); break;
+    case O_ADD_B_A: reference_set(ref, R_B, reference_add(ref, reference_get(ref, R_B), reference_get(ref, R_A))); break;
+    case O_ADD_B_C: reference_set(ref, R_B, reference_add(ref, reference_get(ref, R_B), reference_get(ref, R_C))); break;
+    case O_ADD_E_A: reference_set(ref, R_E, reference_add(ref, reference_get(ref, R_E), reference_get(ref, R_A))); break;
+
+    // The assembler negates the immediate, flags are of r8 + -i8.
+    case O_CMP_A_I8: reference_add(ref, reference_get(ref, R_A), reference_fetch(ref)); break;
+    case O_CMP_B_I8: reference_add(ref, reference_get(ref, R_B), reference_fetch(ref)); break;
+    case O_CMP_C_I8: reference_add(ref, reference_get(ref, R_C), reference_fetch(ref)); break;
+
+    case O_ADDC_B_I8:
+    case O_ADDC_D_I8: {
+        R r = o == O_ADDC_B_I8 ? R_B : R_D;
+        int sum = reference_get(ref, r) + reference_fetch(ref) + cf;
+
+        reference_set(ref, r, (uint8_t)sum);
+        ref->f = reference_flags((uint8_t)sum, sum > 0xff);
+    } break;
+
+    case O_TESTZ_B: reference_logic(ref, reference_get(ref, R_B)); break;
+
+    case O_PUSH_A: reference_push(ref, reference_get(ref, R_A)); break;
+    case O_PUSH_B: reference_push(ref, reference_get(ref, R_B)); break;
+    case O_PUSH_C: reference_push(ref, reference_get(ref, R_C)); break;
+    case O_PUSH_D: reference_push(ref, reference_get(ref, R_D)); break;
+    case O_PUSH_E: reference_push(ref, reference_get(ref, R_E)); break;
+
+    case O_POP_A: reference_set(ref, R_A, reference_pop(ref)); break;
+    case O_POP_B: reference_set(ref, R_B, reference_pop(ref)); break;
+    case O_POP_C: reference_set(ref, R_C, reference_pop(ref)); break;
+    case O_POP_D: reference_set(ref, R_D, reference_pop(ref)); break;
+    case O_POP_E: reference_set(ref, R_E, reference_pop(ref)); break;
+
+    // call i16 is the begin opcode, i16 and the end opcode. The return
+    // address is pushed high byte first and its low byte is left in T.
+    case O_CALL_I16_BEGIN: {
+        uint16_t target = reference_fetch16(ref);
+
+        if (reference_fetch(ref) != O_CALL_I16_END) return false;
+
+        reference_set(ref, R_T, (uint8_t)ref->pc);
+        reference_push(ref, (uint8_t)(ref->pc >> 8));
+        reference_push(ref, (uint8_t)ref->pc);
+
+        ref->pc = target;
+    } break;
+
+    case O_CALL_I16_END: return false;
+
+    case O_RET: {
+        uint8_t lo = reference_pop(ref);
+        uint8_t hi = reference_pop(ref);
+
+        ref->pc = (uint16_t)((hi << 8) | lo);
+    } break;
+
+    // ld a[wbit], b[rbit] is ld t, ~(1 << wbit) followed by this opcode and
+    // AU_OR_BIT + (wbit << 3 | rbit), the mask in T clears the bit first.
+    case O_LD_A_WBIT_B_RBIT_END:
+    case O_LD_B_WBIT_A_RBIT_END: {
+        R dest = o == O_LD_A_WBIT_B_RBIT_END ? R_A : R_B;
+        R src  = o == O_LD_A_WBIT_B_RBIT_END ? R_B : R_A;
+        uint8_t bits = reference_fetch(ref);
+
+        if (bits < 0x40 || bits >= 0x80) return false;
+
+        uint8_t wbit = (bits >> 3) & 0x7;
+        uint8_t rbit = bits & 0x7;
+        uint8_t bit = (uint8_t)(((reference_get(ref, src) >> rbit) & 1) << wbit);
+
+        reference_set(ref, dest, (uint8_t)((reference_get(ref, dest) & reference_get(ref, R_T)) | bit));
+    } break;
+
+    // Unused opcodes do nothing.
+    default: break;
+    }
+
+    return true;
+}
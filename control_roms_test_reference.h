@@ -0,0 +1,765 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "control_roms_reference.h"
+
+// Differential test of every opcode, the microcode through emulate_next_cycle
+// against the reference model in control_roms_reference.h.
+//
+// Each opcode has a plan of what its result depends on: up to two bytes run
+// over all 256 values, all eight states of Z, C and S when it reads the flags
+// and a set of representative pointers, stack pointers or bit positions. Every
+// other register, immediate and the pc come from a hash of the case, so they
+// differ between cases without multiplying them. Cases are cut into chunks
+// run by one thread per core.
+//
+// After each case the pc, the flags, port 3 and every byte either side wrote
+// or the case set up are compared. Memory is zero apart from what a case sets
+// up and is cleared again after it, so a case costs its cycles only.
+
+#define REFERENCE_CHUNK 4096
+#define REFERENCE_RANDOM_CASES 256
+#define REFERENCE_MAX_TOUCHED 64
+
+typedef enum {
+    TARGET_NONE = -1,
+    TARGET_A = R_A,
+    TARGET_B = R_B,
+    TARGET_C = R_C,
+    TARGET_D = R_D,
+    TARGET_E = R_E,
+    TARGET_T = R_T,
+    TARGET_IMM0,       // First byte after the opcode.
+    TARGET_IMM1,
+    TARGET_AT_POINTER, // The byte the pointer points at.
+    TARGET_STACK1,     // The byte at SP - 1.
+    TARGET_STACK2,     // The byte at SP - 2.
+} Target;
+
+typedef enum {
+    POINTER_NONE,
+    POINTER_BC,
+    POINTER_DE,
+    POINTER_I16,  // The first two bytes after the opcode.
+    POINTER_SP,
+    POINTER_BITS, // The bit positions of the bit moves.
+} Pointer;
+
+typedef struct {
+    const char *skip;  // Why the opcode is not run, or NULL.
+    Target sweep[2];   // Bytes run over 0..255.
+    uint8_t sweep_set; // Bits always set in the first swept byte.
+    Pointer pointer;
+    bool flags;
+    int instructions;
+} ReferencePlan;
+
+// Clear of the programs at REFERENCE_PCS and of the register file.
+static const uint16_t REFERENCE_POINTERS[] = {
+    0x0000, 0x00ff, 0x0100, 0x0fff, 0x2000, 0x7fff, 0x8000, 0xa55a, 0xfeff, 0xff00, 0xffef
+};
+
+#define N_REFERENCE_POINTERS (sizeof(REFERENCE_POINTERS) / sizeof(REFERENCE_POINTERS[0]))
+
+// Every position of a five byte instruction against a page boundary.
+static const uint16_t REFERENCE_PCS[] = { 0x1000, 0x12fd, 0x12fe, 0x12ff };
+
+// Two bytes either way clear of the register file and of wrapping around.
+#define REFERENCE_SP_MIN 0x02
+#define REFERENCE_SP_MAX 0xed
+
+// Microcode known to differ from the model, kept as it is for now. Each is
+// printed on every run and fails the test once it no longer differs, so the
+// entry is removed with the fix.
+typedef struct {
+    O o;
+    const char *reason;
+} ReferenceKnown;
+
+static const ReferenceKnown REFERENCE_KNOWN[] = {
+    { O_ADDC_B_I8, "carry set and b = 0xff loses the carry out, the alu has no carry in" },
+    { O_ADDC_D_I8, "carry set and d = 0xff loses the carry out, the alu has no carry in" },
+};
+
+#define N_REFERENCE_KNOWN (sizeof(REFERENCE_KNOWN) / sizeof(REFERENCE_KNOWN[0]))
+
+static const char *reference_known(uint8_t o) {
+    for (size_t i = 0; i < N_REFERENCE_KNOWN; ++i)
+        if (REFERENCE_KNOWN[i].o == o) return REFERENCE_KNOWN[i].reason;
+
+    return NULL;
+}
+
+static ReferencePlan reference_plan(uint8_t o) {
+    ReferencePlan plan = { .sweep = { TARGET_NONE, TARGET_NONE }, .instructions = 1 };
+
+    switch ((O)o) {
+
+    case O_NOP:
+    case O_NOP2:
+    case O_DEBUG:
+    case O_DEBUG_I16_N:
+    case O_IN_A_3:
+        break;
+
+    case O_IN_A_0:
+    case O_IN_A_1:
+    case O_IN_A_2:
+    case O_OUT_0_A:
+    case O_OUT_1_A:
+    case O_OUT_2_A:
+    case O_OUT_0_I8:
+    case O_OUT_1_I8:
+    case O_OUT_2_I8:
+        plan.skip = "port not emulated";
+        break;
+
+    case O_OUT_3_A: plan.sweep[0] = TARGET_A; break;
+    case O_OUT_3_I8: plan.sweep[0] = TARGET_IMM0; break;
+
+    case O_LD_A_I8:
+    case O_LD_B_I8:
+    case O_LD_C_I8:
+    case O_LD_D_I8:
+    case O_LD_E_I8:
+    case O_LD_T_I8:
+        plan.sweep[0] = TARGET_IMM0;
+        break;
+
+    case O_LD_BC_I16:
+    case O_LD_DE_I16:
+        plan.sweep[0] = TARGET_IMM0;
+        plan.sweep[1] = TARGET_IMM1;
+        break;
+
+    case O_LD_A_FLAGS: plan.flags = true; break;
+
+    // Clearing F_I starts the init sequence over.
+    case O_LD_FLAGS_A:
+        plan.sweep[0] = TARGET_A;
+        plan.sweep_set = F_I;
+        break;
+
+    case O_LD_A_B: plan.sweep[0] = TARGET_B; break;
+    case O_LD_A_C: plan.sweep[0] = TARGET_C; break;
+    case O_LD_A_D: plan.sweep[0] = TARGET_D; break;
+    case O_LD_A_E: plan.sweep[0] = TARGET_E; break;
+    case O_LD_B_A: plan.sweep[0] = TARGET_A; break;
+    case O_LD_B_C: plan.sweep[0] = TARGET_C; break;
+    case O_LD_B_E: plan.sweep[0] = TARGET_E; break;
+    case O_LD_C_A: plan.sweep[0] = TARGET_A; break;
+    case O_LD_C_B: plan.sweep[0] = TARGET_B; break;
+    case O_LD_D_A: plan.sweep[0] = TARGET_A; break;
+    case O_LD_E_A: plan.sweep[0] = TARGET_A; break;
+    case O_LD_E_B: plan.sweep[0] = TARGET_B; break;
+
+    case O_LD_AT_BC_A: plan.sweep[0] = TARGET_A; plan.pointer = POINTER_BC; break;
+    case O_LD_AT_BC_E: plan.sweep[0] = TARGET_E; plan.pointer = POINTER_BC; break;
+    case O_LD_AT_DE_A: plan.sweep[0] = TARGET_A; plan.pointer = POINTER_DE; break;
+
+    case O_LD_AT_I16_A: plan.sweep[0] = TARGET_A; plan.pointer = POINTER_I16; break;
+    case O_LD_AT_I16_B: plan.sweep[0] = TARGET_B; plan.pointer = POINTER_I16; break;
+    case O_LD_AT_I16_C: plan.sweep[0] = TARGET_C; plan.pointer = POINTER_I16; break;
+
+    case O_LD_A_AT_I16:
+    case O_LD_B_AT_I16:
+    case O_LD_C_AT_I16:
+        plan.sweep[0] = TARGET_AT_POINTER;
+        plan.pointer = POINTER_I16;
+        break;
+
+    case O_LD_B_AT_DE_INC:
+    case O_LD_C_AT_DE_INC:
+        plan.sweep[0] = TARGET_AT_POINTER;
+        plan.pointer = POINTER_DE;
+        break;
+
+    case O_LD_AT_DE_INC_A:  plan.sweep[0] = TARGET_A;    plan.pointer = POINTER_DE; break;
+    case O_LD_AT_DE_INC_I8: plan.sweep[0] = TARGET_IMM0; plan.pointer = POINTER_DE; break;
+
+    case O_JMP_I16:
+    case O_JZ_I16:
+    case O_JNZ_I16:
+    case O_JC_I16:
+    case O_JNC_I16:
+    case O_JS_I16:
+    case O_JBE_I16:
+    case O_JAE_I16:
+        plan.flags = true;
+        plan.pointer = POINTER_I16;
+        break;
+
+    case O_DEC_A: plan.sweep[0] = TARGET_A; break;
+    case O_DEC_B: plan.sweep[0] = TARGET_B; break;
+    case O_DEC_C: plan.sweep[0] = TARGET_C; break;
+    case O_DEC_D: plan.sweep[0] = TARGET_D; break;
+    case O_DEC_E: plan.sweep[0] = TARGET_E; break;
+    case O_DEC_T: plan.sweep[0] = TARGET_T; break;
+
+    case O_DECC_D: plan.sweep[0] = TARGET_D; plan.flags = true; break;
+
+    case O_INC_A: plan.sweep[0] = TARGET_A; break;
+    case O_INC_B: plan.sweep[0] = TARGET_B; break;
+    case O_INC_C: plan.sweep[0] = TARGET_C; break;
+    case O_INC_D: plan.sweep[0] = TARGET_D; break;
+
+    case O_INCC_B: plan.sweep[0] = TARGET_B; plan.flags = true; break;
+
+    case O_SHL_A: plan.sweep[0] = TARGET_A; break;
+    case O_SHL_B: plan.sweep[0] = TARGET_B; break;
+    case O_SHL_E: plan.sweep[0] = TARGET_E; break;
+
+    case O_SHLC_B: plan.sweep[0] = TARGET_B; plan.flags = true; break;
+    case O_SHLC_C: plan.sweep[0] = TARGET_C; plan.flags = true; break;
+    case O_SHLC_D: plan.sweep[0] = TARGET_D; plan.flags = true; break;
+    case O_SHLC_E: plan.sweep[0] = TARGET_E; plan.flags = true; break;
+
+    case O_SHR_A: plan.sweep[0] = TARGET_A; break;
+    case O_SHR_B: plan.sweep[0] = TARGET_B; break;
+
+    case O_AND_A_I8:
+    case O_OR_A_I8:
+    case O_ADD_A_I8:
+    case O_CMP_A_I8:
+        plan.sweep[0] = TARGET_A;
+        plan.sweep[1] = TARGET_IMM0;
+        break;
+
+    case O_ADD_B_I8:
+    case O_CMP_B_I8:
+        plan.sweep[0] = TARGET_B;
+        plan.sweep[1] = TARGET_IMM0;
+        break;
+
+    case O_ADD_C_I8:
+    case O_CMP_C_I8:
+        plan.sweep[0] = TARGET_C;
+        plan.sweep[1] = TARGET_IMM0;
+        break;
+
+    case O_ADD_E_I8:
+        plan.sweep[0] = TARGET_E;
+        plan.sweep[1] = TARGET_IMM0;
+        break;
+
+    case O_OR_A_B:
+    case O_ADD_A_B:
+    case O_ADD_B_A:
+        plan.sweep[0] = TARGET_A;
+        plan.sweep[1] = TARGET_B;
+        break;
+
+    case O_ADD_B_C:
+        plan.sweep[0] = TARGET_B;
+        plan.sweep[1] = TARGET_C;
+        break;
+
+    case O_ADD_E_A:
+        plan.sweep[0] = TARGET_E;
+        plan.sweep[1] = TARGET_A;
+        break;
+
+    case O_OR_A_CF: plan.sweep[0] = TARGET_A; plan.flags = true; break;
+
+    case O_ADDC_B_I8:
+        plan.sweep[0] = TARGET_B;
+        plan.sweep[1] = TARGET_IMM0;
+        plan.flags = true;
+        break;
+
+    case O_ADDC_D_I8:
+        plan.sweep[0] = TARGET_D;
+        plan.sweep[1] = TARGET_IMM0;
+        plan.flags = true;
+        break;
+
+    case O_TESTZ_B: plan.sweep[0] = TARGET_B; break;
+
+    case O_PUSH_A: plan.sweep[0] = TARGET_A; plan.pointer = POINTER_SP; break;
+    case O_PUSH_B: plan.sweep[0] = TARGET_B; plan.pointer = POINTER_SP; break;
+    case O_PUSH_C: plan.sweep[0] = TARGET_C; plan.pointer = POINTER_SP; break;
+    case O_PUSH_D: plan.sweep[0] = TARGET_D; plan.pointer = POINTER_SP; break;
+    case O_PUSH_E: plan.sweep[0] = TARGET_E; plan.pointer = POINTER_SP; break;
+
+    case O_POP_A:
+    case O_POP_B:
+    case O_POP_C:
+    case O_POP_D:
+    case O_POP_E:
+        plan.sweep[0] = TARGET_STACK1;
+        plan.pointer = POINTER_SP;
+        break;
+
+    // Both halves, the end opcode is placed after i16.
+    case O_CALL_I16_BEGIN:
+        plan.sweep[0] = TARGET_IMM0;
+        plan.sweep[1] = TARGET_IMM1;
+        plan.instructions = 2;
+        break;
+
+    case O_CALL_I16_END:
+        plan.skip = "run by call";
+        break;
+
+    case O_RET:
+        plan.sweep[0] = TARGET_STACK1;
+        plan.sweep[1] = TARGET_STACK2;
+        break;
+
+    // The source gives a single bit and T the mask, both come from the hash.
+    case O_LD_A_WBIT_B_RBIT_END:
+        plan.sweep[0] = TARGET_A;
+        plan.pointer = POINTER_BITS;
+        break;
+
+    case O_LD_B_WBIT_A_RBIT_END:
+        plan.sweep[0] = TARGET_B;
+        plan.pointer = POINTER_BITS;
+        break;
+
+    default: break;
+    }
+
+    return plan;
+}
+
+static uint32_t reference_pointer_values(Pointer pointer) {
+    switch (pointer) {
+    case POINTER_NONE: return 1;
+    case POINTER_BC:
+    case POINTER_DE:
+    case POINTER_I16:  return N_REFERENCE_POINTERS;
+    case POINTER_SP:   return REFERENCE_SP_MAX - REFERENCE_SP_MIN + 1;
+    case POINTER_BITS: return 0x40;
+    }
+}
+
+static uint32_t reference_cases(const ReferencePlan *plan) {
+    uint32_t cases = (plan->sweep[0] != TARGET_NONE ? 0x100 : 1)
+                   * (plan->sweep[1] != TARGET_NONE ? 0x100 : 1)
+                   * (plan->flags ? 8 : 1)
+                   * reference_pointer_values(plan->pointer);
+
+    return cases == 1 ? REFERENCE_RANDOM_CASES : cases;
+}
+
+static const char *reference_name(uint8_t o, char buffer[32]) {
+    const char *rule = customasm_rule_from_opcode((O)o);
+    const char *end = rule != NULL ? strstr(rule, " =>") : NULL;
+
+    if (end == NULL) snprintf(buffer, 32, "opcode %02x", o);
+    else snprintf(buffer, 32, "%.*s", (int)(end - rule), rule);
+
+    return buffer;
+}
+
+typedef struct {
+    uint8_t o;
+    uint32_t start;
+    uint32_t end;
+} ReferenceChunk;
+
+typedef struct {
+    uint8_t *control;
+    uint8_t *alu;
+    ReferencePlan plans[0x100];
+    ReferenceChunk *chunks;
+    size_t n_chunks;
+    atomic_uint_fast64_t cases;
+    atomic_bool failed[0x100];
+    char failure[0x100][256];
+    pthread_mutex_t failure_lock;
+} ReferenceRun;
+
+typedef struct {
+    ReferenceRun *run;
+    State state;
+
+    int n_setup;
+    uint16_t setup_address[REFERENCE_MAX_TOUCHED];
+    uint8_t setup_value[REFERENCE_MAX_TOUCHED];
+
+    int n_written;
+    uint16_t written[REFERENCE_MAX_TOUCHED];
+
+    uint32_t random;
+} ReferenceWorker;
+
+// xorshift, without multiplies the integer sanitizer would trap on. Bits
+// shifted out are masked off first, -fsanitize=integer checks those too.
+static uint8_t reference_random(ReferenceWorker *worker) {
+    worker->random ^= (worker->random & 0x7ffff) << 13;
+    worker->random ^= worker->random >> 17;
+    worker->random ^= (worker->random & 0x7ffffff) << 5;
+
+    return (uint8_t)(worker->random >> 24);
+}
+
+static void reference_setup(ReferenceWorker *worker, uint16_t address, uint8_t value) {
+    assert(worker->n_setup < REFERENCE_MAX_TOUCHED);
+
+    worker->state.mem[address] = value;
+    worker->setup_address[worker->n_setup] = address;
+    worker->setup_value[worker->n_setup] = value;
+    ++worker->n_setup;
+}
+
+static uint16_t reference_target_address(const ReferenceWorker *worker, Target target, uint16_t pc, uint16_t pointer) {
+    uint8_t sp = worker->state.mem[REFERENCE_SP];
+
+    switch (target) {
+    case TARGET_NONE:       assert(false); return 0;
+    case TARGET_A:
+    case TARGET_B:
+    case TARGET_C:
+    case TARGET_D:
+    case TARGET_E:
+    case TARGET_T:          return (uint16_t)(0xfff0 | target);
+    case TARGET_IMM0:       return (uint16_t)(pc + 1);
+    case TARGET_IMM1:       return (uint16_t)(pc + 2);
+    case TARGET_AT_POINTER: return pointer;
+    case TARGET_STACK1:     return (uint16_t)(0xff00 | (uint8_t)(sp - 1));
+    case TARGET_STACK2:     return (uint16_t)(0xff00 | (uint8_t)(sp - 2));
+    }
+}
+
+static const char *reference_address_name(uint16_t address, char buffer[16]) {
+    static const char *names[] = { "a", "b", "c", "d", "e", "t" };
+
+    if (address >= 0xfff0 && address <= 0xfff5) return names[address & 0xf];
+    if (address == REFERENCE_SP) return "sp";
+
+    snprintf(buffer, 16, "[%04x]", address);
+
+    return buffer;
+}
+
+// Expected value of address after the case, what the reference wrote, what
+// the case set up or zero.
+static uint8_t reference_expected(const ReferenceWorker *worker, const Reference *ref, uint16_t address) {
+    for (int i = ref->n_writes - 1; i >= 0; --i)
+        if (ref->write_address[i] == address) return ref->write_value[i];
+
+    for (int i = worker->n_setup - 1; i >= 0; --i)
+        if (worker->setup_address[i] == address) return worker->setup_value[i];
+
+    return 0;
+}
+
+static bool reference_compare_address(ReferenceWorker *worker, const Reference *ref, uint16_t address, char *message, size_t size) {
+    // Microcode scratch.
+    if (address == 0xfff6 || address == 0xfff7) return true;
+
+    uint8_t expected = reference_expected(worker, ref, address);
+    uint8_t actual = worker->state.mem[address];
+
+    if (actual == expected) return true;
+
+    char buffer[16];
+    snprintf(message, size, "%s is %02x, expected %02x", reference_address_name(address, buffer), actual, expected);
+
+    return false;
+}
+
+// Runs case index of opcode o, returns false with message on a difference.
+static bool reference_case(ReferenceWorker *worker, uint8_t o, uint32_t index, char *message, size_t size) {
+    const ReferencePlan *plan = &worker->run->plans[o];
+    State *state = &worker->state;
+
+    worker->random = ((uint32_t)o << 24) ^ index ^ 0x2545f491;
+    for (int i = 0; i < 4; ++i) reference_random(worker);
+
+    worker->n_setup = 0;
+    worker->n_written = 0;
+
+    uint32_t rest = index;
+    uint8_t flags = reference_random(worker) & 0x7;
+    uint8_t sweep[2] = {0};
+
+    if (plan->flags) { flags = (uint8_t)(rest % 8); rest /= 8; }
+
+    for (int i = 0; i < 2; ++i)
+        if (plan->sweep[i] != TARGET_NONE) { sweep[i] = (uint8_t)(rest % 0x100); rest /= 0x100; }
+
+    sweep[0] |= plan->sweep_set;
+
+    uint32_t pointer_index = rest % reference_pointer_values(plan->pointer);
+    uint16_t pc = REFERENCE_PCS[reference_random(worker) & 0x3];
+
+    for (R r = R_A; r <= R_T; ++r) reference_setup(worker, (uint16_t)(0xfff0 | r), reference_random(worker));
+    reference_setup(worker, REFERENCE_SP, (uint8_t)(REFERENCE_SP_MIN + reference_random(worker) % (REFERENCE_SP_MAX - REFERENCE_SP_MIN + 1)));
+
+    reference_setup(worker, pc, o);
+    for (uint16_t i = 1; i < 5; ++i) reference_setup(worker, (uint16_t)(pc + i), reference_random(worker));
+    if (o == O_CALL_I16_BEGIN) reference_setup(worker, (uint16_t)(pc + 3), O_CALL_I16_END);
+
+    uint16_t pointer = 0;
+
+    switch (plan->pointer) {
+    case POINTER_NONE: break;
+
+    case POINTER_BC:
+    case POINTER_DE:
+    case POINTER_I16: {
+        pointer = REFERENCE_POINTERS[pointer_index];
+
+        uint16_t hi = (uint16_t)(plan->pointer == POINTER_BC ? 0xfff0 | R_B : plan->pointer == POINTER_DE ? 0xfff0 | R_D : pc + 1);
+        uint16_t lo = (uint16_t)(plan->pointer == POINTER_BC ? 0xfff0 | R_C : plan->pointer == POINTER_DE ? 0xfff0 | R_E : pc + 2);
+
+        reference_setup(worker, hi, (uint8_t)(pointer >> 8));
+        reference_setup(worker, lo, (uint8_t)pointer);
+    } break;
+
+    case POINTER_SP:
+        reference_setup(worker, REFERENCE_SP, (uint8_t)(REFERENCE_SP_MIN + pointer_index));
+        break;
+
+    case POINTER_BITS:
+        reference_setup(worker, (uint16_t)(pc + 1), (uint8_t)(0x40 + pointer_index));
+        break;
+    }
+
+    // What the stack and the pointer hold, unless swept below.
+    reference_setup(worker, reference_target_address(worker, TARGET_STACK1, pc, pointer), reference_random(worker));
+    reference_setup(worker, reference_target_address(worker, TARGET_STACK2, pc, pointer), reference_random(worker));
+    if (plan->pointer == POINTER_BC || plan->pointer == POINTER_DE || plan->pointer == POINTER_I16)
+        reference_setup(worker, pointer, reference_random(worker));
+
+    for (int i = 0; i < 2; ++i)
+        if (plan->sweep[i] != TARGET_NONE)
+            reference_setup(worker, reference_target_address(worker, plan->sweep[i], pc, pointer), sweep[i]);
+
+    uint8_t gpo = reference_random(worker);
+
+    state->o = 0;
+    state->s = 0;
+    state->f = F_I | flags;
+    state->c = 0;
+    state->t = reference_random(worker);
+    state->ml = (uint8_t)pc;
+    state->mh = (uint8_t)(pc >> 8);
+    state->gpo = gpo;
+    state->tx = 0;
+    state->tx_bits = 0;
+    state->rx = 0;
+    state->rx_bits = 0;
+    state->rx_tries = 0;
+
+    Reference ref = { .mem = state->mem, .pc = pc, .f = state->f, .in = { 0, 0, 0, GPI_MASK_BIT7_RX } };
+
+    // Printed on a difference only.
+    uint8_t code[5], registers[6];
+
+    for (int i = 0; i < 5; ++i) code[i] = state->mem[(uint16_t)(pc + i)];
+    for (int i = 0; i < 6; ++i) registers[i] = state->mem[0xfff0 | i];
+
+    uint8_t sp = state->mem[REFERENCE_SP];
+    char difference[64];
+    bool ok = true;
+
+    if (!reference_step(&ref)) {
+        snprintf(difference, sizeof(difference), "not an instruction of the reference");
+        ok = false;
+    }
+
+    for (int instruction = 0; ok && instruction < plan->instructions; ++instruction) {
+        bool done = false;
+
+        while (ok && !done) {
+            uint16_t signals = emulate_control_signals(worker->run->control, state);
+            int n_oe = ((signals & OE_MEM) ? 1 : 0)
+                     + ((signals & OE_T)   ? 1 : 0)
+                     + ((signals & OE_IO)  ? 1 : 0)
+                     + ((signals & OE_C)   ? 1 : 0)
+                     + ((signals & OE_ALU) ? 1 : 0);
+
+            bool io_port_3 = (signals & OE_IO)    ? (state->c & 0xf) == 0x8
+                           : IS_LD_IO(signals)    ? (~state->c & 0xf) == 0x8
+                           : true;
+
+            if (n_oe != 1 || !io_port_3) {
+                snprintf(difference, sizeof(difference), "%s at step %x", n_oe != 1 ? "bus conflict" : "io on a port other than 3", state->s);
+                ok = false;
+                break;
+            }
+
+            if (signals & LD_MEM) {
+                assert(worker->n_written < REFERENCE_MAX_TOUCHED);
+                worker->written[worker->n_written++] = emulate_mem_bus(state);
+            }
+
+            done = emulate_next_cycle(false, worker->run->control, worker->run->alu, state);
+        }
+    }
+
+    if (ok) {
+        uint16_t pc_after = (uint16_t)((state->mh << 8) | state->ml);
+        uint8_t gpo_expected = ref.out_written[3] ? ref.out[3] : gpo;
+
+        if (pc_after != ref.pc) {
+            snprintf(difference, sizeof(difference), "pc is %04x, expected %04x", pc_after, ref.pc);
+            ok = false;
+        } else if (state->f != ref.f) {
+            snprintf(difference, sizeof(difference), "flags are %x, expected %x", state->f, ref.f);
+            ok = false;
+        } else if (state->gpo != gpo_expected) {
+            snprintf(difference, sizeof(difference), "port 3 is %02x, expected %02x", state->gpo, gpo_expected);
+            ok = false;
+        } else {
+            for (int i = 0; ok && i < worker->n_setup; ++i)
+                ok = reference_compare_address(worker, &ref, worker->setup_address[i], difference, sizeof(difference));
+
+            for (int i = 0; ok && i < worker->n_written; ++i)
+                ok = reference_compare_address(worker, &ref, worker->written[i], difference, sizeof(difference));
+
+            for (int i = 0; ok && i < ref.n_writes; ++i)
+                ok = reference_compare_address(worker, &ref, ref.write_address[i], difference, sizeof(difference));
+        }
+
+    }
+
+    if (!ok)
+        snprintf(message, size, "pc %04x: %02x %02x %02x %02x %02x, a %02x b %02x c %02x d %02x e %02x t %02x sp %02x f %x, %s",
+            pc, code[0], code[1], code[2], code[3], code[4],
+            registers[0], registers[1], registers[2], registers[3], registers[4], registers[5], sp, F_I | flags, difference);
+
+    for (int i = 0; i < worker->n_setup; ++i) state->mem[worker->setup_address[i]] = 0;
+    for (int i = 0; i < worker->n_written; ++i) state->mem[worker->written[i]] = 0;
+
+    return ok;
+}
+
+// Runs chunks [begin, end), on a worker of its own so threads share nothing
+// but the failures.
+static void reference_chunks(void *context, uint32_t begin, uint32_t end) {
+    ReferenceRun *run = context;
+    ReferenceWorker *worker = calloc(1, sizeof(ReferenceWorker));
+
+    if (worker == NULL) {
+        fprintf(stderr, "Failed to allocate reference worker\n");
+        exit(1);
+    }
+
+    worker->run = run;
+
+    char message[256];
+
+    for (uint32_t i = begin; i < end; ++i) {
+        const ReferenceChunk *chunk = &run->chunks[i];
+
+        for (uint32_t index = chunk->start; index < chunk->end; ++index) {
+            if (atomic_load(&run->failed[chunk->o])) break;
+
+            if (!reference_case(worker, chunk->o, index, message, sizeof(message))) {
+                pthread_mutex_lock(&run->failure_lock);
+
+                if (!atomic_load(&run->failed[chunk->o])) {
+                    snprintf(run->failure[chunk->o], sizeof(run->failure[chunk->o]), "%s", message);
+                    atomic_store(&run->failed[chunk->o], true);
+                }
+
+                pthread_mutex_unlock(&run->failure_lock);
+                break;
+            }
+
+            atomic_fetch_add_explicit(&run->cases, 1, memory_order_relaxed);
+        }
+    }
+
+    free(worker);
+}
+
+static void test_reference(uint8_t control[CONTROL_ROM_SIZE], uint8_t alu[ALU_ROM_SIZE]) {
+    printf("%-32s", "reference model, all opcodes");
+    fflush(stdout);
+
+    static ReferenceRun run;
+
+    run.control = control;
+    run.alu = alu;
+    pthread_mutex_init(&run.failure_lock, NULL);
+
+    size_t capacity = 0;
+
+    for (int o = 0; o < 0x100; ++o) {
+        run.plans[o] = reference_plan((uint8_t)o);
+
+        if (run.plans[o].skip != NULL) continue;
+
+        uint32_t cases = reference_cases(&run.plans[o]);
+
+        for (uint32_t start = 0; start < cases; start += REFERENCE_CHUNK) {
+            if (run.n_chunks == capacity) {
+                capacity = capacity == 0 ? 1024 : 2 * capacity;
+                run.chunks = realloc(run.chunks, capacity * sizeof(ReferenceChunk));
+
+                if (run.chunks == NULL) {
+                    fprintf(stderr, "Failed to allocate reference chunks\n");
+                    exit(1);
+                }
+            }
+
+            uint32_t end = cases - start < REFERENCE_CHUNK ? cases : start + REFERENCE_CHUNK;
+            run.chunks[run.n_chunks++] = (ReferenceChunk){ (uint8_t)o, start, end };
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    parallel_for((uint32_t)run.n_chunks, 1, reference_chunks, &run);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    char name[32];
+    int n_failed = 0;
+
+    for (int o = 0; o < 0x100; ++o) {
+        bool failed = atomic_load(&run.failed[o]);
+        bool known = reference_known((uint8_t)o) != NULL;
+
+        if (failed == known) continue;
+
+        if (n_failed++ == 0) {
+            printf("failed\n");
+            fflush(stdout);
+        }
+
+        if (failed) fprintf(stderr, "%02x %s: %s\n", o, reference_name((uint8_t)o, name), run.failure[o]);
+        else fprintf(stderr, "%02x %s: no longer differs, remove it from REFERENCE_KNOWN\n", o, reference_name((uint8_t)o, name));
+    }
+
+    if (n_failed > 0) exit(1);
+
+    printf("passed, %llu cases on %d threads in %.2f s\n", (unsigned long long)atomic_load(&run.cases), parallel_threads(), seconds);
+
+    for (size_t i = 0; i < N_REFERENCE_KNOWN; ++i) {
+        uint8_t o = (uint8_t)REFERENCE_KNOWN[i].o;
+
+        printf("    known difference, %02x %s: %s\n", o, reference_name(o, name), REFERENCE_KNOWN[i].reason);
+        printf("        %s\n", run.failure[o]);
+    }
+
+    for (int o = 0; o < 0x100; ++o) {
+        const char *skip = run.plans[o].skip;
+        bool first = true;
+
+        if (skip == NULL) continue;
+
+        for (int before = 0; before < o; ++before)
+            if (run.plans[before].skip == skip) first = false;
+
+        if (!first) continue;
+
+        printf("    not run, %s:", skip);
+
+        for (int same = o; same < 0x100; ++same)
+            if (run.plans[same].skip == skip) printf(" %02x", same);
+
+        printf("\n");
+    }
+
+    free(run.chunks);
+}
@@ -17,6 +17,8 @@ typedef struct {
     uint8_t rx;
     uint8_t rx_bits;
     uint8_t rx_tries;
+    uint8_t bus;    // Data bus of the last cycle.
+    uint64_t cycle; // Cycles emulated since power on.
 } State;
 
 #define IS_LD_O(signals)  (((signals) & S_C0) && !((signals) & LD_C))
@@ -79,28 +81,42 @@ static void emulate_print_control_signals(uint8_t s, uint16_t signals) {
     printf("0x%x: %s\n", s, buf);
 }
 
-static bool emulate_next_cycle(
-    bool print_debug_info,
-    uint8_t control[CONTROL_ROM_SIZE],
-    uint8_t alu[ALU_ROM_SIZE],
-    State *state) {
+static inline uint16_t emulate_control_address(const State *state) {
+    return (uint16_t)((state->f << 12) | (state->s << 8) | state->o);
+}
 
-    uint16_t control_address = (uint16_t)((state->f << 12) | (state->s << 8) | state->o);
+// Control signals of the next cycle, active high.
+static inline uint16_t emulate_control_signals(const uint8_t control[CONTROL_ROM_SIZE], const State *state) {
+    uint16_t control_address = emulate_control_address(state);
 
-    uint16_t control_signals = (uint16_t)(
+    return (uint16_t)(
             (control[(1 << 16) | control_address] << 8) |
              control[control_address]
         ) ^ S_ACTIVE_LOW_MASK;
+}
+
+// Memory address of the next cycle, either M or the register selected by C.
+static inline uint16_t emulate_mem_bus(const State *state) {
+    return (state->c & 0x8)
+            ? (0xfff0 | (state->c & 0x7))
+            : (uint16_t)((state->mh << 8) | state->ml);
+}
+
+// Runs one cycle with control_signals from emulate_control_signals, for
+// callers that already looked them up. Returns true at the end of an
+// instruction.
+static bool emulate_next_cycle_signals(
+    bool print_debug_info,
+    uint16_t control_signals,
+    uint8_t alu[ALU_ROM_SIZE],
+    State *state) {
 
     if (print_debug_info) {
         if (state->s > 0) printf("opcode: %02x - flags: %x\n", state->o, state->f);
         emulate_print_control_signals(state->s, control_signals);
     }
 
-    uint16_t mem_bus =
-        (state->c & 0x8)
-            ? (0xfff0 | (state->c & 0x7))
-            : (uint16_t)((state->mh << 8) | state->ml);
+    uint16_t mem_bus = emulate_mem_bus(state);
 
     uint32_t alu_bus = (uint32_t)(
         ((state->c & 0x7) << 16) |
@@ -154,6 +170,8 @@ static bool emulate_next_cycle(
         }
     }
 
+    state->bus = data_bus;
+
     int n_oe = (oe_mem ? 1 : 0)
              + (oe_t   ? 1 : 0)
              + (oe_io  ? 1 : 0)
@@ -229,6 +247,8 @@ static bool emulate_next_cycle(
                             ((control_signals & S_C1)  ? 2 : 0) |
                             ((control_signals & S_C0)  ? 1 : 0);
 
+    ++state->cycle;
+
     bool inc_m = control_signals & INC_M;
 
     if (inc_m & !ld_ml) {
@@ -249,3 +269,12 @@ static bool emulate_next_cycle(
             return false;
     }
 }
+
+static inline bool emulate_next_cycle(
+    bool print_debug_info,
+    uint8_t control[CONTROL_ROM_SIZE],
+    uint8_t alu[ALU_ROM_SIZE],
+    State *state) {
+
+    return emulate_next_cycle_signals(print_debug_info, emulate_control_signals(control, state), alu, state);
+}
@@ -2,8 +2,8 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h> // memcpy
-#include <unistd.h>  // sysconf
-#include <sys/times.h> // times
+#include <unistd.h>  // usleep
+#include <getopt.h> // getopt
 #include <netinet/in.h> // socket
 
 #include "emulate.h"
@@ -72,44 +72,43 @@ static size_t read_program(const char *filepath, uint8_t program[PROGRAM_SIZE])
     return read_bytes;
 }
 
-int main(int argc, char **argv) {
-    uint8_t control[CONTROL_ROM_SIZE];
-    uint8_t alu[ALU_ROM_SIZE];
+static bool load_program(const char *filepath, State *state) {
+    uint8_t program[PROGRAM_SIZE];
+    size_t program_size = read_program(filepath, program);
 
-    if (!read_rom("./build/custom-cpu_control.bin", CONTROL_ROM_SIZE, control) ||
-        !read_rom("./build/custom-cpu_alu.bin",     ALU_ROM_SIZE,     alu)) return 1;
+    if (program_size == 0) return false;
 
-    State state = {0};
+    // jmp {i:i16} => 0x1c @ i;
+    state->mem[0] = O_JMP_I16;
+    state->mem[1] = PROGRAM_START >> 8;
+    state->mem[2] = PROGRAM_START & 0xff;
 
-    printf("running init\n");
+    memcpy(state->mem + PROGRAM_START, program, program_size);
 
-    size_t cycles = 0;
-    for (; !(state.f & F_I); ++cycles)
-        emulate_next_cycle(false, control, alu, &state);
+    printf("loaded %s (%ld)\n", filepath, program_size);
 
-    printf("init done after %zd cycles\n", cycles);
-
-    print_state(&state, 0, 0);
-
-    if (argc > 1) {
-        uint8_t program[PROGRAM_SIZE];
-        size_t program_size = read_program(argv[1], program);
-
-        if (program_size == 0) return 1;
-
-        // jmp {i:i16} => 0x1c @ i;
-        state.mem[0] = O_JMP_I16;
-        state.mem[1] = PROGRAM_START >> 8;
-        state.mem[2] = PROGRAM_START & 0xff;
-
-        memcpy(state.mem + PROGRAM_START, program, program_size);
-
-        printf("boot program skipped, running %s (%ld) directly\n", argv[1], program_size);
-    }
-
-    struct tms tms;
-    double freq = (double)sysconf(_SC_CLK_TCK);
+    return true;
+}
 
+#include "emulator_hot_reload.h"
+#include "emulator_debug_stream.h"
+#include "emulator_watch.h"
+#include "emulator_timeline.h"
+#include "emulator_reverse.h"
+#include "emulator_gdb.h"
+#include "emulator_trace.h"
+#include "emulator_itrace.h"
+#include "emulator_vcd.h"
+#include "emulator_stats.h"
+#include "emulator_symbols.h"
+#include "emulator_profile.h"
+#include "emulator_callgraph.h"
+#include "emulator_steps.h"
+#include "emulator_coverage.h"
+#include "emulator_heatmap.h"
+#include "emulator_latency.h"
+
+static int serial_accept(void) {
     struct sockaddr_in serv_addr = {0};
     serv_addr.sin_family = AF_INET; // IPv4
     serv_addr.sin_addr.s_addr = htonl(INADDR_ANY); // accept connections from any network interface
@@ -143,82 +142,541 @@ int main(int argc, char **argv) {
 
     int clientfd = accept(listenfd, (struct sockaddr *)&client_addr, &client_socklen);
 
+    // Only one connection is served, later ones are refused instead of queued.
+    close(listenfd);
+
     if (clientfd < 0) {
         perror("accept failed\n");
         exit(1);
     }
 
+    return clientfd;
+}
+
+// O_DEBUG and O_DEBUG_I16_N at the end of an instruction, stream is NULL to
+// print the state and wait for enter.
+static void debug_instruction(DebugStream *stream, State *state) {
+    if (state->o == O_DEBUG_I16_N) {
+        uint16_t pc = (uint16_t)(state->mh << 8) | state->ml;
+        uint16_t address = (uint16_t)((state->mem[pc - 4] << 8) | state->mem[pc - 3]);
+        uint16_t n = (uint16_t)(state->mem[pc - 2] << 8) | state->mem[pc - 1];
+
+        if (stream != NULL) {
+            debug_stream_push(stream, state->cycle, state, address, n);
+        } else {
+            print_state(state, address, n);
+            getchar();
+        }
+    }
+    else if (state->o == O_DEBUG) {
+        if (stream != NULL) {
+            debug_stream_push(stream, state->cycle, state, 0, 0);
+        } else {
+            print_state(state, 0, 0);
+            getchar();
+        }
+    }
+}
+
+// Serial io at the end of an instruction, from replay if not NULL or the
+// connection. record, reverse, latency and stats are NULL when not kept.
+// Returns false if recv failed.
+static bool serial_io(State *state, int clientfd, Timeline *replay, FILE *record, Reverse *reverse, Latency *latency, Stats *stats) {
+    if (state->tx_bits == 9) {
+        // printf("sending '%c'\n", state->tx);
+
+        LatencyByte *answered = latency != NULL ? latency_tx(latency, state) : NULL;
+        uint64_t io_start = stats != NULL ? stats_now_ns() : 0;
+
+        if (clientfd >= 0) send(clientfd, &state->tx, 1, 0);
+        else               putchar(state->tx);
+
+        if (stats != NULL) stats->io_ns += stats_now_ns() - io_start;
+
+        if (answered != NULL) answered->sent_ns = stats_now_ns();
+
+        state->tx_bits = 0;
+    }
+
+    if (replay != NULL) {
+        if (timeline_inject(replay, state)) {
+            if (reverse != NULL) reverse_log_rx(reverse, state);
+            if (latency != NULL) latency_injected(latency, state, 0);
+        }
+    } else if (state->rx_bits == 0 && state->mem[(uint16_t)(state->mh << 8) | state->ml] == 0x04) {
+        uint64_t io_start = stats != NULL ? stats_now_ns() : 0;
+        uint8_t recv_byte;
+
+        ssize_t bytes_read = recv(clientfd, &recv_byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+        if (bytes_read > 0) {
+            bytes_read = latency != NULL
+                       ? latency_recv(latency, clientfd, &recv_byte, state)
+                       : recv(clientfd, &recv_byte, 1, MSG_DONTWAIT);
+
+            if (bytes_read < 1) {
+                fprintf(stderr, "expected bytes from recv, got %ld\n", bytes_read);
+                return false;
+            }
+
+            state->rx = recv_byte;
+            state->rx_bits = 1;
+
+            if (reverse != NULL) reverse_log_rx(reverse, state);
+
+            if (record != NULL) {
+                fprintf(record, "%llu rx %02x\n", (unsigned long long)state->cycle, state->rx);
+                fflush(record);
+            }
+
+            // printf("recv: '%c'\n", state->rx);
+        }
+
+        if (stats != NULL) stats->io_ns += stats_now_ns() - io_start;
+    }
+
+    return true;
+}
+
+static void print_usage(const char *name) {
+    fprintf(stderr, "usage: %s [-w] [-s] [-d path] [-g port] [-b MiB] [-r path | -R path] [-t path[:MiB]] [-T path] [-v path [-V options]] [-i seconds] [-I path]\n", name);
+    fprintf(stderr, "       [-P path [-p cycles]] [-C path] [-y symbols] [-u path] [-k path] [-m path[:cycles]] [-l path] [program]\n");
+    fprintf(stderr, "  -w       hot reload roms and program on change\n");
+    fprintf(stderr, "  -s       stop on stack overflow into the register file\n");
+    fprintf(stderr, "  -d path  stream debug instructions to path (or unix:path) instead of pausing\n");
+    fprintf(stderr, "  -g port  wait for gdb on localhost:port before starting emulation\n");
+    fprintf(stderr, "  -b MiB   keep up to MiB of checkpoints for reverse execution in gdb\n");
+    fprintf(stderr, "  -r path  record serial input against emulated cycles to path\n");
+    fprintf(stderr, "  -R path  replay serial input from path without a connection, as fast as possible\n");
+    fprintf(stderr, "  -t path  trace every cycle into a ring buffer file of MiB (default %d), see trace_decode\n", TRACE_DEFAULT_MIB);
+    fprintf(stderr, "  -T path  write a compressed instruction trace of the whole run to path, see itrace_query\n");
+    fprintf(stderr, "  -v path  write control lines, buses and serial io as a value change dump to path\n");
+    fprintf(stderr, "  -V opts  limit the dump with start=<cycle>,gpo=<trigger mask>,cycles=<n>\n");
+    fprintf(stderr, "  -i secs  report throughput counters to stderr every secs seconds\n");
+    fprintf(stderr, "  -I path  serve throughput counters on the unix socket path\n");
+    fprintf(stderr, "  -P path  sample pc and call stack, write folded stacks to path at exit\n");
+    fprintf(stderr, "  -p n     sample every n cycles (default %d)\n", PROFILE_DEFAULT_PERIOD);
+    fprintf(stderr, "  -C path  count calls and cycles per routine, write a report to path and path.callgrind\n");
+    fprintf(stderr, "  -u path  count cycles per microcode step, write utilization by opcode to path\n");
+    fprintf(stderr, "  -k path  merge run control addresses into the coverage bitmap at path, report to path.txt\n");
+    fprintf(stderr, "  -m path  count memory accesses per address and page, working sets per %d cycles or :cycles\n", HEATMAP_DEFAULT_PHASE);
+    fprintf(stderr, "  -l path  measure serial round trip latency per rx byte, write percentiles to path\n");
+    fprintf(stderr, "  -y path  program symbols from customasm -f symbols, besides %s\n", SYMBOLS_DEFAULT_PATH);
+}
+
+int main(int argc, char **argv) {
+    bool hot_reload = false;
+    bool stack_guard = false;
+    const char *debug_stream_path = NULL;
+    uint16_t gdb_port = 0;
+    size_t reverse_budget = 0;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    char *trace_path = NULL;
+    const char *itrace_path = NULL;
+    const char *vcd_path = NULL;
+    char *vcd_options = NULL;
+    double stats_interval = 0;
+    const char *stats_path = NULL;
+    const char *profile_path = NULL;
+    uint64_t profile_period = PROFILE_DEFAULT_PERIOD;
+    const char *symbols_path = NULL;
+    const char *callgraph_path = NULL;
+    const char *steps_path = NULL;
+    const char *coverage_path = NULL;
+    char *heatmap_path = NULL;
+    const char *latency_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "wsd:g:b:r:R:t:T:v:V:i:I:P:p:y:C:u:k:m:l:")) != -1) {
+        switch (opt) {
+        case 'w': hot_reload = true; break;
+        case 's': stack_guard = true; break;
+        case 'd': debug_stream_path = optarg; break;
+        case 'g': gdb_port = (uint16_t)strtoul(optarg, NULL, 10); break;
+        case 'b': reverse_budget = strtoul(optarg, NULL, 10) << 20; break;
+        case 'r': record_path = optarg; break;
+        case 'R': replay_path = optarg; break;
+        case 't': trace_path = optarg; break;
+        case 'T': itrace_path = optarg; break;
+        case 'v': vcd_path = optarg; break;
+        case 'V': vcd_options = optarg; break;
+        case 'i': stats_interval = strtod(optarg, NULL); break;
+        case 'I': stats_path = optarg; break;
+        case 'P': profile_path = optarg; break;
+        case 'p': profile_period = strtoull(optarg, NULL, 10); break;
+        case 'y': symbols_path = optarg; break;
+        case 'C': callgraph_path = optarg; break;
+        case 'u': steps_path = optarg; break;
+        case 'k': coverage_path = optarg; break;
+        case 'm': heatmap_path = optarg; break;
+        case 'l': latency_path = optarg; break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (record_path != NULL && replay_path != NULL) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    const char *program_path = optind < argc ? argv[optind] : NULL;
+
+    uint8_t control[CONTROL_ROM_SIZE];
+    uint8_t alu[ALU_ROM_SIZE];
+
+    if (!read_rom("./build/custom-cpu_control.bin", CONTROL_ROM_SIZE, control) ||
+        !read_rom("./build/custom-cpu_alu.bin",     ALU_ROM_SIZE,     alu)) return 1;
+
+    State state = {0};
+
+    printf("running init\n");
+
+    size_t cycles = 0;
+    for (; !(state.f & F_I); ++cycles)
+        emulate_next_cycle(false, control, alu, &state);
+
+    printf("init done after %zd cycles\n", cycles);
+
+    print_state(&state, 0, 0);
+
+    State boot_state = state;
+
+    if (program_path != NULL) {
+        if (!load_program(program_path, &state)) return 1;
+
+        printf("boot program skipped, running %s directly\n", program_path);
+    }
+
+    HotReload reload = {0};
+
+    if (hot_reload) {
+        hot_reload_watch(&reload.control, "./build/custom-cpu_control.bin");
+        hot_reload_watch(&reload.alu,     "./build/custom-cpu_alu.bin");
+
+        if (program_path != NULL) hot_reload_watch(&reload.program, program_path);
+
+        printf("watching roms%s for changes\n", program_path != NULL ? " and program" : "");
+    }
+
+    static DebugStream debug_stream;
+
+    if (debug_stream_path != NULL) {
+        if (!debug_stream_start(&debug_stream, debug_stream_path)) return 1;
+
+        printf("streaming debug events to %s\n", debug_stream_path);
+    }
+
+    static Timeline replay = { .end = UINT64_MAX };
+    int clientfd = -1;
+
+    if (replay_path != NULL) {
+        if (!timeline_read(replay_path, &replay)) return 1;
+
+        printf("replaying %zu bytes of serial input from %s\n", replay.n, replay_path);
+    } else {
+        clientfd = serial_accept();
+    }
+
+    FILE *record = NULL;
+
+    if (record_path != NULL) {
+        record = fopen(record_path, "w");
+
+        if (record == NULL) {
+            fprintf(stderr, "Could not open %s\n", record_path);
+            return 1;
+        }
+
+        printf("recording serial input to %s\n", record_path);
+    }
+
+    static Trace trace;
+
+    if (trace_path != NULL) {
+        char *mib = strrchr(trace_path, ':');
+        if (mib != NULL) *mib++ = 0;
+
+        if (!trace_open(&trace, trace_path, mib != NULL ? strtoul(mib, NULL, 10) : TRACE_DEFAULT_MIB)) return 1;
+
+        printf("tracing the last %llu cycles to %s\n", (unsigned long long)trace.header->capacity, trace_path);
+    }
+
+    static Itrace itrace;
+
+    if (itrace_path != NULL) {
+        if (!itrace_start(&itrace, itrace_path)) return 1;
+
+        printf("writing instruction trace to %s\n", itrace_path);
+    }
+
+    static Vcd vcd;
+
+    if (vcd_path != NULL) {
+        if (vcd_options != NULL && !vcd_parse_options(&vcd, vcd_options)) {
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        if (!vcd_open(&vcd, vcd_path)) return 1;
+
+        vcd.last_gpo = state.gpo;
+
+        printf("writing value change dump to %s\n", vcd_path);
+    }
+
+    static Stats stats = { .listenfd = -1 };
+
+    stats_start(&stats, &state);
+
+    if (stats_path != NULL) {
+        if (!stats_listen(&stats, stats_path)) return 1;
+
+        printf("serving throughput counters on %s\n", stats_path);
+    }
+
+    static Symbols symbols;
+
+    if (profile_path != NULL || callgraph_path != NULL) {
+        if (symbols_read(&symbols, SYMBOLS_DEFAULT_PATH)) symbols_end(&symbols, BOOT_ROM_SIZE);
+
+        if (symbols_path != NULL && !symbols_read(&symbols, symbols_path)) {
+            fprintf(stderr, "Could not open %s\n", symbols_path);
+            return 1;
+        }
+    }
+
+    static Profile profile;
+
+    if (profile_path != NULL) {
+        if (profile_period == 0 || !profile_init(&profile, profile_period, &state)) return 1;
+
+        printf("sampling every %llu cycles, %zu symbols\n", (unsigned long long)profile_period, symbols.n);
+    }
+
+    static Callgraph callgraph;
+
+    if (callgraph_path != NULL) {
+        if (!callgraph_init(&callgraph, &state)) return 1;
+
+        printf("counting calls, %zu symbols\n", symbols.n);
+    }
+
+    static Steps steps;
+
+    static Coverage coverage;
+
+    if (coverage_path != NULL && !coverage_merge(&coverage, coverage_path)) return 1;
+
+    static Heatmap heatmap;
+
+    if (heatmap_path != NULL) {
+        char *phase = strrchr(heatmap_path, ':');
+        if (phase != NULL) *phase++ = 0;
+
+        uint64_t phase_cycles = phase != NULL ? strtoull(phase, NULL, 10) : HEATMAP_DEFAULT_PHASE;
+
+        if (phase_cycles == 0) {
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        heatmap_init(&heatmap, phase_cycles, &state);
+    }
+
+    static Latency latency;
+
+    if (latency_path != NULL) latency_init(clientfd);
+
+    static WatchMap watch;
+
+    if (stack_guard) watch_set_stack_guard(&watch);
+
+    static Reverse reverse;
+
+    if (reverse_budget != 0) {
+        if (!reverse_init(&reverse, reverse_budget)) exit(1);
+
+        reverse_reset(&reverse, &state);
+
+        printf("keeping %zu checkpoints for reverse execution\n", reverse.max_checkpoints);
+    }
+
+    static Gdb gdb = { .listenfd = -1, .fd = -1, .watch = &watch };
+
+    gdb.control = control;
+    gdb.alu = alu;
+    if (reverse_budget != 0) gdb.reverse = &reverse;
+
+    if (gdb_port != 0) {
+        if (!gdb_listen(&gdb, gdb_port)) exit(1);
+        if (gdb_stop(&gdb, &state, 0) == GDB_RESUME_KILL) goto done;
+    }
+
     printf("starting emulation\n");
 
+    // Without any of these the plain loop below runs, it only emulates and
+    // does serial io.
+    bool stats_on = stats_interval > 0 || stats_path != NULL;
+    bool instrumented = gdb_port != 0 || stack_guard || reverse_budget != 0 || hot_reload || stats_on ||
+                        trace_path != NULL || itrace_path != NULL || vcd_path != NULL || profile_path != NULL ||
+                        callgraph_path != NULL || steps_path != NULL || coverage_path != NULL ||
+                        heatmap_path != NULL || latency_path != NULL;
+
+    DebugStream *debug = debug_stream_path != NULL ? &debug_stream : NULL;
+    Timeline *replaying_from = replay_path != NULL ? &replay : NULL;
+    Reverse *reverse_log = reverse_budget != 0 ? &reverse : NULL;
+    Latency *latency_log = latency_path != NULL ? &latency : NULL;
+    Stats *stats_log = stats_on ? &stats : NULL;
+
     size_t max_cycles = 10000000;
     uint8_t recv_byte;
+    bool reload_pending = false;
 
     for (;;) {
-        clock_t start = times(&tms);
+        for (cycles = 0; cycles < max_cycles && !instrumented; ++cycles) {
+            if ((cycles & 127) == 127 && clientfd >= 0) usleep(8);
+
+            if (emulate_next_cycle(false, control, alu, &state)) {
+                debug_instruction(debug, &state);
+
+                if (!serial_io(&state, clientfd, replaying_from, record, NULL, NULL, NULL)) goto done;
+            }
 
-        for (cycles = 0; cycles < max_cycles; ++cycles) {
+            if (state.cycle == replay.end) goto done;
+        }
+
+        for (cycles = 0; cycles < max_cycles && instrumented; ++cycles) {
             // if ((cycles & 63) == 63) usleep(4);
-            if ((cycles & 127) == 127) usleep(8);
+            if ((cycles & 127) == 127 && clientfd >= 0) {
+                uint64_t sleep_start = stats_on ? stats_now_ns() : 0;
+                usleep(8);
+                if (stats_on) stats.sleep_ns += stats_now_ns() - sleep_start;
 
-            bool instr_done = emulate_next_cycle(false, control, alu, &state);
+                if (latency_path != NULL) latency_poll(&latency, clientfd, &state);
+            }
 
-            if (instr_done) {
-                if (state.o == O_DEBUG_I16_N) {
-                    uint16_t pc = (uint16_t)(state.mh << 8) | state.ml;
-                    uint16_t address = (uint16_t)((state.mem[pc - 4] << 8) | state.mem[pc - 3]);
-                    uint16_t n = (uint16_t)(state.mem[pc - 2] << 8) | state.mem[pc - 1];
+            if (hot_reload && (cycles & (HOT_RELOAD_CLOCK_CYCLES - 1)) == 0 && hot_reload_due(&reload)) reload_pending = true;
 
-                    print_state(&state, address, n);
-                    getchar();
-                }
-                else if (state.o == O_DEBUG) {
-                    print_state(&state, 0, 0);
-                    getchar();
-                }
+            if (stats_on && (cycles & (STATS_POLL_CYCLES - 1)) == 0) stats_poll(&stats, stats_interval, state.cycle);
 
-                if (state.tx_bits == 9) {
-                    // printf("sending '%c'\n", state.tx);
+            uint16_t control_signals = emulate_control_signals(control, &state);
+            uint8_t watch_hit = watch_check(&watch, &state, control_signals);
 
-                    send(clientfd, &state.tx, 1, 0);
+            if (watch_hit) {
+                if (gdb.fd >= 0) {
+                    int signal = gdb_watch_hit(&gdb, &state, watch_hit);
 
-                    state.tx_bits = 0;
+                    if (signal != 0) {
+                        if (gdb_stop(&gdb, &state, signal) == GDB_RESUME_KILL) goto done;
+
+                        control_signals = emulate_control_signals(control, &state);
+                    }
+                } else if (watch_hit & WATCH_STACK) {
+                    fprintf(stderr, "stack overflow, address: %04x, sp: %02x, opcode: %02x\n", emulate_mem_bus(&state), state.mem[0xffff], state.o);
+                    exit(1);
                 }
+            }
 
-                if (state.rx_bits == 0 && state.mem[(uint16_t)(state.mh << 8) | state.ml] == 0x04) {
+            TraceRecord *trace_record = trace_path != NULL ? trace_next(&trace, &state, control_signals) : NULL;
+            VcdSample vcd_before = {0};
+            uint64_t cycle = state.cycle;
 
-                    ssize_t bytes_read = recv(clientfd, &recv_byte, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (vcd_path != NULL) vcd_before = vcd_before_cycle(&state, control_signals);
+            if (steps_path != NULL) steps_count(&steps, &state);
+            if (coverage_path != NULL) coverage_mark(&coverage, &state);
+            if (heatmap_path != NULL) heatmap_count(&heatmap, control_signals, &state);
 
-                    if (bytes_read > 0) {
-                        bytes_read = recv(clientfd, &recv_byte, 1, MSG_DONTWAIT);
+            bool instr_done = emulate_next_cycle_signals(false, control_signals, alu, &state);
 
-                        if (bytes_read < 1) {
-                            fprintf(stderr, "expected bytes from recv, got %ld\n", bytes_read);
-                            goto done;
-                        }
+            if (trace_record != NULL) trace_record->bus = state.bus;
+            if (vcd_path != NULL) vcd_sample(&vcd, cycle, &vcd_before, state.bus);
 
-                        state.rx = recv_byte;
-                        state.rx_bits = 1;
+            if (instr_done) {
+                if (stats_on) stats_instruction(&stats, &state);
+
+                if (reload_pending) {
+                    if (hot_reload_apply(&reload, control, alu, &state, &boot_state)) {
+                        stats_rebase(&stats, &state);
 
-                        // printf("recv: '%c'\n", state.rx);
+                        if (latency_path != NULL) latency_rebase(&latency, &state);
+                        if (reverse_budget != 0) reverse_reset(&reverse, &state);
                     }
+
+                    reload_pending = false;
+                }
+
+                if (itrace_path != NULL) itrace_push(&itrace, &state);
+                if (profile_path != NULL && state.cycle >= profile.next_sample) profile_sample(&profile, &state);
+                if (callgraph_path != NULL) callgraph_instruction(&callgraph, &state);
+                if (latency_path != NULL) latency_instruction(&latency, &state);
+
+                // Cycles up to the present are re-run after reverse execution,
+                // with serial io from the log instead of the connection.
+                bool replaying = reverse_budget != 0 && reverse_replaying(&reverse, &state);
+
+                if (reverse_budget != 0 && !replaying) reverse_checkpoint(&reverse, &state);
+
+                debug_instruction(debug, &state);
+
+                if (replaying) {
+                    reverse_replay_io(&reverse, &state);
+                } else if (!serial_io(&state, clientfd, replaying_from, record, reverse_log, latency_log, stats_log)) {
+                    goto done;
                 }
             }
-        }
 
-        clock_t end = times(&tms);
+            if (reverse_budget != 0 && state.cycle > reverse.present) reverse.present = state.cycle;
+
+            if (state.cycle == replay.end) goto done;
+
+            if (gdb.fd >= 0) {
+                int signal = gdb_after_cycle(&gdb, instr_done);
+
+                if (signal != 0 && gdb_stop(&gdb, &state, signal) == GDB_RESUME_KILL) goto done;
+            }
+        }
 
-        if (recv(clientfd, &recv_byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+        if (clientfd >= 0 && recv(clientfd, &recv_byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
             perror("disconnected");
             break;
         }
 
-        if (false) printf("elapsed ticks: %lu, elapsed seconds: %5.2f s\n", end - start, (double)(end - start) / freq);
     }
 done:
     printf("done\n");
 
-    printf("closing Serial connection\n");
-    shutdown(listenfd, 2);
+    if (record != NULL) {
+        fprintf(record, "%llu end\n", (unsigned long long)state.cycle);
+        fclose(record);
+    }
+
+    if (replay_path != NULL) {
+        double seconds = (double)(stats_now_ns() - stats.start_ns) / 1e9;
+        uint64_t run_cycles = stats_cycles(&stats, state.cycle);
+
+        printf("replayed %llu cycles in %.2f s, %.2f MHz\n",
+            (unsigned long long)run_cycles, seconds, seconds > 0 ? (double)run_cycles / seconds / 1e6 : 0);
+    }
+
+    if (debug_stream_path != NULL) debug_stream_stop(&debug_stream);
+    if (trace_path != NULL) trace_close(&trace);
+    if (itrace_path != NULL) itrace_stop(&itrace);
+    if (vcd_path != NULL) vcd_close(&vcd);
+    if (stats_interval > 0) stats_report(&stats, state.cycle);
+    if (profile_path != NULL) profile_write(&profile, &symbols, profile_path);
+    if (steps_path != NULL) steps_write(&steps, control, steps_path);
+    if (coverage_path != NULL) coverage_write(&coverage, control, coverage_path);
+    if (heatmap_path != NULL) heatmap_write(&heatmap, &state, heatmap_path);
+    if (latency_path != NULL) latency_write(&latency, latency_path);
+    if (callgraph_path != NULL) callgraph_write(&callgraph, &symbols, callgraph_path, state.cycle);
+
+    if (clientfd >= 0) {
+        printf("closing Serial connection\n");
+        shutdown(clientfd, 2);
+    }
 
     return 0;
 }
@@ -0,0 +1,270 @@
+// Exact call graph profiler, enabled with -C path.
+//
+// Calls and returns are seen at instruction boundaries: after call_i16_end
+// the pc is the routine entered, after ret it is the return address. A
+// shadow call stack gives every routine its calls, inclusive cycles (counted
+// once for recursive activations) and exclusive cycles. Cycles outside any
+// call belong to <root>. Routines are named by their entry address.
+//
+// At exit a report sorted by inclusive cycles is written to path and the
+// call graph in the callgrind format to path.callgrind for kcachegrind and
+// qcachegrind.
+
+#define CALLGRAPH_MAX_DEPTH 256
+#define CALLGRAPH_ROOT 0x10000
+#define CALLGRAPH_N_ROUTINES (CALLGRAPH_ROOT + 1)
+#define CALLGRAPH_EDGES_SIZE (1 << 16) // Power of two.
+
+typedef struct {
+    uint64_t calls;
+    uint64_t inclusive;
+    uint64_t exclusive;
+    uint32_t active;    // Activations on the shadow stack.
+    uint32_t max_depth; // Deepest call depth the routine was entered at.
+} CallgraphRoutine;
+
+typedef struct {
+    bool used;
+    uint32_t caller;
+    uint32_t callee;
+    uint64_t calls;
+    uint64_t inclusive;
+} CallgraphEdge;
+
+typedef struct {
+    uint32_t routine;
+    uint16_t return_address;
+    uint64_t entry_cycle;
+    uint64_t children;  // Inclusive cycles of calls made from here.
+} CallgraphFrame;
+
+typedef struct {
+    CallgraphRoutine *routines;
+    CallgraphEdge *edges;
+    size_t n_edges;
+    CallgraphFrame frames[CALLGRAPH_MAX_DEPTH];
+    uint32_t depth;
+    uint64_t start_cycle;
+    uint64_t last_cycle;  // Of the last instruction boundary seen.
+    uint64_t elapsed;     // Cycles before start_cycle, the run is rebased when the cycle goes back.
+    uint64_t unmatched; // Returns without a call, or calls beyond CALLGRAPH_MAX_DEPTH.
+} Callgraph;
+
+static bool callgraph_init(Callgraph *callgraph, const State *state) {
+    callgraph->routines = calloc(CALLGRAPH_N_ROUTINES, sizeof(CallgraphRoutine));
+    callgraph->edges = calloc(CALLGRAPH_EDGES_SIZE, sizeof(CallgraphEdge));
+
+    if (callgraph->routines == NULL || callgraph->edges == NULL) {
+        fprintf(stderr, "Failed to allocate call graph\n");
+        return false;
+    }
+
+    callgraph->start_cycle = callgraph->last_cycle = state->cycle;
+    callgraph->frames[0] = (CallgraphFrame){ .routine = CALLGRAPH_ROOT, .entry_cycle = state->cycle };
+    callgraph->depth = 1;
+    callgraph->routines[CALLGRAPH_ROOT] = (CallgraphRoutine){ .calls = 1, .active = 1 };
+
+    return true;
+}
+
+static CallgraphEdge *callgraph_edge(Callgraph *callgraph, uint32_t caller, uint32_t callee) {
+    // In 64 bits, wrapping unsigned arithmetic traps with -fsanitize=integer.
+    uint64_t hash = ((uint64_t)caller * 2654435761u) ^ ((uint64_t)callee * 40503u);
+
+    for (uint64_t i = hash & (CALLGRAPH_EDGES_SIZE - 1); ; i = (i + 1) & (CALLGRAPH_EDGES_SIZE - 1)) {
+        CallgraphEdge *edge = &callgraph->edges[i];
+
+        if (!edge->used) {
+            if (callgraph->n_edges == CALLGRAPH_EDGES_SIZE / 2) return NULL;
+
+            edge->used = true;
+            edge->caller = caller;
+            edge->callee = callee;
+            ++callgraph->n_edges;
+            return edge;
+        }
+
+        if (edge->caller == caller && edge->callee == callee) return edge;
+    }
+}
+
+static void callgraph_pop(Callgraph *callgraph, uint64_t cycle) {
+    CallgraphFrame *frame = &callgraph->frames[--callgraph->depth];
+    CallgraphFrame *parent = &callgraph->frames[callgraph->depth - 1];
+    CallgraphRoutine *routine = &callgraph->routines[frame->routine];
+    uint64_t inclusive = cycle - frame->entry_cycle;
+
+    routine->exclusive += inclusive - frame->children;
+    if (--routine->active == 0) routine->inclusive += inclusive;
+
+    parent->children += inclusive;
+
+    CallgraphEdge *edge = callgraph_edge(callgraph, parent->routine, frame->routine);
+    if (edge != NULL) edge->inclusive += inclusive;
+}
+
+static void callgraph_call(Callgraph *callgraph, const State *state) {
+    uint16_t pc = (uint16_t)((state->mh << 8) | state->ml);
+    uint8_t sp = state->mem[0xffff];
+    uint16_t return_address = (uint16_t)((state->mem[0xff00 + (uint8_t)(sp - 2)] << 8) | state->mem[0xff00 + (uint8_t)(sp - 1)]);
+
+    if (callgraph->depth == CALLGRAPH_MAX_DEPTH) {
+        ++callgraph->unmatched;
+        return;
+    }
+
+    CallgraphRoutine *routine = &callgraph->routines[pc];
+    CallgraphFrame *parent = &callgraph->frames[callgraph->depth - 1];
+
+    ++routine->calls;
+    ++routine->active;
+    if (callgraph->depth > routine->max_depth) routine->max_depth = callgraph->depth;
+
+    CallgraphEdge *edge = callgraph_edge(callgraph, parent->routine, pc);
+    if (edge != NULL) ++edge->calls;
+
+    callgraph->frames[callgraph->depth++] = (CallgraphFrame){
+        .routine = pc,
+        .return_address = return_address,
+        .entry_cycle = state->cycle,
+    };
+}
+
+static void callgraph_return(Callgraph *callgraph, const State *state) {
+    uint16_t pc = (uint16_t)((state->mh << 8) | state->ml);
+
+    // Frames the stack was unwound past without a ret are closed as well.
+    uint32_t depth = callgraph->depth;
+    while (depth > 1 && callgraph->frames[depth - 1].return_address != pc) --depth;
+
+    if (depth == 1) {
+        ++callgraph->unmatched;
+        return;
+    }
+
+    while (callgraph->depth >= depth) callgraph_pop(callgraph, state->cycle);
+}
+
+// A reload or reverse step took the cycle back. What ran is closed as if
+// everything returned at the last boundary seen, counting starts again at
+// cycle from <root>.
+static void callgraph_rebase(Callgraph *callgraph, uint64_t cycle) {
+    while (callgraph->depth > 1) callgraph_pop(callgraph, callgraph->last_cycle);
+
+    callgraph->elapsed += callgraph->last_cycle - callgraph->start_cycle;
+    callgraph->start_cycle = callgraph->last_cycle = cycle;
+    callgraph->frames[0].entry_cycle = cycle;
+}
+
+// Call at instruction boundaries, state->o is the opcode just executed.
+static inline void callgraph_instruction(Callgraph *callgraph, const State *state) {
+    if (state->cycle < callgraph->last_cycle) callgraph_rebase(callgraph, state->cycle);
+
+    callgraph->last_cycle = state->cycle;
+
+    if      (state->o == O_CALL_I16_END) callgraph_call(callgraph, state);
+    else if (state->o == O_RET)          callgraph_return(callgraph, state);
+}
+
+static const char *callgraph_name(const Symbols *symbols, uint32_t routine, char *buf, size_t size) {
+    if (routine == CALLGRAPH_ROOT) return "<root>";
+
+    return symbols_format(symbols, (uint16_t)routine, buf, size);
+}
+
+static const Callgraph *callgraph_sorting;
+
+static int callgraph_compare(const void *a, const void *b) {
+    const CallgraphRoutine *ra = &callgraph_sorting->routines[*(const uint32_t *)a];
+    const CallgraphRoutine *rb = &callgraph_sorting->routines[*(const uint32_t *)b];
+
+    return ra->inclusive < rb->inclusive ? 1 : ra->inclusive > rb->inclusive ? -1 : 0;
+}
+
+static bool callgraph_write(Callgraph *callgraph, const Symbols *symbols, const char *path, uint64_t cycle) {
+    if (cycle < callgraph->last_cycle) callgraph_rebase(callgraph, cycle);
+
+    // Close what is still running, as if everything returned now.
+    while (callgraph->depth > 1) callgraph_pop(callgraph, cycle);
+
+    CallgraphRoutine *root = &callgraph->routines[CALLGRAPH_ROOT];
+    uint64_t total = callgraph->elapsed + cycle - callgraph->start_cycle;
+
+    root->inclusive = total;
+    root->exclusive = total - callgraph->frames[0].children;
+
+    static uint32_t order[CALLGRAPH_N_ROUTINES];
+    size_t n = 0;
+
+    for (uint32_t i = 0; i < CALLGRAPH_N_ROUTINES; ++i)
+        if (callgraph->routines[i].calls > 0) order[n++] = i;
+
+    callgraph_sorting = callgraph;
+    qsort(order, n, sizeof(order[0]), callgraph_compare);
+
+    FILE *f = fopen(path, "w");
+
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    char name[96];
+
+    fprintf(f, "%12s %14s %7s %14s %7s %10s %5s  %s\n",
+        "calls", "inclusive", "%", "exclusive", "%", "incl/call", "depth", "routine");
+
+    for (size_t i = 0; i < n; ++i) {
+        const CallgraphRoutine *r = &callgraph->routines[order[i]];
+
+        fprintf(f, "%12llu %14llu %6.2f%% %14llu %6.2f%% %10.1f %5u  %s\n",
+            (unsigned long long)r->calls,
+            (unsigned long long)r->inclusive, total > 0 ? 100.0 * (double)r->inclusive / (double)total : 0,
+            (unsigned long long)r->exclusive, total > 0 ? 100.0 * (double)r->exclusive / (double)total : 0,
+            (double)r->inclusive / (double)r->calls,
+            r->max_depth,
+            callgraph_name(symbols, order[i], name, sizeof(name)));
+    }
+
+    if (callgraph->unmatched > 0)
+        fprintf(f, "\n%llu unmatched calls or returns\n", (unsigned long long)callgraph->unmatched);
+
+    fclose(f);
+
+    char callgrind_path[1024];
+    snprintf(callgrind_path, sizeof(callgrind_path), "%s.callgrind", path);
+
+    f = fopen(callgrind_path, "w");
+
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s\n", callgrind_path);
+        return false;
+    }
+
+    fprintf(f, "# callgrind format\nversion: 1\ncreator: custom-cpu emulator\n");
+    fprintf(f, "positions: instr\nevents: Cycles\nsummary: %llu\n", (unsigned long long)total);
+
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t caller = order[i];
+        uint32_t position = caller == CALLGRAPH_ROOT ? 0 : caller;
+
+        fprintf(f, "\nfn=%s\n", callgraph_name(symbols, caller, name, sizeof(name)));
+        fprintf(f, "0x%x %llu\n", position, (unsigned long long)callgraph->routines[caller].exclusive);
+
+        for (size_t e = 0; e < CALLGRAPH_EDGES_SIZE; ++e) {
+            const CallgraphEdge *edge = &callgraph->edges[e];
+
+            if (!edge->used || edge->caller != caller) continue;
+
+            fprintf(f, "cfn=%s\n", callgraph_name(symbols, edge->callee, name, sizeof(name)));
+            fprintf(f, "calls=%llu 0x%x\n", (unsigned long long)edge->calls, edge->callee);
+            fprintf(f, "0x%x %llu\n", position, (unsigned long long)edge->inclusive);
+        }
+    }
+
+    fclose(f);
+
+    printf("call graph of %zu routines written to %s and %s\n", n, path, callgrind_path);
+
+    return true;
+}
@@ -0,0 +1,242 @@
+// Microcode coverage, enabled with -k path.
+//
+// One bit per control address (f, s, o) is set when the address is run. The
+// bitmap at path is merged in at start and written back at exit, so running
+// every test program with the same path accumulates their coverage. The
+// report in path.txt lists, per opcode and flags, the steps an instruction
+// can reach before LD_S ends it and which of those were never run.
+//
+// Only addresses after init, with F_I set, are counted. Flag combinations
+// with identical microcode for an opcode share their coverage, a jump that
+// ignores Z is tested once whatever Z is.
+
+#define COVERAGE_BYTES (0x10000 / 8)
+
+typedef struct {
+    uint8_t bits[COVERAGE_BYTES];
+} Coverage;
+
+static inline void coverage_mark(Coverage *coverage, const State *state) {
+    uint16_t control_address = emulate_control_address(state);
+
+    coverage->bits[control_address >> 3] |= (uint8_t)(1 << (control_address & 7));
+}
+
+static inline bool coverage_covered(const Coverage *coverage, uint16_t control_address) {
+    return (coverage->bits[control_address >> 3] >> (control_address & 7)) & 1;
+}
+
+// A missing file is no coverage yet.
+static bool coverage_merge(Coverage *coverage, const char *path) {
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL) return true;
+
+    uint8_t bits[COVERAGE_BYTES];
+    size_t n = fread(bits, 1, sizeof(bits), f);
+    bool extra = fgetc(f) != EOF;
+
+    fclose(f);
+
+    if (n != sizeof(bits) || extra) {
+        fprintf(stderr, "%s is not a coverage bitmap of %d bytes\n", path, COVERAGE_BYTES);
+        return false;
+    }
+
+    for (size_t i = 0; i < sizeof(bits); ++i)
+        coverage->bits[i] |= bits[i];
+
+    return true;
+}
+
+// Number of steps until LD_S, 16 if the instruction wraps around to step 0
+// on its own like NOP and undefined opcodes do.
+static int coverage_reachable_steps(const uint8_t control[CONTROL_ROM_SIZE], uint8_t f, uint8_t o) {
+    for (uint8_t s = 0; s < 16; ++s) {
+        State at = { .f = f, .s = s, .o = o };
+
+        if (IS_LD_S(emulate_control_signals(control, &at))) return s + 1;
+    }
+
+    return 16;
+}
+
+static bool coverage_same_microcode(const uint8_t control[CONTROL_ROM_SIZE], uint8_t f1, uint8_t f2, uint8_t o, int steps) {
+    for (uint8_t s = 0; s < steps; ++s) {
+        State a = { .f = f1, .s = s, .o = o };
+        State b = { .f = f2, .s = s, .o = o };
+
+        if (emulate_control_signals(control, &a) != emulate_control_signals(control, &b)) return false;
+    }
+
+    return true;
+}
+
+// Flags of a class of combinations, upper case when set, lower case when
+// clear and '.' when either, e.g. "Z.." for every combination with Z set.
+static void coverage_format_flags(uint8_t class, char *buf, size_t size) {
+    const char names[3] = { 'z', 'c', 's' };
+    char pattern[4] = "...";
+    int matching = 0;
+
+    for (int b = 0; b < 3; ++b) {
+        int set = 0, clear = 0;
+
+        for (int combo = 0; combo < 8; ++combo)
+            if (class & (1 << combo)) {
+                if (combo & (1 << b)) ++set;
+                else ++clear;
+            }
+
+        if (clear == 0) pattern[b] = (char)(names[b] - 'a' + 'A');
+        if (set == 0) pattern[b] = names[b];
+    }
+
+    for (int combo = 0; combo < 8; ++combo) {
+        bool match = true;
+
+        for (int b = 0; b < 3; ++b) {
+            if (pattern[b] == names[b] && (combo & (1 << b))) match = false;
+            if (pattern[b] != names[b] && pattern[b] != '.' && !(combo & (1 << b))) match = false;
+        }
+
+        if (match) ++matching;
+    }
+
+    if (matching == __builtin_popcount(class)) {
+        snprintf(buf, size, "%s", pattern);
+        return;
+    }
+
+    // Not a cube, list every combination.
+    size_t len = 0;
+    buf[0] = '\0';
+
+    for (int combo = 0; combo < 8 && len + 5 < size; ++combo)
+        if (class & (1 << combo))
+            len += (size_t)snprintf(buf + len, size - len, "%s%c%c%c", len > 0 ? "," : "",
+                (combo & F_Z) ? 'Z' : 'z', (combo & F_C) ? 'C' : 'c', (combo & F_S) ? 'S' : 's');
+}
+
+typedef struct {
+    uint8_t o;
+    uint8_t class; // Bit per flags combination sharing the microcode.
+    int steps;
+    uint16_t covered; // Bit per step, run with any flags of the class.
+} CoverageEntry;
+
+// An opcode is defined when its microcode ends in LD_S, or is NOP, which
+// runs all 16 steps by design.
+static bool coverage_write(const Coverage *coverage, const uint8_t control[CONTROL_ROM_SIZE], const char *path) {
+    FILE *f = fopen(path, "wb");
+
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    fwrite(coverage->bits, 1, sizeof(coverage->bits), f);
+    fclose(f);
+
+    static CoverageEntry entries[256 * 8];
+    size_t n = 0;
+    int opcodes = 0, opcodes_untested = 0;
+    int steps = 0, steps_covered = 0;
+
+    for (int o = 0; o < 256; ++o) {
+        bool defined = o == O_NOP;
+
+        for (uint8_t combo = 0; combo < 8; ++combo)
+            if (coverage_reachable_steps(control, F_I | combo, (uint8_t)o) < 16) defined = true;
+
+        if (!defined) continue;
+
+        uint8_t assigned = 0;
+        bool tested = false;
+
+        for (uint8_t combo = 0; combo < 8; ++combo) {
+            if (assigned & (1 << combo)) continue;
+
+            CoverageEntry *entry = &entries[n++];
+            *entry = (CoverageEntry){ .o = (uint8_t)o, .steps = coverage_reachable_steps(control, F_I | combo, (uint8_t)o) };
+
+            for (uint8_t other = combo; other < 8; ++other)
+                if (!(assigned & (1 << other)) &&
+                    coverage_reachable_steps(control, F_I | other, (uint8_t)o) == entry->steps &&
+                    coverage_same_microcode(control, F_I | combo, F_I | other, (uint8_t)o, entry->steps)) {
+                    assigned |= (uint8_t)(1 << other);
+                    entry->class |= (uint8_t)(1 << other);
+
+                    for (uint8_t s = 0; s < entry->steps; ++s)
+                        if (coverage_covered(coverage, (uint16_t)(((F_I | other) << 12) | (s << 8) | o)))
+                            entry->covered |= (uint16_t)(1 << s);
+                }
+
+            steps += entry->steps;
+            steps_covered += __builtin_popcount(entry->covered);
+
+            // Step 0 is the fetch after the instruction, not part of it.
+            if (entry->covered & ~1) tested = true;
+        }
+
+        ++opcodes;
+        if (!tested) ++opcodes_untested;
+    }
+
+    char report_path[1024];
+    if (snprintf(report_path, sizeof(report_path), "%s.txt", path) >= (int)sizeof(report_path)) {
+        fprintf(stderr, "Path too long %s\n", path);
+        return false;
+    }
+
+    FILE *r = fopen(report_path, "w");
+
+    if (r == NULL) {
+        fprintf(stderr, "Could not open %s\n", report_path);
+        return false;
+    }
+
+    fprintf(r, "%d of %d reachable steps covered (%.1f%%), %d of %d opcodes never run\n",
+        steps_covered, steps, steps > 0 ? 100.0 * steps_covered / steps : 0, opcodes_untested, opcodes);
+
+    fprintf(r, "\nuntested, steps never run per opcode and flags\n");
+
+    for (size_t i = 0; i < n; ++i) {
+        const CoverageEntry *entry = &entries[i];
+        uint16_t reachable = (uint16_t)((1u << entry->steps) - 1);
+
+        if (entry->covered == reachable) continue;
+
+        char flags[64];
+        coverage_format_flags(entry->class, flags, sizeof(flags));
+
+        fprintf(r, "    %02x %-16s %s", entry->o, flags, (entry->covered & ~1) ? "steps" : "never run, steps");
+
+        for (int s = 0; s < entry->steps; ++s)
+            if (!(entry->covered & (1 << s))) fprintf(r, " %x", s);
+
+        fprintf(r, "\n");
+    }
+
+    fprintf(r, "\nopcode flags            covered/reachable steps\n");
+
+    for (size_t i = 0; i < n; ++i) {
+        const CoverageEntry *entry = &entries[i];
+        char flags[64];
+
+        coverage_format_flags(entry->class, flags, sizeof(flags));
+
+        fprintf(r, "    %02x %-16s %2d/%-2d ", entry->o, flags, __builtin_popcount(entry->covered), entry->steps);
+
+        for (int s = 0; s < entry->steps; ++s)
+            fputc((entry->covered & (1 << s)) ? '#' : '.', r);
+
+        fprintf(r, "\n");
+    }
+
+    fclose(r);
+
+    printf("coverage written to %s, %d of %d reachable steps covered\n", report_path, steps_covered, steps);
+
+    return true;
+}
@@ -0,0 +1,157 @@
+#include <errno.h>
+#include <fcntl.h> // open
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h> // sockaddr_un
+
+// Records emitted by O_DEBUG and O_DEBUG_I16_N when running with -d.
+// Written as is, in host byte order, one after another.
+
+#define DEBUG_EVENT_WINDOW 256
+#define DEBUG_EVENT_QUEUE_SIZE 1024 // Power of two.
+
+typedef struct {
+    uint64_t cycle;
+    uint8_t o;
+    uint8_t f;
+    uint8_t c;
+    uint8_t t;
+    uint8_t ml;
+    uint8_t mh;
+    uint8_t sp;
+    uint8_t regs[8];    // mem[0xfff0..0xfff7]
+    uint8_t reserved;
+    uint16_t address;   // Start of the requested memory window.
+    uint16_t n;         // Requested size, mem holds the first DEBUG_EVENT_WINDOW bytes.
+    uint8_t mem[DEBUG_EVENT_WINDOW];
+} DebugEvent;
+
+typedef struct {
+    DebugEvent events[DEBUG_EVENT_QUEUE_SIZE];
+    _Atomic size_t head; // Written by the emulator only.
+    _Atomic size_t tail; // Written by the consumer only.
+    _Atomic bool done;
+    size_t dropped;
+    int fd;
+    pthread_t consumer;
+} DebugStream;
+
+static int debug_stream_open(const char *path) {
+    const char *unix_prefix = "unix:";
+
+    if (strncmp(path, unix_prefix, strlen(unix_prefix)) != 0)
+        return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path + strlen(unix_prefix), sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void debug_stream_write(int fd, const DebugEvent *event) {
+    const uint8_t *p = (const uint8_t *)event;
+    size_t left = sizeof(*event);
+
+    while (left > 0) {
+        ssize_t written = write(fd, p, left);
+
+        if (written <= 0) {
+            perror("debug stream write failed");
+            return;
+        }
+
+        p += written;
+        left -= (size_t)written;
+    }
+}
+
+static void *debug_stream_consume(void *arg) {
+    DebugStream *stream = arg;
+
+    for (;;) {
+        size_t tail = atomic_load_explicit(&stream->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&stream->head, memory_order_acquire);
+
+        if (tail == head) {
+            if (atomic_load_explicit(&stream->done, memory_order_acquire) &&
+                head == atomic_load_explicit(&stream->head, memory_order_acquire)) break;
+
+            usleep(1000);
+            continue;
+        }
+
+        for (; tail != head; ++tail)
+            debug_stream_write(stream->fd, &stream->events[tail & (DEBUG_EVENT_QUEUE_SIZE - 1)]);
+
+        atomic_store_explicit(&stream->tail, tail, memory_order_release);
+    }
+
+    return NULL;
+}
+
+static bool debug_stream_start(DebugStream *stream, const char *path) {
+    stream->fd = debug_stream_open(path);
+
+    if (stream->fd < 0) {
+        fprintf(stderr, "Failed to open debug stream %s, reason: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    if (pthread_create(&stream->consumer, NULL, debug_stream_consume, stream) != 0) {
+        fprintf(stderr, "Failed to start debug stream consumer\n");
+        close(stream->fd);
+        return false;
+    }
+
+    return true;
+}
+
+// Never blocks, the event is dropped if the consumer is behind.
+static void debug_stream_push(DebugStream *stream, uint64_t cycle, const State *state, uint16_t address, uint16_t n) {
+    size_t head = atomic_load_explicit(&stream->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&stream->tail, memory_order_acquire);
+
+    if (head - tail == DEBUG_EVENT_QUEUE_SIZE) {
+        ++stream->dropped;
+        return;
+    }
+
+    DebugEvent *event = &stream->events[head & (DEBUG_EVENT_QUEUE_SIZE - 1)];
+
+    // The padding is written too, cleared so the stream is the same each run.
+    memset(event, 0, sizeof(*event));
+
+    event->cycle = cycle;
+    event->o = state->o;
+    event->f = state->f;
+    event->c = state->c;
+    event->t = state->t;
+    event->ml = state->ml;
+    event->mh = state->mh;
+    event->sp = state->mem[0xffff];
+    memcpy(event->regs, state->mem + 0xfff0, sizeof(event->regs));
+    event->address = address;
+    event->n = n;
+
+    for (int i = 0; i < DEBUG_EVENT_WINDOW; ++i)
+        event->mem[i] = state->mem[(address + i) & 0xffff];
+
+    atomic_store_explicit(&stream->head, head + 1, memory_order_release);
+}
+
+static void debug_stream_stop(DebugStream *stream) {
+    atomic_store_explicit(&stream->done, true, memory_order_release);
+    pthread_join(stream->consumer, NULL);
+    close(stream->fd);
+
+    if (stream->dropped > 0) fprintf(stderr, "debug stream dropped %zu events\n", stream->dropped);
+}
@@ -0,0 +1,1051 @@
+#include <arpa/inet.h> // inet_addr
+
+// GDB remote serial protocol stub, enabled with -g port.
+//
+// Registers are a, b, c, d, e, t (mem[0xfff0..0xfff5]), flags and m, where m
+// is the program counter at instruction boundaries. 16-bit values are sent
+// big-endian, like immediates in the instruction set.
+//
+// Breakpoints (Z0/Z1) and watchpoints (Z2..Z4) are handled by the emulator
+// through the WatchMap. Breakpoint conditions are sent by GDB as agent
+// expressions and evaluated here, so the machine runs at full speed until a
+// condition is true. Watchpoints and stack guard hits stop at the end of the
+// instruction doing the access.
+//
+// "monitor step cycle" makes stepi execute a single micro-step,
+// "monitor step instruction" restores the default.
+//
+// With reverse execution enabled (-b) reverse-stepi and reverse-continue
+// are supported, and "monitor goto <cycle>" moves to any cycle still
+// covered by checkpoints.
+
+#define GDB_PACKET_SIZE          0x1000
+#define GDB_MAX_BREAKPOINTS      64
+#define GDB_MAX_WATCHPOINTS      16
+#define GDB_MAX_CONDITIONS       4
+#define GDB_MAX_CONDITION_SIZE   128
+#define GDB_AX_STACK_SIZE        32
+#define GDB_INTERRUPT_POLL_CYCLES (1 << 16)
+
+#define GDB_SIGINT  2
+#define GDB_SIGTRAP 5
+#define GDB_SIGSEGV 11
+
+typedef enum {
+    GDB_REG_A,
+    GDB_REG_B,
+    GDB_REG_C,
+    GDB_REG_D,
+    GDB_REG_E,
+    GDB_REG_T,
+    GDB_REG_FLAGS,
+    GDB_REG_M,
+    GDB_N_REGS,
+} GdbReg;
+
+typedef enum {
+    GDB_WATCH_WRITE  = 2,
+    GDB_WATCH_READ   = 3,
+    GDB_WATCH_ACCESS = 4,
+} GdbWatchType;
+
+typedef enum {
+    GDB_RESUME_CONTINUE,
+    GDB_RESUME_STEP,
+    GDB_RESUME_STEP_CYCLE,
+    GDB_RESUME_DETACH,
+    GDB_RESUME_KILL,
+} GdbResume;
+
+typedef struct {
+    uint16_t address;
+    uint8_t n_conditions;
+    uint8_t condition_size[GDB_MAX_CONDITIONS];
+    uint8_t conditions[GDB_MAX_CONDITIONS][GDB_MAX_CONDITION_SIZE];
+} GdbBreakpoint;
+
+typedef struct {
+    uint16_t address;
+    uint16_t length;
+    GdbWatchType type;
+} GdbWatchpoint;
+
+typedef struct {
+    int listenfd;
+    int fd;
+    bool no_ack;
+    bool step_cycles;
+    bool resumed;
+    GdbResume resume;
+
+    WatchMap *watch;
+    Reverse *reverse; // NULL unless reverse execution is enabled.
+    uint8_t *control;
+    uint8_t *alu;
+
+    GdbBreakpoint breakpoints[GDB_MAX_BREAKPOINTS];
+    size_t n_breakpoints;
+
+    GdbWatchpoint watchpoints[GDB_MAX_WATCHPOINTS];
+    size_t n_watchpoints;
+
+    const GdbWatchpoint *watch_hit;
+    uint16_t watch_hit_address;
+    bool stack_hit;
+
+    size_t interrupt_poll;
+
+    uint8_t in[256];
+    size_t in_pos;
+    size_t in_len;
+
+    char packet[GDB_PACKET_SIZE + 1];
+    char reply[GDB_PACKET_SIZE + 1];
+} Gdb;
+
+static const char *GDB_TARGET_XML =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target version=\"1.0\">"
+    "<feature name=\"org.custom-cpu.core\">"
+    "<reg name=\"a\" bitsize=\"8\" type=\"uint8\"/>"
+    "<reg name=\"b\" bitsize=\"8\" type=\"uint8\"/>"
+    "<reg name=\"c\" bitsize=\"8\" type=\"uint8\"/>"
+    "<reg name=\"d\" bitsize=\"8\" type=\"uint8\"/>"
+    "<reg name=\"e\" bitsize=\"8\" type=\"uint8\"/>"
+    "<reg name=\"t\" bitsize=\"8\" type=\"uint8\"/>"
+    "<reg name=\"flags\" bitsize=\"8\" type=\"uint8\"/>"
+    "<reg name=\"m\" bitsize=\"16\" type=\"code_ptr\"/>"
+    "</feature>"
+    "</target>";
+
+static const char GDB_HEX[] = "0123456789abcdef";
+
+static int gdb_hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static uint32_t gdb_parse_hex(const char **p) {
+    uint32_t value = 0;
+
+    for (int v; (v = gdb_hex_value(**p)) >= 0; ++*p)
+        value = (value << 4) | (uint32_t)v;
+
+    return value;
+}
+
+static bool gdb_parse_hex_bytes(const char *p, size_t n, uint8_t *bytes) {
+    for (size_t i = 0; i < n; ++i) {
+        int hi = gdb_hex_value(p[2 * i]);
+        int lo = gdb_hex_value(p[2 * i + 1]);
+
+        if (hi < 0 || lo < 0) return false;
+
+        bytes[i] = (uint8_t)((hi << 4) | lo);
+    }
+
+    return true;
+}
+
+static char *gdb_append_hex(char *p, uint8_t byte) {
+    *p++ = GDB_HEX[byte >> 4];
+    *p++ = GDB_HEX[byte & 0xf];
+    *p = 0;
+    return p;
+}
+
+static bool gdb_listen(Gdb *gdb, uint16_t port) {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(port);
+
+    gdb->listenfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (gdb->listenfd < 0) {
+        perror("gdb socket failed");
+        return false;
+    }
+
+    const int reuse = 1;
+    if (setsockopt(gdb->listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) < 0)
+        perror("gdb setsockopt(SO_REUSEADDR) failed");
+
+    if (bind(gdb->listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("gdb bind failed");
+        return false;
+    }
+
+    if (listen(gdb->listenfd, 1) < 0) {
+        perror("gdb listen failed");
+        return false;
+    }
+
+    printf("waiting for gdb connection on port %d\n", port);
+
+    gdb->fd = accept(gdb->listenfd, NULL, NULL);
+
+    if (gdb->fd < 0) {
+        perror("gdb accept failed");
+        return false;
+    }
+
+    printf("gdb connected\n");
+
+    return true;
+}
+
+static void gdb_close(Gdb *gdb) {
+    close(gdb->fd);
+    close(gdb->listenfd);
+    gdb->fd = -1;
+    gdb->listenfd = -1;
+}
+
+static int gdb_getc(Gdb *gdb) {
+    if (gdb->in_pos == gdb->in_len) {
+        ssize_t n = recv(gdb->fd, gdb->in, sizeof(gdb->in), 0);
+
+        if (n <= 0) return -1;
+
+        gdb->in_pos = 0;
+        gdb->in_len = (size_t)n;
+    }
+
+    return gdb->in[gdb->in_pos++];
+}
+
+static bool gdb_send_raw(Gdb *gdb, const char *data, size_t n) {
+    while (n > 0) {
+        ssize_t sent = send(gdb->fd, data, n, 0);
+
+        if (sent <= 0) return false;
+
+        data += sent;
+        n -= (size_t)sent;
+    }
+
+    return true;
+}
+
+static bool gdb_send_packet(Gdb *gdb, const char *data) {
+    char frame[GDB_PACKET_SIZE + 8];
+    size_t n = strlen(data);
+    uint8_t checksum = 0;
+
+    if (n > GDB_PACKET_SIZE) n = GDB_PACKET_SIZE;
+
+    frame[0] = '$';
+    for (size_t i = 0; i < n; ++i) {
+        frame[i + 1] = data[i];
+        checksum = (uint8_t)(checksum + (uint8_t)data[i]);
+    }
+    frame[n + 1] = '#';
+    frame[n + 2] = GDB_HEX[checksum >> 4];
+    frame[n + 3] = GDB_HEX[checksum & 0xf];
+
+    for (;;) {
+        if (!gdb_send_raw(gdb, frame, n + 4)) return false;
+        if (gdb->no_ack) return true;
+
+        int c = gdb_getc(gdb);
+
+        if (c == '+') return true;
+        if (c != '-') return false;
+    }
+}
+
+// Returns the packet length, or -1 when gdb disconnected.
+static int gdb_read_packet(Gdb *gdb) {
+    for (;;) {
+        int c;
+
+        while ((c = gdb_getc(gdb)) != '$')
+            if (c < 0) return -1;
+
+        size_t n = 0;
+        uint8_t checksum = 0;
+
+        while ((c = gdb_getc(gdb)) != '#') {
+            if (c < 0) return -1;
+
+            if (n < GDB_PACKET_SIZE) gdb->packet[n++] = (char)c;
+            checksum = (uint8_t)(checksum + c);
+        }
+
+        int hi = gdb_getc(gdb);
+        int lo = gdb_getc(gdb);
+
+        if (hi < 0 || lo < 0) return -1;
+
+        gdb->packet[n] = 0;
+
+        if (gdb->no_ack) return (int)n;
+
+        if (gdb_hex_value((char)hi) * 16 + gdb_hex_value((char)lo) == checksum) {
+            gdb_send_raw(gdb, "+", 1);
+            return (int)n;
+        }
+
+        gdb_send_raw(gdb, "-", 1);
+    }
+}
+
+static uint16_t gdb_read_reg(const State *state, GdbReg reg) {
+    switch (reg) {
+    case GDB_REG_A:
+    case GDB_REG_B:
+    case GDB_REG_C:
+    case GDB_REG_D:
+    case GDB_REG_E:
+    case GDB_REG_T:     return state->mem[0xfff0 | reg];
+    case GDB_REG_FLAGS: return state->f;
+    case GDB_REG_M:     return (uint16_t)((state->mh << 8) | state->ml);
+    case GDB_N_REGS:    break;
+    }
+
+    return 0;
+}
+
+static void gdb_write_reg(State *state, GdbReg reg, uint16_t value) {
+    switch (reg) {
+    case GDB_REG_A:
+    case GDB_REG_B:
+    case GDB_REG_C:
+    case GDB_REG_D:
+    case GDB_REG_E:
+    case GDB_REG_T:     state->mem[0xfff0 | reg] = (uint8_t)value; break;
+    case GDB_REG_FLAGS: state->f = value & 0x0f; break;
+    case GDB_REG_M:     state->mh = (uint8_t)(value >> 8); state->ml = (uint8_t)value; break;
+    case GDB_N_REGS:    break;
+    }
+}
+
+static size_t gdb_reg_size(GdbReg reg) {
+    return reg == GDB_REG_M ? 2 : 1;
+}
+
+// Binary agent expression operators, a b => q. The bytecode comes from the
+// connection, arithmetic wraps through the overflow builtins and shifted out
+// bits are masked off first, -fsanitize=integer traps on those. Division of
+// INT64_MIN by -1 overflows and fails like division by zero.
+static bool gdb_ax_binary(uint8_t op, int64_t a, int64_t b, int64_t *q) {
+    uint64_t ua = (uint64_t)a;
+    uint64_t ub = (uint64_t)b;
+    uint64_t uq;
+    bool overflow = b == -1 && a == INT64_MIN;
+
+    switch (op) {
+    case 0x02: __builtin_add_overflow(ua, ub, &uq); *q = (int64_t)uq; return true; // add
+    case 0x03: __builtin_sub_overflow(ua, ub, &uq); *q = (int64_t)uq; return true; // sub
+    case 0x04: __builtin_mul_overflow(ua, ub, &uq); *q = (int64_t)uq; return true; // mul
+    case 0x05: if (b == 0 || overflow) return false; *q = a / b; return true;     // div_signed
+    case 0x06: if (b == 0) return false; *q = (int64_t)(ua / ub); return true;    // div_unsigned
+    case 0x07: if (b == 0 || overflow) return false; *q = a % b; return true;     // rem_signed
+    case 0x08: if (b == 0) return false; *q = (int64_t)(ua % ub); return true;    // rem_unsigned
+    case 0x09: *q = (int64_t)((ua & (UINT64_MAX >> (b & 63))) << (b & 63)); return true; // lsh
+    case 0x0a: *q = a >> (b & 63); return true;               // rsh_signed
+    case 0x0b: *q = (int64_t)(ua >> (b & 63)); return true;  // rsh_unsigned
+    case 0x0f: *q = a & b; return true;                       // bit_and
+    case 0x10: *q = a | b; return true;                       // bit_or
+    case 0x11: *q = a ^ b; return true;                       // bit_xor
+    case 0x13: *q = a == b; return true;                      // equal
+    case 0x14: *q = a < b; return true;                       // less_signed
+    case 0x15: *q = ua < ub; return true;                     // less_unsigned
+    default:   return false;
+    }
+}
+
+// Evaluates a GDB agent expression, an unsupported or malformed expression
+// counts as true so the breakpoint is not silently ignored.
+static bool gdb_eval_condition(const uint8_t *code, size_t size, const State *state) {
+    int64_t stack[GDB_AX_STACK_SIZE];
+    int sp = 0;
+    size_t pc = 0;
+
+    while (pc < size) {
+        uint8_t op = code[pc++];
+
+        switch (op) {
+        case 0x02: case 0x03: case 0x04: case 0x05: case 0x06: case 0x07:
+        case 0x08: case 0x09: case 0x0a: case 0x0b: case 0x0f: case 0x10:
+        case 0x11: case 0x13: case 0x14: case 0x15: {
+            if (sp < 2) return true;
+            --sp;
+            if (!gdb_ax_binary(op, stack[sp - 1], stack[sp], &stack[sp - 1])) return true;
+        } break;
+
+        case 0x0e: // log_not
+            if (sp < 1) return true;
+            stack[sp - 1] = !stack[sp - 1];
+            break;
+
+        case 0x12: // bit_not
+            if (sp < 1) return true;
+            stack[sp - 1] = ~stack[sp - 1];
+            break;
+
+        case 0x16:   // ext n
+        case 0x2a: { // zero_ext n
+            if (sp < 1 || pc >= size) return true;
+            uint8_t bits = code[pc++];
+            if (bits == 0 || bits >= 64) break;
+            uint64_t mask = ((uint64_t)1 << bits) - 1;
+            uint64_t v = (uint64_t)stack[sp - 1] & mask;
+            if (op == 0x16 && ((v >> (bits - 1)) & 1)) v |= ~mask;
+            stack[sp - 1] = (int64_t)v;
+        } break;
+
+        case 0x17: // ref8
+            if (sp < 1) return true;
+            stack[sp - 1] = state->mem[stack[sp - 1] & 0xffff];
+            break;
+
+        case 0x18: { // ref16
+            if (sp < 1) return true;
+            uint16_t address = (uint16_t)stack[sp - 1];
+            stack[sp - 1] = (state->mem[address] << 8) | state->mem[(uint16_t)(address + 1)];
+        } break;
+
+        case 0x20:   // if_goto
+        case 0x21: { // goto
+            if (pc + 2 > size || (op == 0x20 && sp < 1)) return true;
+            size_t target = (size_t)((code[pc] << 8) | code[pc + 1]);
+            pc += 2;
+            if (op == 0x21 || stack[--sp] != 0) pc = target;
+        } break;
+
+        case 0x22:   // const8
+        case 0x23:   // const16
+        case 0x24:   // const32
+        case 0x25: { // const64
+            size_t n = (size_t)1 << (op - 0x22);
+            if (pc + n > size || sp == GDB_AX_STACK_SIZE) return true;
+            uint64_t v = 0;
+            for (size_t i = 0; i < n; ++i) v = (v << 8) | code[pc++];
+            stack[sp++] = (int64_t)v;
+        } break;
+
+        case 0x26: { // reg n
+            if (pc + 2 > size || sp == GDB_AX_STACK_SIZE) return true;
+            unsigned reg = (unsigned)((code[pc] << 8) | code[pc + 1]);
+            pc += 2;
+            if (reg >= GDB_N_REGS) return true;
+            stack[sp++] = gdb_read_reg(state, (GdbReg)reg);
+        } break;
+
+        case 0x27: // end
+            return sp == 0 || stack[sp - 1] != 0;
+
+        case 0x28: // dup
+            if (sp < 1 || sp == GDB_AX_STACK_SIZE) return true;
+            stack[sp] = stack[sp - 1];
+            ++sp;
+            break;
+
+        case 0x29: // pop
+            if (sp < 1) return true;
+            --sp;
+            break;
+
+        case 0x2b: { // swap
+            if (sp < 2) return true;
+            int64_t b = stack[sp - 1];
+            stack[sp - 1] = stack[sp - 2];
+            stack[sp - 2] = b;
+        } break;
+
+        case 0x32: { // pick n
+            if (pc >= size || sp == GDB_AX_STACK_SIZE) return true;
+            int n = code[pc++];
+            if (n >= sp) return true;
+            stack[sp] = stack[sp - 1 - n];
+            ++sp;
+        } break;
+
+        case 0x33: { // rot, a b c => c a b
+            if (sp < 3) return true;
+            int64_t c = stack[sp - 1];
+            stack[sp - 1] = stack[sp - 2];
+            stack[sp - 2] = stack[sp - 3];
+            stack[sp - 3] = c;
+        } break;
+
+        default: return true;
+        }
+    }
+
+    return true;
+}
+
+static GdbBreakpoint *gdb_find_breakpoint(Gdb *gdb, uint16_t address) {
+    for (size_t i = 0; i < gdb->n_breakpoints; ++i)
+        if (gdb->breakpoints[i].address == address) return &gdb->breakpoints[i];
+
+    return NULL;
+}
+
+static bool gdb_breakpoint_hit(Gdb *gdb, const State *state, uint16_t pc) {
+    const GdbBreakpoint *bp = gdb_find_breakpoint(gdb, pc);
+
+    if (bp == NULL) return false;
+    if (bp->n_conditions == 0) return true;
+
+    for (int i = 0; i < bp->n_conditions; ++i)
+        if (gdb_eval_condition(bp->conditions[i], bp->condition_size[i], state)) return true;
+
+    return false;
+}
+
+// Parses "addr,kind[;X len,expr]..." of a Z0/Z1 packet.
+static bool gdb_insert_breakpoint(Gdb *gdb, const char *p) {
+    uint16_t address = (uint16_t)gdb_parse_hex(&p);
+
+    GdbBreakpoint *bp = gdb_find_breakpoint(gdb, address);
+
+    if (bp == NULL) {
+        if (gdb->n_breakpoints == GDB_MAX_BREAKPOINTS) return false;
+        bp = &gdb->breakpoints[gdb->n_breakpoints++];
+    }
+
+    bp->address = address;
+    bp->n_conditions = 0;
+
+    while ((p = strchr(p, ';')) != NULL && p[1] == 'X') {
+        p += 2;
+
+        size_t size = gdb_parse_hex(&p);
+
+        if (*p++ != ',' || size > GDB_MAX_CONDITION_SIZE || bp->n_conditions == GDB_MAX_CONDITIONS) return false;
+        if (!gdb_parse_hex_bytes(p, size, bp->conditions[bp->n_conditions])) return false;
+
+        bp->condition_size[bp->n_conditions++] = (uint8_t)size;
+        p += 2 * size;
+    }
+
+    return true;
+}
+
+static void gdb_remove_breakpoint(Gdb *gdb, uint16_t address) {
+    GdbBreakpoint *bp = gdb_find_breakpoint(gdb, address);
+
+    if (bp != NULL) *bp = gdb->breakpoints[--gdb->n_breakpoints];
+}
+
+static bool gdb_insert_watchpoint(Gdb *gdb, GdbWatchType type, uint16_t address, uint16_t length) {
+    if (gdb->n_watchpoints == GDB_MAX_WATCHPOINTS) return false;
+
+    gdb->watchpoints[gdb->n_watchpoints++] = (GdbWatchpoint){ .address = address, .length = length, .type = type };
+
+    return true;
+}
+
+static void gdb_remove_watchpoint(Gdb *gdb, GdbWatchType type, uint16_t address, uint16_t length) {
+    for (size_t i = 0; i < gdb->n_watchpoints; ++i) {
+        GdbWatchpoint *wp = &gdb->watchpoints[i];
+
+        if (wp->type == type && wp->address == address && wp->length == length) {
+            *wp = gdb->watchpoints[--gdb->n_watchpoints];
+            return;
+        }
+    }
+}
+
+static void gdb_update_watch(Gdb *gdb) {
+    watch_reset(gdb->watch);
+
+    for (size_t i = 0; i < gdb->n_breakpoints; ++i)
+        watch_set(gdb->watch, gdb->breakpoints[i].address, WATCH_FETCH);
+
+    for (size_t i = 0; i < gdb->n_watchpoints; ++i) {
+        const GdbWatchpoint *wp = &gdb->watchpoints[i];
+
+        uint8_t kinds = wp->type == GDB_WATCH_WRITE ? WATCH_WRITE
+                      : wp->type == GDB_WATCH_READ  ? WATCH_READ
+                      :                               (WATCH_READ | WATCH_WRITE);
+
+        for (uint32_t j = 0; j < wp->length; ++j)
+            watch_set(gdb->watch, (uint16_t)(wp->address + j), kinds);
+    }
+}
+
+static const GdbWatchpoint *gdb_find_watchpoint(const Gdb *gdb, uint8_t hit, uint16_t address) {
+    for (size_t i = 0; i < gdb->n_watchpoints; ++i) {
+        const GdbWatchpoint *wp = &gdb->watchpoints[i];
+
+        if ((uint16_t)(address - wp->address) >= wp->length) continue;
+
+        if ((wp->type == GDB_WATCH_WRITE  && (hit & WATCH_WRITE)) ||
+            (wp->type == GDB_WATCH_READ   && (hit & WATCH_READ))  ||
+            (wp->type == GDB_WATCH_ACCESS)) return wp;
+    }
+
+    return NULL;
+}
+
+// Slow path for a WatchMap hit before the next cycle, returns the signal to
+// stop with right away or 0 to keep running.
+static int gdb_watch_hit(Gdb *gdb, const State *state, uint8_t hit) {
+    if (hit & WATCH_FETCH) {
+        uint16_t pc = (uint16_t)((state->mh << 8) | state->ml);
+
+        return !gdb->resumed && gdb_breakpoint_hit(gdb, state, pc) ? GDB_SIGTRAP : 0;
+    }
+
+    if (hit & WATCH_STACK) gdb->stack_hit = true;
+
+    if (!(hit & (WATCH_READ | WATCH_WRITE))) return 0;
+
+    uint16_t address = emulate_mem_bus(state);
+    const GdbWatchpoint *wp = gdb_find_watchpoint(gdb, hit, address);
+
+    if (wp != NULL) {
+        gdb->watch_hit = wp;
+        gdb->watch_hit_address = address;
+    }
+
+    return 0;
+}
+
+static bool gdb_interrupted(Gdb *gdb) {
+    uint8_t c;
+
+    if (recv(gdb->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) != 1 || c != 0x03) return false;
+
+    recv(gdb->fd, &c, 1, 0);
+
+    return true;
+}
+
+// Call after every emulated cycle while gdb is attached, returns the signal
+// to report or 0 to keep running.
+static int gdb_after_cycle(Gdb *gdb, bool instr_done) {
+    gdb->resumed = false;
+
+    if (gdb->resume == GDB_RESUME_STEP_CYCLE) return GDB_SIGTRAP;
+
+    if (!instr_done) return 0;
+
+    if (gdb->stack_hit) return GDB_SIGSEGV;
+    if (gdb->resume == GDB_RESUME_STEP) return GDB_SIGTRAP;
+    if (gdb->watch_hit != NULL) return GDB_SIGTRAP;
+
+    if (++gdb->interrupt_poll == GDB_INTERRUPT_POLL_CYCLES) {
+        gdb->interrupt_poll = 0;
+        if (gdb_interrupted(gdb)) return GDB_SIGINT;
+    }
+
+    return 0;
+}
+
+static void gdb_stop_reply(Gdb *gdb, int signal) {
+    if (gdb->watch_hit != NULL) {
+        const char *kind = gdb->watch_hit->type == GDB_WATCH_WRITE ? "watch"
+                         : gdb->watch_hit->type == GDB_WATCH_READ  ? "rwatch"
+                         :                                           "awatch";
+
+        snprintf(gdb->reply, sizeof(gdb->reply), "T%02x%s:%04x;", signal, kind, gdb->watch_hit_address);
+        gdb->watch_hit = NULL;
+    } else {
+        snprintf(gdb->reply, sizeof(gdb->reply), "S%02x", signal);
+    }
+
+    gdb->stack_hit = false;
+
+    gdb_send_packet(gdb, gdb->reply);
+}
+
+static void gdb_send_output(Gdb *gdb, const char *output) {
+    char *p = gdb->reply;
+    *p++ = 'O';
+    for (; *output && p < gdb->reply + GDB_PACKET_SIZE - 2; ++output) p = gdb_append_hex(p, (uint8_t)*output);
+
+    gdb_send_packet(gdb, gdb->reply);
+}
+
+static void gdb_reverse_step(Gdb *gdb, State *state) {
+    Reverse *reverse = gdb->reverse;
+    uint64_t now = state->cycle;
+    uint64_t target = now - 1;
+
+    if (now == 0 || !reverse_restore(reverse, now - 1, state)) {
+        reverse_goto(reverse, gdb->control, gdb->alu, state, reverse_first_cycle(reverse));
+        gdb_send_packet(gdb, "T05replaylog:begin;");
+        return;
+    }
+
+    if (!gdb->step_cycles) {
+        // Checkpoints are at instruction boundaries, find the last one before now.
+        target = state->cycle;
+
+        while (state->cycle < now)
+            if (reverse_replay_cycle(reverse, gdb->control, gdb->alu, state) && state->cycle < now)
+                target = state->cycle;
+    }
+
+    reverse_goto(reverse, gdb->control, gdb->alu, state, target);
+    gdb_stop_reply(gdb, GDB_SIGTRAP);
+}
+
+// Replays the checkpoint intervals before the current cycle, latest first,
+// until one of them has a breakpoint or watchpoint hit.
+static void gdb_reverse_continue(Gdb *gdb, State *state) {
+    Reverse *reverse = gdb->reverse;
+    uint64_t now = state->cycle;
+
+    bool found = false;
+    uint64_t hit_cycle = 0;
+    const GdbWatchpoint *hit_wp = NULL;
+    uint16_t hit_address = 0;
+
+    size_t i = reverse->n_checkpoints;
+    while (i > 0 && reverse->checkpoints[i - 1].cycle >= now) --i;
+
+    for (; i > 0 && !found; --i) {
+        uint64_t end = i < reverse->n_checkpoints && reverse->checkpoints[i].cycle < now
+                     ? reverse->checkpoints[i].cycle
+                     : now;
+
+        reverse_restore(reverse, reverse->checkpoints[i - 1].cycle, state);
+
+        const GdbWatchpoint *pending_wp = NULL;
+        uint16_t pending_address = 0;
+
+        while (state->cycle < end) {
+            uint8_t hit = watch_check(gdb->watch, state, emulate_control_signals(gdb->control, state));
+
+            if (hit & WATCH_FETCH) {
+                if (gdb_breakpoint_hit(gdb, state, (uint16_t)((state->mh << 8) | state->ml))) {
+                    found = true;
+                    hit_cycle = state->cycle;
+                    hit_wp = NULL;
+                }
+            } else if (hit & (WATCH_READ | WATCH_WRITE)) {
+                uint16_t address = emulate_mem_bus(state);
+                const GdbWatchpoint *wp = gdb_find_watchpoint(gdb, hit, address);
+
+                if (wp != NULL && pending_wp == NULL) {
+                    pending_wp = wp;
+                    pending_address = address;
+                }
+            }
+
+            if (reverse_replay_cycle(reverse, gdb->control, gdb->alu, state) && pending_wp != NULL) {
+                if (state->cycle < now) {
+                    found = true;
+                    hit_cycle = state->cycle;
+                    hit_wp = pending_wp;
+                    hit_address = pending_address;
+                }
+
+                pending_wp = NULL;
+            }
+        }
+    }
+
+    if (!found) {
+        reverse_goto(reverse, gdb->control, gdb->alu, state, reverse_first_cycle(reverse));
+        gdb_send_packet(gdb, "T05replaylog:begin;");
+        return;
+    }
+
+    reverse_goto(reverse, gdb->control, gdb->alu, state, hit_cycle);
+
+    gdb->watch_hit = hit_wp;
+    gdb->watch_hit_address = hit_address;
+    gdb_stop_reply(gdb, GDB_SIGTRAP);
+}
+
+static void gdb_monitor(Gdb *gdb, State *state, const char *hex) {
+    char command[128] = {0};
+    size_t n = strlen(hex) / 2;
+
+    if (n >= sizeof(command) || !gdb_parse_hex_bytes(hex, n, (uint8_t *)command)) {
+        gdb_send_packet(gdb, "E01");
+        return;
+    }
+
+    char output[256];
+
+    if (strcmp(command, "step cycle") == 0) {
+        gdb->step_cycles = true;
+        snprintf(output, sizeof(output), "stepi executes one micro-step\n");
+    } else if (strcmp(command, "step instruction") == 0) {
+        gdb->step_cycles = false;
+        snprintf(output, sizeof(output), "stepi executes one instruction\n");
+    } else if (strcmp(command, "cycle") == 0) {
+        if (gdb->reverse != NULL)
+            snprintf(output, sizeof(output), "cycle %llu, reachable %llu..%llu\n",
+                (unsigned long long)state->cycle,
+                (unsigned long long)reverse_first_cycle(gdb->reverse),
+                (unsigned long long)gdb->reverse->present);
+        else
+            snprintf(output, sizeof(output), "cycle %llu\n", (unsigned long long)state->cycle);
+    } else if (strncmp(command, "goto ", 5) == 0 && gdb->reverse != NULL) {
+        uint64_t cycle = strtoull(command + 5, NULL, 0);
+
+        if (reverse_goto(gdb->reverse, gdb->control, gdb->alu, state, cycle))
+            snprintf(output, sizeof(output), "at cycle %llu, run 'maintenance flush register-cache'\n", (unsigned long long)cycle);
+        else
+            snprintf(output, sizeof(output), "cycle %llu is outside %llu..%llu\n",
+                (unsigned long long)cycle,
+                (unsigned long long)reverse_first_cycle(gdb->reverse),
+                (unsigned long long)gdb->reverse->present);
+    } else {
+        snprintf(output, sizeof(output), "commands: step cycle, step instruction, cycle%s\n",
+            gdb->reverse != NULL ? ", goto <cycle>" : "");
+    }
+
+    gdb_send_output(gdb, output);
+    gdb_send_packet(gdb, "OK");
+}
+
+static void gdb_read_features(Gdb *gdb, const char *p) {
+    if (strncmp(p, "target.xml:", 11) != 0) {
+        gdb_send_packet(gdb, "E00");
+        return;
+    }
+
+    p += 11;
+    size_t offset = gdb_parse_hex(&p);
+    ++p;
+    size_t length = gdb_parse_hex(&p);
+    size_t size = strlen(GDB_TARGET_XML);
+
+    if (offset >= size) {
+        gdb_send_packet(gdb, "l");
+        return;
+    }
+
+    if (length > GDB_PACKET_SIZE - 1) length = GDB_PACKET_SIZE - 1;
+    if (length > size - offset) length = size - offset;
+
+    gdb->reply[0] = offset + length < size ? 'm' : 'l';
+    memcpy(gdb->reply + 1, GDB_TARGET_XML + offset, length);
+    gdb->reply[length + 1] = 0;
+
+    gdb_send_packet(gdb, gdb->reply);
+}
+
+// Handles one packet, returns true when execution should resume.
+static bool gdb_handle_packet(Gdb *gdb, State *state, int signal) {
+    const char *p = gdb->packet;
+    char *r = gdb->reply;
+    r[0] = 0;
+
+    switch (*p++) {
+    case '?':
+        snprintf(r, sizeof(gdb->reply), "S%02x", signal);
+        break;
+
+    case 'g':
+        for (GdbReg reg = 0; reg < GDB_N_REGS; ++reg) {
+            uint16_t value = gdb_read_reg(state, reg);
+            if (gdb_reg_size(reg) == 2) r = gdb_append_hex(r, (uint8_t)(value >> 8));
+            r = gdb_append_hex(r, (uint8_t)value);
+        }
+        break;
+
+    case 'G':
+        for (GdbReg reg = 0; reg < GDB_N_REGS; ++reg) {
+            uint8_t bytes[2];
+            size_t size = gdb_reg_size(reg);
+
+            if (!gdb_parse_hex_bytes(p, size, bytes)) break;
+
+            gdb_write_reg(state, reg, size == 2 ? (uint16_t)((bytes[0] << 8) | bytes[1]) : bytes[0]);
+            p += 2 * size;
+        }
+        if (gdb->reverse != NULL) reverse_truncate(gdb->reverse, state);
+        strcpy(r, "OK");
+        break;
+
+    case 'p': {
+        uint32_t reg = gdb_parse_hex(&p);
+
+        if (reg >= GDB_N_REGS) {
+            strcpy(r, "E01");
+            break;
+        }
+
+        uint16_t value = gdb_read_reg(state, (GdbReg)reg);
+        if (gdb_reg_size((GdbReg)reg) == 2) r = gdb_append_hex(r, (uint8_t)(value >> 8));
+        gdb_append_hex(r, (uint8_t)value);
+    } break;
+
+    case 'P': {
+        uint32_t reg = gdb_parse_hex(&p);
+        uint8_t bytes[2];
+
+        if (reg >= GDB_N_REGS || *p++ != '=' || !gdb_parse_hex_bytes(p, gdb_reg_size((GdbReg)reg), bytes)) {
+            strcpy(r, "E01");
+            break;
+        }
+
+        gdb_write_reg(state, (GdbReg)reg, gdb_reg_size((GdbReg)reg) == 2 ? (uint16_t)((bytes[0] << 8) | bytes[1]) : bytes[0]);
+        if (gdb->reverse != NULL) reverse_truncate(gdb->reverse, state);
+        strcpy(r, "OK");
+    } break;
+
+    case 'm': {
+        uint32_t address = gdb_parse_hex(&p);
+        ++p;
+        uint32_t length = gdb_parse_hex(&p);
+
+        if (length > GDB_PACKET_SIZE / 2) length = GDB_PACKET_SIZE / 2;
+
+        for (uint32_t i = 0; i < length; ++i)
+            r = gdb_append_hex(r, state->mem[(address + i) & 0xffff]);
+    } break;
+
+    case 'M': {
+        uint32_t address = gdb_parse_hex(&p);
+        ++p;
+        uint32_t length = gdb_parse_hex(&p);
+        ++p;
+
+        for (uint32_t i = 0; i < length; ++i) {
+            uint8_t byte;
+
+            if (!gdb_parse_hex_bytes(p + 2 * i, 1, &byte)) break;
+
+            state->mem[(address + i) & 0xffff] = byte;
+        }
+        if (gdb->reverse != NULL) reverse_truncate(gdb->reverse, state);
+        strcpy(r, "OK");
+    } break;
+
+    case 'c':
+        gdb->resume = GDB_RESUME_CONTINUE;
+        return true;
+
+    case 'b':
+        if (gdb->reverse == NULL) break;
+
+        if (*p == 's') {
+            gdb_reverse_step(gdb, state);
+            return false;
+        } else if (*p == 'c') {
+            gdb_reverse_continue(gdb, state);
+            return false;
+        }
+        break;
+
+    case 's':
+        gdb->resume = gdb->step_cycles ? GDB_RESUME_STEP_CYCLE : GDB_RESUME_STEP;
+        return true;
+
+    case 'Z':
+    case 'z': {
+        bool insert = gdb->packet[0] == 'Z';
+        uint32_t type = gdb_parse_hex(&p);
+
+        if (*p++ != ',') {
+            strcpy(r, "E01");
+            break;
+        }
+
+        if (type == 0 || type == 1) {
+            if (insert) {
+                strcpy(r, gdb_insert_breakpoint(gdb, p) ? "OK" : "E01");
+            } else {
+                gdb_remove_breakpoint(gdb, (uint16_t)gdb_parse_hex(&p));
+                strcpy(r, "OK");
+            }
+
+            gdb_update_watch(gdb);
+        } else if (type >= GDB_WATCH_WRITE && type <= GDB_WATCH_ACCESS) {
+            uint16_t address = (uint16_t)gdb_parse_hex(&p);
+            ++p;
+            uint16_t length = (uint16_t)gdb_parse_hex(&p);
+
+            if (insert) {
+                strcpy(r, gdb_insert_watchpoint(gdb, (GdbWatchType)type, address, length) ? "OK" : "E01");
+            } else {
+                gdb_remove_watchpoint(gdb, (GdbWatchType)type, address, length);
+                strcpy(r, "OK");
+            }
+
+            gdb_update_watch(gdb);
+        }
+    } break;
+
+    case 'D':
+        gdb_send_packet(gdb, "OK");
+        gdb->resume = GDB_RESUME_DETACH;
+        return true;
+
+    case 'k':
+        gdb->resume = GDB_RESUME_KILL;
+        return true;
+
+    case 'H':
+        strcpy(r, "OK");
+        break;
+
+    case 'q':
+        if (strncmp(p, "Supported", 9) == 0) {
+            snprintf(r, sizeof(gdb->reply),
+                "PacketSize=%x;QStartNoAckMode+;ConditionalBreakpoints+;swbreak+;hwbreak+;qXfer:features:read+%s",
+                GDB_PACKET_SIZE,
+                gdb->reverse != NULL ? ";ReverseStep+;ReverseContinue+" : "");
+        } else if (strcmp(p, "Attached") == 0) {
+            strcpy(r, "1");
+        } else if (strcmp(p, "C") == 0) {
+            strcpy(r, "QC1");
+        } else if (strcmp(p, "fThreadInfo") == 0) {
+            strcpy(r, "m1");
+        } else if (strcmp(p, "sThreadInfo") == 0) {
+            strcpy(r, "l");
+        } else if (strncmp(p, "Xfer:features:read:", 19) == 0) {
+            gdb_read_features(gdb, p + 19);
+            return false;
+        } else if (strncmp(p, "Rcmd,", 5) == 0) {
+            gdb_monitor(gdb, state, p + 5);
+            return false;
+        }
+        break;
+
+    case 'Q':
+        if (strcmp(p, "StartNoAckMode") == 0) {
+            gdb_send_packet(gdb, "OK");
+            gdb->no_ack = true;
+            return false;
+        }
+        break;
+
+    default: break;
+    }
+
+    gdb_send_packet(gdb, gdb->reply);
+
+    return false;
+}
+
+// Serves gdb until it resumes execution, sending a stop reply first unless
+// signal is 0, as on the initial connection.
+static GdbResume gdb_stop(Gdb *gdb, State *state, int signal) {
+    if (signal != 0) gdb_stop_reply(gdb, signal);
+
+    for (;;) {
+        if (gdb_read_packet(gdb) < 0) {
+            printf("gdb disconnected\n");
+            gdb->resume = GDB_RESUME_DETACH;
+            break;
+        }
+
+        if (gdb_handle_packet(gdb, state, signal != 0 ? signal : GDB_SIGTRAP)) break;
+    }
+
+    if (gdb->resume == GDB_RESUME_DETACH || gdb->resume == GDB_RESUME_KILL) {
+        watch_reset(gdb->watch);
+        gdb_close(gdb);
+    }
+
+    gdb->resumed = true;
+
+    return gdb->resume;
+}
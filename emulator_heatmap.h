@@ -0,0 +1,235 @@
+// Memory access heatmap, enabled with -m path[:cycles].
+//
+// Reads and writes are counted per address in 16 bit counters that stop at
+// their maximum, and exactly per 256 byte page. Opcode fetches, step 0, are
+// counted apart from data reads so code does not hide data. The run is cut
+// into phases of `cycles` and the number of addresses and pages touched in
+// each is its working set. At exit path gets per page counts, a heatmap of
+// the pages and of the register file page, the hottest addresses and the
+// working set per phase.
+
+#define HEATMAP_DEFAULT_PHASE (1 << 20)
+
+typedef enum {
+    HEAT_FETCH,
+    HEAT_READ,
+    HEAT_WRITE,
+    HEAT_N_KINDS
+} HeatKind;
+
+static const char *HEAT_KIND_NAME[HEAT_N_KINDS] = { "fetch", "read", "write" };
+
+typedef struct {
+    uint64_t cycle;
+    uint32_t addresses;
+    uint32_t pages;
+    uint32_t written_addresses;
+} HeatmapPhase;
+
+typedef struct {
+    uint16_t counts[HEAT_N_KINDS][0x10000]; // Saturating.
+    uint64_t pages[HEAT_N_KINDS][0x100];
+
+    uint64_t phase_cycles;
+    uint64_t phase_start;
+    uint8_t touched[0x10000 / 8];
+    uint8_t written[0x10000 / 8];
+
+    HeatmapPhase *phases;
+    size_t n_phases;
+    size_t capacity;
+} Heatmap;
+
+static void heatmap_init(Heatmap *heatmap, uint64_t phase_cycles, const State *state) {
+    heatmap->phase_cycles = phase_cycles;
+    heatmap->phase_start = state->cycle;
+}
+
+static uint32_t heatmap_popcount(const uint8_t *bits, size_t n) {
+    uint32_t count = 0;
+
+    for (size_t i = 0; i < n; ++i) count += (uint32_t)__builtin_popcount(bits[i]);
+
+    return count;
+}
+
+static void heatmap_end_phase(Heatmap *heatmap) {
+    if (heatmap->n_phases == heatmap->capacity) {
+        heatmap->capacity = heatmap->capacity == 0 ? 256 : 2 * heatmap->capacity;
+        heatmap->phases = realloc(heatmap->phases, heatmap->capacity * sizeof(HeatmapPhase));
+
+        if (heatmap->phases == NULL) {
+            fprintf(stderr, "Failed to grow heatmap phases\n");
+            exit(1);
+        }
+    }
+
+    uint32_t pages = 0;
+
+    for (int page = 0; page < 0x100; ++page)
+        for (int i = 0; i < 32; ++i)
+            if (heatmap->touched[page * 32 + i]) {
+                ++pages;
+                break;
+            }
+
+    heatmap->phases[heatmap->n_phases++] = (HeatmapPhase){
+        .cycle = heatmap->phase_start,
+        .addresses = heatmap_popcount(heatmap->touched, sizeof(heatmap->touched)),
+        .pages = pages,
+        .written_addresses = heatmap_popcount(heatmap->written, sizeof(heatmap->written)),
+    };
+
+    memset(heatmap->touched, 0, sizeof(heatmap->touched));
+    memset(heatmap->written, 0, sizeof(heatmap->written));
+}
+
+// Call before the cycle is run, with its control signals.
+static inline void heatmap_count(Heatmap *heatmap, uint16_t signals, const State *state) {
+    // A reload or reverse step going back also ends the phase.
+    if (state->cycle < heatmap->phase_start || state->cycle - heatmap->phase_start >= heatmap->phase_cycles) {
+        heatmap_end_phase(heatmap);
+        heatmap->phase_start = state->cycle;
+    }
+
+    if (!(signals & (OE_MEM | LD_MEM))) return;
+
+    uint16_t address = emulate_mem_bus(state);
+    HeatKind kind = (signals & LD_MEM) ? HEAT_WRITE : state->s == 0 ? HEAT_FETCH : HEAT_READ;
+    uint16_t *count = &heatmap->counts[kind][address];
+
+    *count = (uint16_t)(*count + (*count != 0xffff));
+    ++heatmap->pages[kind][address >> 8];
+
+    heatmap->touched[address >> 3] |= (uint8_t)(1 << (address & 7));
+    if (kind == HEAT_WRITE) heatmap->written[address >> 3] |= (uint8_t)(1 << (address & 7));
+}
+
+// One character per cell, on a log scale of the hottest cell.
+static void heatmap_grid(FILE *f, const uint64_t cells[256], const char *row_format) {
+    const char shades[] = " .:-=+*#%@";
+    uint64_t max = 0;
+
+    for (int i = 0; i < 256; ++i)
+        if (cells[i] > max) max = cells[i];
+
+    int max_log2 = max > 0 ? 63 - __builtin_clzll(max) : 0;
+
+    fprintf(f, "      0123456789abcdef\n");
+
+    for (int row = 0; row < 16; ++row) {
+        fprintf(f, row_format, row);
+
+        for (int col = 0; col < 16; ++col) {
+            uint64_t count = cells[row * 16 + col];
+            int shade = count == 0 ? 0
+                      : max_log2 == 0 ? 9
+                      : 1 + 8 * (63 - __builtin_clzll(count)) / max_log2;
+
+            fputc(shades[shade], f);
+        }
+
+        fprintf(f, "\n");
+    }
+}
+
+typedef struct {
+    uint16_t address;
+    uint32_t accesses;
+} HeatmapAddress;
+
+static int heatmap_address_compare(const void *a, const void *b) {
+    const HeatmapAddress *ha = a;
+    const HeatmapAddress *hb = b;
+
+    return ha->accesses < hb->accesses ? 1 : ha->accesses > hb->accesses ? -1 : (int)ha->address - (int)hb->address;
+}
+
+static bool heatmap_write(Heatmap *heatmap, const State *state, const char *path) {
+    if (state->cycle > heatmap->phase_start) heatmap_end_phase(heatmap);
+
+    FILE *f = fopen(path, "w");
+
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    uint64_t totals[HEAT_N_KINDS] = {0};
+    uint64_t pages[256];
+
+    for (int page = 0; page < 0x100; ++page) {
+        pages[page] = 0;
+
+        for (int k = 0; k < HEAT_N_KINDS; ++k) {
+            totals[k] += heatmap->pages[k][page];
+            pages[page] += heatmap->pages[k][page];
+        }
+    }
+
+    uint64_t total = totals[HEAT_FETCH] + totals[HEAT_READ] + totals[HEAT_WRITE];
+
+    fprintf(f, "%llu accesses, %llu fetches, %llu reads, %llu writes\n",
+        (unsigned long long)total, (unsigned long long)totals[HEAT_FETCH],
+        (unsigned long long)totals[HEAT_READ], (unsigned long long)totals[HEAT_WRITE]);
+
+    fprintf(f, "register file page ff has %.2f%% of data accesses\n",
+        totals[HEAT_READ] + totals[HEAT_WRITE] > 0
+            ? 100.0 * (double)(heatmap->pages[HEAT_READ][0xff] + heatmap->pages[HEAT_WRITE][0xff]) /
+              (double)(totals[HEAT_READ] + totals[HEAT_WRITE])
+            : 0);
+
+    fprintf(f, "\npage %14s %14s %14s %7s\n", HEAT_KIND_NAME[HEAT_FETCH], HEAT_KIND_NAME[HEAT_READ], HEAT_KIND_NAME[HEAT_WRITE], "%");
+
+    for (int page = 0; page < 0x100; ++page) {
+        if (pages[page] == 0) continue;
+
+        fprintf(f, "  %02x %14llu %14llu %14llu %6.2f%%\n", page,
+            (unsigned long long)heatmap->pages[HEAT_FETCH][page], (unsigned long long)heatmap->pages[HEAT_READ][page],
+            (unsigned long long)heatmap->pages[HEAT_WRITE][page], 100.0 * (double)pages[page] / (double)total);
+    }
+
+    fprintf(f, "\npages, all accesses\n");
+    heatmap_grid(f, pages, "    %x ");
+
+    for (int k = HEAT_READ; k < HEAT_N_KINDS; ++k) {
+        uint64_t cells[256];
+
+        for (int i = 0; i < 256; ++i) cells[i] = heatmap->counts[k][0xff00 | i];
+
+        fprintf(f, "\npage ff, %s\n", HEAT_KIND_NAME[k]);
+        heatmap_grid(f, cells, "  ff%x ");
+    }
+
+    static HeatmapAddress addresses[0x10000];
+
+    for (uint32_t i = 0; i < 0x10000; ++i)
+        addresses[i] = (HeatmapAddress){ (uint16_t)i, (uint32_t)heatmap->counts[HEAT_READ][i] + heatmap->counts[HEAT_WRITE][i] };
+
+    qsort(addresses, 0x10000, sizeof(addresses[0]), heatmap_address_compare);
+
+    fprintf(f, "\nhottest data addresses, counts stop at 65535\n");
+
+    for (int i = 0; i < 32 && addresses[i].accesses > 0; ++i) {
+        uint16_t address = addresses[i].address;
+
+        fprintf(f, "  %04x %6u reads %6u writes\n", address, heatmap->counts[HEAT_READ][address], heatmap->counts[HEAT_WRITE][address]);
+    }
+
+    fprintf(f, "\nworking set per phase of %llu cycles\n", (unsigned long long)heatmap->phase_cycles);
+    fprintf(f, "%14s %9s %9s %9s\n", "cycle", "addresses", "pages", "written");
+
+    for (size_t i = 0; i < heatmap->n_phases; ++i) {
+        const HeatmapPhase *phase = &heatmap->phases[i];
+
+        fprintf(f, "%14llu %9u %9u %9u\n", (unsigned long long)phase->cycle, phase->addresses, phase->pages, phase->written_addresses);
+    }
+
+    fclose(f);
+
+    free(heatmap->phases);
+
+    printf("memory heatmap written to %s\n", path);
+
+    return true;
+}
@@ -0,0 +1,119 @@
+#include <sys/stat.h> // stat
+#include <time.h> // clock_gettime
+
+// Files are polled every HOT_RELOAD_POLL_NS of wall time, the clock is read
+// every HOT_RELOAD_CLOCK_CYCLES emulated cycles. A change is applied after it
+// has been stable for one full poll interval so a half written file is never
+// picked up.
+#define HOT_RELOAD_POLL_NS 50000000
+#define HOT_RELOAD_CLOCK_CYCLES (1 << 12)
+
+typedef struct {
+    const char *path;
+    struct timespec mtime;
+    ino_t ino;
+    off_t size;
+    bool settling;
+} HotReloadFile;
+
+typedef struct {
+    HotReloadFile control;
+    HotReloadFile alu;
+    HotReloadFile program;
+    uint64_t next_poll_ns;
+} HotReload;
+
+// Nanoseconds, a rebuild within the same second as the last change still
+// moves it.
+static struct timespec hot_reload_mtime(const struct stat *st) {
+#ifdef __APPLE__
+    return st->st_mtimespec;
+#else
+    return st->st_mtim;
+#endif
+}
+
+static void hot_reload_watch(HotReloadFile *file, const char *path) {
+    struct stat st;
+
+    file->path = path;
+    file->settling = false;
+
+    if (stat(path, &st) == 0) {
+        file->mtime = hot_reload_mtime(&st);
+        file->ino = st.st_ino;
+        file->size = st.st_size;
+    }
+}
+
+// Call every HOT_RELOAD_CLOCK_CYCLES, returns true once per poll interval.
+static bool hot_reload_due(HotReload *reload) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+
+    if (now < reload->next_poll_ns) return false;
+
+    reload->next_poll_ns = now + HOT_RELOAD_POLL_NS;
+    return true;
+}
+
+static bool hot_reload_poll_file(HotReloadFile *file) {
+    struct stat st;
+
+    if (file->path == NULL || stat(file->path, &st) != 0) return false;
+
+    struct timespec mtime = hot_reload_mtime(&st);
+
+    if (mtime.tv_sec != file->mtime.tv_sec || mtime.tv_nsec != file->mtime.tv_nsec ||
+        st.st_ino != file->ino || st.st_size != file->size) {
+        file->mtime = mtime;
+        file->ino = st.st_ino;
+        file->size = st.st_size;
+        file->settling = true;
+        return false;
+    }
+
+    if (!file->settling) return false;
+
+    file->settling = false;
+    return true;
+}
+
+// Must be called at an instruction boundary, returns true if anything was
+// reloaded.
+static bool hot_reload_apply(
+    HotReload *reload,
+    uint8_t control[CONTROL_ROM_SIZE],
+    uint8_t alu[ALU_ROM_SIZE],
+    State *state,
+    const State *boot_state) {
+
+    static uint8_t rom[ALU_ROM_SIZE];
+    bool reloaded = false;
+
+    if (hot_reload_poll_file(&reload->control) && read_rom(reload->control.path, CONTROL_ROM_SIZE, rom)) {
+        memcpy(control, rom, CONTROL_ROM_SIZE);
+        printf("reloaded %s\n", reload->control.path);
+        reloaded = true;
+    }
+
+    if (hot_reload_poll_file(&reload->alu) && read_rom(reload->alu.path, ALU_ROM_SIZE, rom)) {
+        memcpy(alu, rom, ALU_ROM_SIZE);
+        printf("reloaded %s\n", reload->alu.path);
+        reloaded = true;
+    }
+
+    if (hot_reload_poll_file(&reload->program)) {
+        State restarted = *boot_state;
+
+        if (load_program(reload->program.path, &restarted)) {
+            *state = restarted;
+            printf("reloaded %s, restarted from post-init state\n", reload->program.path);
+            reloaded = true;
+        }
+    }
+
+    return reloaded;
+}
@@ -0,0 +1,323 @@
+#include <zlib.h>
+
+// Instruction trace for long runs, written with -T and queried with
+// ./build/itrace_query.
+//
+// The emulator thread only copies registers at each instruction boundary
+// into a block, a background thread delta encodes and compresses full
+// blocks. The emulator waits only if that thread is ITRACE_QUEUE_SIZE blocks
+// behind.
+//
+// File layout:
+//
+//     ItraceFileHeader
+//     ItraceBlockHeader, compressed records    (repeated)
+//     ItraceBlockHeader[n_blocks] as index     (missing if the run crashed)
+//     ItraceFooter
+//
+// Each block decodes on its own. A record is the cycle delta as varint, the
+// zigzag pc delta as varint, a byte with a bit per changed register and the
+// changed registers, all relative to the previous record in the block,
+// starting from the block's first cycle and zeros. Block headers carry the
+// cycle range and a bitmap of pc >> 6 so a query only inflates the blocks
+// it needs.
+
+#define ITRACE_MAGIC "CPUITRC1"
+#define ITRACE_INDEX_MAGIC "CPUITIDX"
+#define ITRACE_BLOCK_RECORDS (1 << 16)
+#define ITRACE_QUEUE_SIZE 8 // Power of two.
+#define ITRACE_N_REGS 8
+#define ITRACE_PC_SHIFT 6
+#define ITRACE_RAW_BOUND (ITRACE_BLOCK_RECORDS * (10 + 3 + 1 + ITRACE_N_REGS))
+
+// a, b, c, d, e, sp, f and the opcode at pc.
+static const char *ITRACE_REG_NAME[ITRACE_N_REGS] = { "a", "b", "c", "d", "e", "sp", "f", "op" };
+
+typedef struct {
+    char magic[8];
+    uint32_t block_records;
+    uint32_t reserved;
+} ItraceFileHeader;
+
+typedef struct {
+    uint64_t offset;            // Of the block header in the file.
+    uint64_t first_cycle;
+    uint64_t last_cycle;
+    uint32_t n_records;
+    uint32_t compressed_size;   // Bytes following the header.
+    uint32_t raw_size;
+    uint32_t reserved;
+    uint8_t pcs[(0x10000 >> ITRACE_PC_SHIFT) / 8];
+} ItraceBlockHeader;
+
+typedef struct {
+    uint64_t index_offset;
+    uint64_t n_blocks;
+    char magic[8];
+} ItraceFooter;
+
+typedef struct {
+    uint64_t cycle;
+    uint16_t pc;
+    uint8_t regs[ITRACE_N_REGS];
+} ItraceRecord;
+
+typedef struct {
+    ItraceRecord records[ITRACE_BLOCK_RECORDS];
+    size_t n;
+} ItraceBlock;
+
+typedef struct {
+    ItraceBlock blocks[ITRACE_QUEUE_SIZE];
+    _Atomic size_t head; // Written by the emulator only.
+    _Atomic size_t tail; // Written by the writer only.
+    _Atomic bool done;
+    size_t stalls;
+    FILE *f;
+    pthread_t writer;
+
+    // Writer thread only.
+    uint8_t raw[ITRACE_RAW_BOUND];
+    uint8_t *compressed;
+    uLong compressed_bound;
+    ItraceBlockHeader *index;
+    size_t n_index;
+    size_t index_capacity;
+} Itrace;
+
+static inline ItraceRecord itrace_record(const State *state) {
+    uint16_t pc = (uint16_t)((state->mh << 8) | state->ml);
+
+    return (ItraceRecord){
+        .cycle = state->cycle,
+        .pc = pc,
+        .regs = {
+            state->mem[0xfff0], state->mem[0xfff1], state->mem[0xfff2], state->mem[0xfff3],
+            state->mem[0xfff4], state->mem[0xffff], state->f, state->mem[pc],
+        },
+    };
+}
+
+static uint8_t *itrace_put_varint(uint8_t *p, uint64_t value) {
+    while (value >= 0x80) {
+        *p++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (uint8_t)value;
+
+    return p;
+}
+
+static const uint8_t *itrace_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *value) {
+    *value = 0;
+
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+
+        if (!(byte & 0x80)) return p;
+    }
+
+    return NULL;
+}
+
+// Returns the encoded size.
+static size_t itrace_encode(const ItraceBlock *block, uint8_t *raw, ItraceBlockHeader *header) {
+    ItraceRecord prev = { .cycle = block->records[0].cycle };
+    uint8_t *p = raw;
+
+    memset(header, 0, sizeof(*header));
+    header->first_cycle = block->records[0].cycle;
+    header->last_cycle = block->records[block->n - 1].cycle;
+    header->n_records = (uint32_t)block->n;
+
+    for (size_t i = 0; i < block->n; ++i) {
+        const ItraceRecord *r = &block->records[i];
+        uint16_t pc_delta = (uint16_t)(r->pc - prev.pc);
+        uint32_t pc_zigzag = (uint32_t)(pc_delta << 1) ^ ((pc_delta & 0x8000) ? 0xffff : 0);
+
+        p = itrace_put_varint(p, r->cycle - prev.cycle);
+        p = itrace_put_varint(p, pc_zigzag & 0xffff);
+
+        uint8_t *changed = p++;
+        *changed = 0;
+
+        for (int reg = 0; reg < ITRACE_N_REGS; ++reg) {
+            if (r->regs[reg] == prev.regs[reg]) continue;
+
+            *changed |= (uint8_t)(1 << reg);
+            *p++ = r->regs[reg];
+        }
+
+        header->pcs[r->pc >> (ITRACE_PC_SHIFT + 3)] |= (uint8_t)(1 << ((r->pc >> ITRACE_PC_SHIFT) & 7));
+        prev = *r;
+    }
+
+    return (size_t)(p - raw);
+}
+
+// Returns the number of records decoded into records, or -1 if raw is corrupt.
+static long itrace_decode(const uint8_t *raw, size_t size, const ItraceBlockHeader *header, ItraceRecord *records) {
+    ItraceRecord prev = { .cycle = header->first_cycle };
+    const uint8_t *p = raw;
+    const uint8_t *end = raw + size;
+
+    for (uint32_t i = 0; i < header->n_records; ++i) {
+        uint64_t cycle_delta, pc_zigzag;
+
+        if ((p = itrace_get_varint(p, end, &cycle_delta)) == NULL ||
+            (p = itrace_get_varint(p, end, &pc_zigzag)) == NULL || p >= end) return -1;
+
+        uint16_t pc_delta = (uint16_t)((pc_zigzag >> 1) ^ ((pc_zigzag & 1) ? 0xffff : 0));
+        uint8_t changed = *p++;
+
+        ItraceRecord *r = &records[i];
+        *r = prev;
+        r->cycle += cycle_delta;
+        r->pc = (uint16_t)(r->pc + pc_delta);
+
+        for (int reg = 0; reg < ITRACE_N_REGS; ++reg) {
+            if (!(changed & (1 << reg))) continue;
+            if (p >= end) return -1;
+
+            r->regs[reg] = *p++;
+        }
+
+        prev = *r;
+    }
+
+    return header->n_records;
+}
+
+static void itrace_write_block(Itrace *itrace, const ItraceBlock *block) {
+    ItraceBlockHeader header;
+    size_t raw_size = itrace_encode(block, itrace->raw, &header);
+    uLongf compressed_size = itrace->compressed_bound;
+
+    if (compress2(itrace->compressed, &compressed_size, itrace->raw, raw_size, 1) != Z_OK) {
+        fprintf(stderr, "itrace compression failed\n");
+        return;
+    }
+
+    header.offset = (uint64_t)ftello(itrace->f);
+    header.compressed_size = (uint32_t)compressed_size;
+    header.raw_size = (uint32_t)raw_size;
+
+    fwrite(&header, sizeof(header), 1, itrace->f);
+    fwrite(itrace->compressed, 1, compressed_size, itrace->f);
+
+    if (itrace->n_index == itrace->index_capacity) {
+        itrace->index_capacity = itrace->index_capacity == 0 ? 1024 : 2 * itrace->index_capacity;
+        itrace->index = realloc(itrace->index, itrace->index_capacity * sizeof(ItraceBlockHeader));
+
+        if (itrace->index == NULL) {
+            fprintf(stderr, "Failed to grow itrace index\n");
+            exit(1);
+        }
+    }
+
+    itrace->index[itrace->n_index++] = header;
+}
+
+static void *itrace_consume(void *arg) {
+    Itrace *itrace = arg;
+
+    for (;;) {
+        size_t tail = atomic_load_explicit(&itrace->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&itrace->head, memory_order_acquire);
+
+        if (tail == head) {
+            if (atomic_load_explicit(&itrace->done, memory_order_acquire) &&
+                head == atomic_load_explicit(&itrace->head, memory_order_acquire)) break;
+
+            usleep(1000);
+            continue;
+        }
+
+        for (; tail != head; ++tail) {
+            itrace_write_block(itrace, &itrace->blocks[tail & (ITRACE_QUEUE_SIZE - 1)]);
+            atomic_store_explicit(&itrace->tail, tail + 1, memory_order_release);
+        }
+    }
+
+    return NULL;
+}
+
+static bool itrace_start(Itrace *itrace, const char *path) {
+    itrace->f = fopen(path, "wb");
+
+    if (itrace->f == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    itrace->compressed_bound = compressBound(ITRACE_RAW_BOUND);
+    itrace->compressed = malloc(itrace->compressed_bound);
+
+    if (itrace->compressed == NULL) {
+        fprintf(stderr, "Failed to allocate itrace buffer\n");
+        return false;
+    }
+
+    ItraceFileHeader header = { .block_records = ITRACE_BLOCK_RECORDS };
+    memcpy(header.magic, ITRACE_MAGIC, sizeof(header.magic));
+    fwrite(&header, sizeof(header), 1, itrace->f);
+
+    if (pthread_create(&itrace->writer, NULL, itrace_consume, itrace) != 0) {
+        fprintf(stderr, "Failed to start itrace writer\n");
+        return false;
+    }
+
+    return true;
+}
+
+static void itrace_flush(Itrace *itrace) {
+    size_t head = atomic_load_explicit(&itrace->head, memory_order_relaxed);
+
+    if (itrace->blocks[head & (ITRACE_QUEUE_SIZE - 1)].n == 0) return;
+
+    atomic_store_explicit(&itrace->head, head + 1, memory_order_release);
+
+    // The next block may still be queued from ITRACE_QUEUE_SIZE blocks ago.
+    while (head + 1 - atomic_load_explicit(&itrace->tail, memory_order_acquire) == ITRACE_QUEUE_SIZE) {
+        ++itrace->stalls;
+        usleep(100);
+    }
+
+    itrace->blocks[(head + 1) & (ITRACE_QUEUE_SIZE - 1)].n = 0;
+}
+
+// Call at instruction boundaries.
+static inline void itrace_push(Itrace *itrace, const State *state) {
+    size_t head = atomic_load_explicit(&itrace->head, memory_order_relaxed);
+    ItraceBlock *block = &itrace->blocks[head & (ITRACE_QUEUE_SIZE - 1)];
+
+    // Cycles only go up within a block, a reload or reverse step starts a new
+    // one. Blocks are then not in cycle order, itrace_query checks them all.
+    if (block->n > 0 && state->cycle < block->records[block->n - 1].cycle) {
+        itrace_flush(itrace);
+
+        head = atomic_load_explicit(&itrace->head, memory_order_relaxed);
+        block = &itrace->blocks[head & (ITRACE_QUEUE_SIZE - 1)];
+    }
+
+    block->records[block->n++] = itrace_record(state);
+
+    if (block->n == ITRACE_BLOCK_RECORDS) itrace_flush(itrace);
+}
+
+static void itrace_stop(Itrace *itrace) {
+    itrace_flush(itrace);
+
+    atomic_store_explicit(&itrace->done, true, memory_order_release);
+    pthread_join(itrace->writer, NULL);
+
+    ItraceFooter footer = { .index_offset = (uint64_t)ftello(itrace->f), .n_blocks = itrace->n_index };
+    memcpy(footer.magic, ITRACE_INDEX_MAGIC, sizeof(footer.magic));
+
+    fwrite(itrace->index, sizeof(ItraceBlockHeader), itrace->n_index, itrace->f);
+    fwrite(&footer, sizeof(footer), 1, itrace->f);
+    fclose(itrace->f);
+
+    if (itrace->stalls > 0) fprintf(stderr, "itrace stalled the emulator %zu times\n", itrace->stalls);
+}
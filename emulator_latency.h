@@ -0,0 +1,278 @@
+#include <sys/ioctl.h> // FIONREAD
+
+// Serial round trip latency, enabled with -l path.
+//
+// Every rx byte is stamped when the kernel received it (SO_TIMESTAMP), when
+// the emulator first saw it waiting on the socket, when the guest sampled
+// its start bit, when the guest finished sending a byte back and when send()
+// returned. A tx byte answers the oldest rx byte not answered yet, as echo
+// does, tx with no rx waiting is not counted. At exit path gets percentiles
+// and histograms of host queueing (kernel to emulator), guest polling
+// (emulator to start bit), bit-bang (start bit to tx done, receiving and
+// sending ten bits each) and send.
+//
+// Replayed rx has no socket, it arrives and is seen when injected.
+
+typedef struct {
+    uint64_t arrive_ns;
+    uint64_t seen_ns;
+    uint64_t start_ns;
+    uint64_t tx_ns;
+    uint64_t sent_ns;
+    uint64_t seen_cycle;
+    uint64_t start_cycle;
+    uint64_t tx_cycle;
+} LatencyByte;
+
+typedef struct {
+    LatencyByte *bytes;
+    size_t n;         // Seen.
+    size_t capacity;
+    size_t injected;  // Handed to the guest.
+    size_t started;   // Start bit sampled by the guest.
+    size_t answered;  // Echoed back.
+} Latency;
+
+static void latency_init(int fd) {
+    const int on = 1;
+
+    if (fd >= 0 && setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on)) < 0)
+        perror("setsockopt(SO_TIMESTAMP) failed, host queueing is not measured");
+}
+
+static void latency_push_seen(Latency *latency, const State *state) {
+    if (latency->n == latency->capacity) {
+        latency->capacity = latency->capacity == 0 ? 1024 : 2 * latency->capacity;
+        latency->bytes = realloc(latency->bytes, latency->capacity * sizeof(LatencyByte));
+
+        if (latency->bytes == NULL) {
+            fprintf(stderr, "Failed to grow latency log\n");
+            exit(1);
+        }
+    }
+
+    uint64_t now = stats_now_ns();
+
+    latency->bytes[latency->n++] = (LatencyByte){ .arrive_ns = now, .seen_ns = now, .seen_cycle = state->cycle };
+}
+
+// Stamps bytes that arrived on the socket since the last poll.
+static void latency_poll(Latency *latency, int fd, const State *state) {
+    int available = 0;
+
+    if (ioctl(fd, FIONREAD, &available) < 0) return;
+
+    while ((size_t)available > latency->n - latency->injected)
+        latency_push_seen(latency, state);
+}
+
+// The byte was handed to the guest, arrive_ns is when the kernel received it
+// on the monotonic clock or 0 if unknown.
+static void latency_injected(Latency *latency, const State *state, uint64_t arrive_ns) {
+    if (latency->injected == latency->n) latency_push_seen(latency, state);
+
+    LatencyByte *byte = &latency->bytes[latency->injected++];
+
+    if (arrive_ns != 0 && arrive_ns < byte->seen_ns) byte->arrive_ns = arrive_ns;
+}
+
+// recv() of a single byte that also takes the kernel's receive timestamp.
+static ssize_t latency_recv(Latency *latency, int fd, uint8_t *byte, const State *state) {
+    struct iovec iov = { .iov_base = byte, .iov_len = 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(struct timeval))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+
+    ssize_t bytes_read = recvmsg(fd, &msg, MSG_DONTWAIT);
+
+    if (bytes_read < 1) return bytes_read;
+
+    uint64_t arrive_ns = 0;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMP) continue;
+
+        struct timeval tv;
+        memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+
+        // The timestamp is wall clock time, move it onto the monotonic clock.
+        struct timespec realtime;
+        clock_gettime(CLOCK_REALTIME, &realtime);
+
+        uint64_t now = stats_now_ns();
+        int64_t age_ns = ((int64_t)realtime.tv_sec - (int64_t)tv.tv_sec) * 1000000000 +
+                         ((int64_t)realtime.tv_nsec - (int64_t)tv.tv_usec * 1000);
+
+        if (age_ns >= 0 && (uint64_t)age_ns < now) arrive_ns = now - (uint64_t)age_ns;
+    }
+
+    latency_injected(latency, state, arrive_ns);
+
+    return bytes_read;
+}
+
+// Call at instruction boundaries, the start bit is sampled once rx_bits has
+// moved on from 1.
+static inline void latency_instruction(Latency *latency, const State *state) {
+    if (latency->started == latency->injected || state->rx_bits == 1) return;
+
+    uint64_t now = stats_now_ns();
+
+    while (latency->started < latency->injected) {
+        LatencyByte *byte = &latency->bytes[latency->started++];
+
+        byte->start_ns = now;
+        byte->start_cycle = state->cycle;
+    }
+}
+
+// The guest finished sending a byte, returns the rx byte it answers to stamp
+// once sent, or NULL.
+static LatencyByte *latency_tx(Latency *latency, const State *state) {
+    if (latency->answered == latency->started) return NULL;
+
+    LatencyByte *byte = &latency->bytes[latency->answered++];
+
+    byte->tx_ns = stats_now_ns();
+    byte->tx_cycle = state->cycle;
+
+    return byte;
+}
+
+// The cycle went back after a reload, the guest lost the bytes it was handed
+// and had not answered yet. Bytes still waiting on the socket are stamped
+// again as seen now.
+static void latency_rebase(Latency *latency, const State *state) {
+    size_t waiting = latency->n - latency->injected;
+
+    memmove(&latency->bytes[latency->answered], &latency->bytes[latency->injected], waiting * sizeof(LatencyByte));
+
+    latency->n = latency->answered + waiting;
+    latency->injected = latency->answered;
+    latency->started = latency->answered;
+
+    for (size_t i = latency->answered; i < latency->n; ++i) latency->bytes[i].seen_cycle = state->cycle;
+}
+
+static int latency_compare(const void *a, const void *b) {
+    uint64_t ua = *(const uint64_t *)a;
+    uint64_t ub = *(const uint64_t *)b;
+
+    return ua < ub ? -1 : ua > ub ? 1 : 0;
+}
+
+// Sorts samples in place.
+static void latency_write_stage(FILE *f, const char *name, const char *unit, double scale, uint64_t *samples, size_t n) {
+    if (n == 0) {
+        fprintf(f, "%-14s no samples\n", name);
+        return;
+    }
+
+    qsort(samples, n, sizeof(samples[0]), latency_compare);
+
+    const double percentiles[] = { 50, 90, 99, 99.9 };
+
+    fprintf(f, "%-14s %6zu", name, n);
+
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i) {
+        size_t rank = (size_t)(percentiles[i] / 100.0 * (double)(n - 1) + 0.5);
+
+        fprintf(f, " %12.1f", (double)samples[rank] / scale);
+    }
+
+    fprintf(f, " %12.1f %s\n", (double)samples[n - 1] / scale, unit);
+}
+
+// Power of two buckets.
+static void latency_write_histogram(FILE *f, const char *name, const char *unit, double scale, const uint64_t *samples, size_t n) {
+    size_t buckets[65] = {0};
+    int first = 64, last = 0;
+
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t value = (uint64_t)((double)samples[i] / scale);
+        int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+
+        ++buckets[bucket];
+        if (bucket < first) first = bucket;
+        if (bucket > last) last = bucket;
+    }
+
+    if (n == 0) return;
+
+    fprintf(f, "\n%s, %s\n", name, unit);
+
+    for (int bucket = first; bucket <= last; ++bucket) {
+        unsigned long long low = bucket == 0 ? 0 : 1ull << (bucket - 1);
+        int width = (int)(50 * buckets[bucket] / n);
+
+        fprintf(f, "  %12llu %6zu %.*s\n", low, buckets[bucket], width, "##################################################");
+    }
+}
+
+static bool latency_write(Latency *latency, const char *path) {
+    size_t answered = latency->answered;
+    size_t n = 0;
+
+    FILE *f = fopen(path, "w");
+
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    fprintf(f, "%zu bytes received, %zu echoed\n\n", latency->injected, answered);
+    fprintf(f, "%-14s %6s %12s %12s %12s %12s %12s\n", "stage", "n", "p50", "p90", "p99", "p99.9", "max");
+
+    uint64_t *samples[7];
+
+    for (int i = 0; i < 7; ++i) {
+        samples[i] = malloc((answered > 0 ? answered : 1) * sizeof(uint64_t));
+
+        if (samples[i] == NULL) {
+            fprintf(stderr, "Failed to allocate latency samples\n");
+            exit(1);
+        }
+    }
+
+    for (size_t i = 0; i < answered; ++i) {
+        const LatencyByte *byte = &latency->bytes[i];
+
+        // A gdb reverse step can take the cycle back between two stamps.
+        if (byte->start_cycle < byte->seen_cycle || byte->tx_cycle < byte->start_cycle) continue;
+
+        samples[0][n] = byte->seen_ns - byte->arrive_ns;
+        samples[1][n] = byte->start_ns - byte->seen_ns;
+        samples[2][n] = byte->tx_ns - byte->start_ns;
+        samples[3][n] = byte->sent_ns - byte->tx_ns;
+        samples[4][n] = byte->sent_ns - byte->arrive_ns;
+        samples[5][n] = byte->start_cycle - byte->seen_cycle;
+        samples[6][n] = byte->tx_cycle - byte->start_cycle;
+        ++n;
+    }
+
+    latency_write_stage(f, "host queueing", "us", 1e3, samples[0], n);
+    latency_write_stage(f, "guest polling", "us", 1e3, samples[1], n);
+    latency_write_stage(f, "bit-bang", "us", 1e3, samples[2], n);
+    latency_write_stage(f, "send", "us", 1e3, samples[3], n);
+    latency_write_stage(f, "round trip", "us", 1e3, samples[4], n);
+    latency_write_stage(f, "guest polling", "cycles", 1, samples[5], n);
+    latency_write_stage(f, "bit-bang", "cycles", 1, samples[6], n);
+
+    latency_write_histogram(f, "host queueing", "us", 1e3, samples[0], n);
+    latency_write_histogram(f, "guest polling", "us", 1e3, samples[1], n);
+    latency_write_histogram(f, "bit-bang", "us", 1e3, samples[2], n);
+    latency_write_histogram(f, "send", "us", 1e3, samples[3], n);
+    latency_write_histogram(f, "round trip", "us", 1e3, samples[4], n);
+
+    for (int i = 0; i < 7; ++i) free(samples[i]);
+
+    fclose(f);
+
+    free(latency->bytes);
+
+    printf("serial latency written to %s\n", path);
+
+    return true;
+}
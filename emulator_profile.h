@@ -0,0 +1,177 @@
+// Sampling profiler, enabled with -P path.
+//
+// At the first instruction fetch after every period cycles the pc and the
+// call stack are recorded. The call stack is recovered from the stack at
+// 0xff00: call pushes the return address high byte first, so a byte pair
+// whose address follows a "call_i16_begin hi lo call_i16_end" sequence in
+// memory is taken to be a return address, other pushed bytes are skipped.
+//
+// At exit the stacks are symbolized and written as folded stacks, one
+// "outermost;...;innermost count" line per stack, the input format of
+// flamegraph.pl and speedscope.
+
+#define PROFILE_DEFAULT_PERIOD 1000
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_TABLE_SIZE (1 << 16) // Power of two.
+
+typedef struct {
+    uint64_t count;
+    uint32_t hash;
+    uint8_t depth;
+    uint16_t frames[PROFILE_MAX_DEPTH]; // pc, then return addresses, innermost first.
+} ProfileStack;
+
+typedef struct {
+    uint64_t period;
+    uint64_t next_sample;
+    uint64_t samples;
+    uint64_t dropped;
+    size_t n_stacks;
+    ProfileStack *stacks;
+} Profile;
+
+typedef struct {
+    char *line;
+    uint64_t count;
+} ProfileLine;
+
+static bool profile_init(Profile *profile, uint64_t period, const State *state) {
+    profile->period = period;
+    profile->next_sample = state->cycle + period;
+    profile->stacks = calloc(PROFILE_TABLE_SIZE, sizeof(ProfileStack));
+
+    if (profile->stacks == NULL) {
+        fprintf(stderr, "Failed to allocate profile\n");
+        return false;
+    }
+
+    return true;
+}
+
+static bool profile_is_return_address(const State *state, uint16_t address) {
+    return address >= 4 &&
+        state->mem[(uint16_t)(address - 1)] == O_CALL_I16_END &&
+        state->mem[(uint16_t)(address - 4)] == O_CALL_I16_BEGIN;
+}
+
+// Returns the depth, frames[0] is the pc.
+static uint8_t profile_unwind(const State *state, uint16_t frames[PROFILE_MAX_DEPTH]) {
+    uint8_t depth = 0;
+
+    frames[depth++] = (uint16_t)((state->mh << 8) | state->ml);
+
+    for (int i = state->mem[0xffff] - 2; i >= 0 && depth < PROFILE_MAX_DEPTH; ) {
+        uint16_t address = (uint16_t)((state->mem[0xff00 + i] << 8) | state->mem[0xff00 + i + 1]);
+
+        if (profile_is_return_address(state, address)) {
+            frames[depth++] = address;
+            i -= 2;
+        } else {
+            i -= 1;
+        }
+    }
+
+    return depth;
+}
+
+// Call at instruction boundaries once state->cycle reaches next_sample.
+static void profile_sample(Profile *profile, const State *state) {
+    uint16_t frames[PROFILE_MAX_DEPTH];
+    uint8_t depth = profile_unwind(state, frames);
+
+    // FNV-1a, each multiply in 64 bits and masked back to 32, wrapping
+    // unsigned arithmetic traps with -fsanitize=integer.
+    uint32_t hash = 2166136261u;
+    for (uint8_t i = 0; i < depth; ++i) {
+        hash = (uint32_t)(((uint64_t)(hash ^ (frames[i] & 0xff)) * 16777619u) & 0xffffffff);
+        hash = (uint32_t)(((uint64_t)(hash ^ (frames[i] >> 8)) * 16777619u) & 0xffffffff);
+    }
+
+    ++profile->samples;
+    while (profile->next_sample <= state->cycle) profile->next_sample += profile->period;
+
+    for (uint32_t i = hash & (PROFILE_TABLE_SIZE - 1); ; i = (i + 1) & (PROFILE_TABLE_SIZE - 1)) {
+        ProfileStack *stack = &profile->stacks[i];
+
+        if (stack->count == 0) {
+            if (profile->n_stacks == PROFILE_TABLE_SIZE / 2) {
+                ++profile->dropped;
+                return;
+            }
+
+            stack->hash = hash;
+            stack->depth = depth;
+            memcpy(stack->frames, frames, depth * sizeof(frames[0]));
+            ++profile->n_stacks;
+        } else if (stack->hash != hash || stack->depth != depth ||
+                   memcmp(stack->frames, frames, depth * sizeof(frames[0])) != 0) {
+            continue;
+        }
+
+        ++stack->count;
+        return;
+    }
+}
+
+static int profile_line_compare(const void *a, const void *b) {
+    return strcmp(((const ProfileLine *)a)->line, ((const ProfileLine *)b)->line);
+}
+
+static bool profile_write(const Profile *profile, const Symbols *symbols, const char *path) {
+    FILE *f = fopen(path, "w");
+
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    ProfileLine *lines = calloc(profile->n_stacks, sizeof(ProfileLine));
+    size_t n_lines = 0;
+
+    for (size_t i = 0; lines != NULL && i < PROFILE_TABLE_SIZE; ++i) {
+        const ProfileStack *stack = &profile->stacks[i];
+
+        if (stack->count == 0) continue;
+
+        char line[PROFILE_MAX_DEPTH * 72];
+        char *p = line;
+
+        for (int frame = stack->depth - 1; frame >= 0; --frame) {
+            // A return address belongs to the routine that made the call.
+            uint16_t address = frame == 0 ? stack->frames[0] : (uint16_t)(stack->frames[frame] - 1);
+            const Symbol *symbol = symbols_lookup(symbols, address);
+
+            if (symbol != NULL) p += sprintf(p, "%s%s", symbol->name, frame > 0 ? ";" : "");
+            else                p += sprintf(p, "%04x%s", address, frame > 0 ? ";" : "");
+        }
+
+        lines[n_lines++] = (ProfileLine){ .line = strdup(line), .count = stack->count };
+    }
+
+    qsort(lines, n_lines, sizeof(ProfileLine), profile_line_compare);
+
+    size_t n_written = 0;
+
+    for (size_t i = 0; i < n_lines; ++n_written) {
+        uint64_t count = 0;
+        size_t j = i;
+
+        for (; j < n_lines && strcmp(lines[j].line, lines[i].line) == 0; ++j) count += lines[j].count;
+
+        fprintf(f, "%s %llu\n", lines[i].line, (unsigned long long)count);
+
+        for (; i < j; ++i) free(lines[i].line);
+    }
+
+    free(lines);
+    fclose(f);
+
+    printf("profile: %llu samples, %zu stacks written to %s",
+        (unsigned long long)profile->samples, n_written, path);
+
+    if (profile->dropped > 0) printf(", %llu samples dropped", (unsigned long long)profile->dropped);
+
+    printf("\n");
+
+    return true;
+}
@@ -0,0 +1,153 @@
+// Reverse execution, enabled with -b budget.
+//
+// A copy of State is kept every `interval` cycles, at an instruction
+// boundary, and every rx byte is logged with the cycle it was injected at.
+// Any earlier cycle is reached by restoring the nearest checkpoint before it
+// and replaying, the emulator being deterministic otherwise. When the budget
+// is used up every other checkpoint is dropped and the interval doubled, so
+// the whole run stays reachable with bounded memory.
+
+#define REVERSE_INITIAL_INTERVAL (1 << 16)
+
+typedef struct {
+    State *checkpoints;
+    size_t n_checkpoints;
+    size_t max_checkpoints;
+    uint64_t interval;
+    uint64_t next_checkpoint;
+
+    Timeline rx; // Bytes at the cycle they were injected.
+
+    uint64_t present; // Latest cycle run live, later cycles are replayed.
+} Reverse;
+
+static bool reverse_init(Reverse *reverse, size_t budget) {
+    reverse->max_checkpoints = budget / sizeof(State);
+
+    if (reverse->max_checkpoints < 2) {
+        fprintf(stderr, "Checkpoint budget of %zu bytes is too small, need at least %zu\n", budget, 2 * sizeof(State));
+        return false;
+    }
+
+    reverse->checkpoints = malloc(reverse->max_checkpoints * sizeof(State));
+
+    if (reverse->checkpoints == NULL) {
+        fprintf(stderr, "Failed to allocate %zu bytes for checkpoints\n", budget);
+        return false;
+    }
+
+    reverse->interval = REVERSE_INITIAL_INTERVAL;
+
+    return true;
+}
+
+// The serial connection has already been served at the present cycle, so it
+// counts as replayed.
+static bool reverse_replaying(const Reverse *reverse, const State *state) {
+    return state->cycle <= reverse->present;
+}
+
+// Call at instruction boundaries while running live.
+static void reverse_checkpoint(Reverse *reverse, const State *state) {
+    if (state->cycle < reverse->next_checkpoint) return;
+
+    if (reverse->n_checkpoints == reverse->max_checkpoints) {
+        size_t n = 0;
+
+        for (size_t i = 0; i < reverse->n_checkpoints; i += 2)
+            reverse->checkpoints[n++] = reverse->checkpoints[i];
+
+        reverse->n_checkpoints = n;
+        reverse->interval *= 2;
+    }
+
+    reverse->checkpoints[reverse->n_checkpoints++] = *state;
+    reverse->next_checkpoint = state->cycle + reverse->interval;
+}
+
+// Forgets all history before the current state, which must be at an
+// instruction boundary.
+static void reverse_reset(Reverse *reverse, const State *state) {
+    reverse->n_checkpoints = 0;
+    reverse->next_checkpoint = state->cycle;
+    reverse->rx.n = 0;
+    reverse->rx.cursor = 0;
+    reverse->present = state->cycle;
+
+    reverse_checkpoint(reverse, state);
+}
+
+static void reverse_log_rx(Reverse *reverse, const State *state) {
+    timeline_push(&reverse->rx, state->cycle, state->rx);
+    reverse->rx.cursor = reverse->rx.n;
+}
+
+// Does what the emulator loop does with the serial connection at an
+// instruction boundary, using the rx log and dropping tx.
+static void reverse_replay_io(Reverse *reverse, State *state) {
+    if (state->tx_bits == 9) state->tx_bits = 0;
+
+    timeline_inject(&reverse->rx, state);
+}
+
+static uint64_t reverse_first_cycle(const Reverse *reverse) {
+    return reverse->n_checkpoints > 0 ? reverse->checkpoints[0].cycle : reverse->present;
+}
+
+// Restores the latest checkpoint at or before cycle, returns false if there
+// is none.
+static bool reverse_restore(Reverse *reverse, uint64_t cycle, State *state) {
+    size_t lo = 0;
+    size_t hi = reverse->n_checkpoints;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+
+        if (reverse->checkpoints[mid].cycle <= cycle) lo = mid + 1;
+        else hi = mid;
+    }
+
+    if (lo == 0) return false;
+
+    *state = reverse->checkpoints[lo - 1];
+
+    timeline_seek(&reverse->rx, state->cycle);
+    reverse_replay_io(reverse, state);
+
+    return true;
+}
+
+static bool reverse_replay_cycle(Reverse *reverse, uint8_t control[CONTROL_ROM_SIZE], uint8_t alu[ALU_ROM_SIZE], State *state) {
+    bool instr_done = emulate_next_cycle(false, control, alu, state);
+
+    if (instr_done) reverse_replay_io(reverse, state);
+
+    return instr_done;
+}
+
+// Brings state to cycle, which must be between the first checkpoint and the
+// present.
+static bool reverse_goto(Reverse *reverse, uint8_t control[CONTROL_ROM_SIZE], uint8_t alu[ALU_ROM_SIZE], State *state, uint64_t cycle) {
+    if (cycle > reverse->present || !reverse_restore(reverse, cycle, state)) return false;
+
+    while (state->cycle < cycle)
+        reverse_replay_cycle(reverse, control, alu, state);
+
+    return true;
+}
+
+// The state was changed while in the past, history after it no longer holds.
+static void reverse_truncate(Reverse *reverse, const State *state) {
+    if (!reverse_replaying(reverse, state)) return;
+
+    while (reverse->n_checkpoints > 0 && reverse->checkpoints[reverse->n_checkpoints - 1].cycle > state->cycle)
+        --reverse->n_checkpoints;
+
+    while (reverse->rx.n > 0 && reverse->rx.events[reverse->rx.n - 1].cycle > state->cycle)
+        --reverse->rx.n;
+
+    if (reverse->rx.cursor > reverse->rx.n) reverse->rx.cursor = reverse->rx.n;
+
+    reverse->present = state->cycle;
+    reverse->next_checkpoint = state->cycle;
+}
@@ -0,0 +1,171 @@
+#include <time.h> // clock_gettime
+#include <sys/un.h> // sockaddr_un
+
+// Throughput counters, only kept with -i or -I and only touched by the
+// emulator thread. With -i the report goes to stderr every interval, with -I
+// it is served to every connection on a unix socket. The report uses the
+// Prometheus text format. Only the stderr report has rates, since the previous
+// stderr report, the socket serves totals for the scraper to rate.
+
+#define STATS_REPORT_SIZE (64 * 1024)
+#define STATS_POLL_CYCLES (1 << 18)
+
+typedef struct {
+    uint64_t start_ns;
+    uint64_t cycles;        // Up to last_boundary, cycles run again after going back count again.
+    uint64_t instructions;
+    uint64_t io_ns;         // In send and recv on the serial connection.
+    uint64_t sleep_ns;      // In the pacing usleep.
+    uint64_t op_instructions[256];
+    uint64_t op_cycles[256];
+    uint64_t last_boundary;
+
+    // At the previous stderr report.
+    uint64_t report_ns;
+    uint64_t report_cycles;
+    uint64_t report_instructions;
+    uint64_t report_io_ns;
+    uint64_t report_sleep_ns;
+
+    int listenfd;
+    char report[STATS_REPORT_SIZE];
+} Stats;
+
+static inline uint64_t stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void stats_start(Stats *stats, const State *state) {
+    stats->start_ns = stats->report_ns = stats_now_ns();
+    stats->last_boundary = state->cycle;
+}
+
+// Call when state is replaced, by a reload or a reverse step, the cycle
+// may have gone back.
+static inline void stats_rebase(Stats *stats, const State *state) {
+    stats->last_boundary = state->cycle;
+}
+
+// Cycles run, including those of the current instruction so far.
+static inline uint64_t stats_cycles(const Stats *stats, uint64_t cycle) {
+    return stats->cycles + (cycle >= stats->last_boundary ? cycle - stats->last_boundary : 0);
+}
+
+static bool stats_listen(Stats *stats, const char *path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    unlink(path);
+
+    stats->listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (stats->listenfd < 0 ||
+        bind(stats->listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(stats->listenfd, 4) < 0 ||
+        fcntl(stats->listenfd, F_SETFL, O_NONBLOCK) < 0) {
+        fprintf(stderr, "Failed to listen for stats on %s, reason: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+// Call at instruction boundaries, state->o is the opcode just executed.
+static inline void stats_instruction(Stats *stats, const State *state) {
+    // Gone back without a stats_rebase, the instruction has no length.
+    if (state->cycle < stats->last_boundary) {
+        stats_rebase(stats, state);
+        return;
+    }
+
+    uint64_t cycles = state->cycle - stats->last_boundary;
+
+    ++stats->instructions;
+    ++stats->op_instructions[state->o];
+    stats->op_cycles[state->o] += cycles;
+    stats->cycles += cycles;
+    stats->last_boundary = state->cycle;
+}
+
+// With rates, also moves the baseline of the rates on to now.
+static size_t stats_format(Stats *stats, uint64_t cycle, bool rates) {
+    uint64_t now = stats_now_ns();
+    double seconds = (double)(now - stats->report_ns) / 1e9;
+    uint64_t cycles = stats_cycles(stats, cycle);
+
+    char *p = stats->report;
+    char *end = stats->report + sizeof(stats->report);
+
+    #define STATS_LINE(...) p += snprintf(p, (size_t)(end - p), __VA_ARGS__)
+
+    STATS_LINE("emulator_uptime_seconds %.3f\n", (double)(now - stats->start_ns) / 1e9);
+    STATS_LINE("emulator_cycles_total %llu\n", (unsigned long long)cycles);
+    STATS_LINE("emulator_instructions_total %llu\n", (unsigned long long)stats->instructions);
+    STATS_LINE("emulator_cycles_per_instruction %.3f\n", stats->instructions > 0 ? (double)cycles / (double)stats->instructions : 0);
+    STATS_LINE("emulator_io_seconds_total %.3f\n", (double)stats->io_ns / 1e9);
+    STATS_LINE("emulator_sleep_seconds_total %.3f\n", (double)stats->sleep_ns / 1e9);
+
+    if (rates) {
+        STATS_LINE("emulator_cycles_per_second %.0f\n", (double)(cycles - stats->report_cycles) / seconds);
+        STATS_LINE("emulator_instructions_per_second %.0f\n", (double)(stats->instructions - stats->report_instructions) / seconds);
+        STATS_LINE("emulator_io_ratio %.4f\n", (double)(stats->io_ns - stats->report_io_ns) / 1e9 / seconds);
+        STATS_LINE("emulator_sleep_ratio %.4f\n", (double)(stats->sleep_ns - stats->report_sleep_ns) / 1e9 / seconds);
+    }
+
+    for (int o = 0; o < 256; ++o) {
+        if (stats->op_instructions[o] == 0) continue;
+
+        STATS_LINE("emulator_opcode_instructions_total{opcode=\"%02x\"} %llu\n", o, (unsigned long long)stats->op_instructions[o]);
+        STATS_LINE("emulator_opcode_cycles_per_instruction{opcode=\"%02x\"} %.3f\n", o,
+            (double)stats->op_cycles[o] / (double)stats->op_instructions[o]);
+    }
+
+    #undef STATS_LINE
+
+    if (rates) {
+        stats->report_ns = now;
+        stats->report_cycles = cycles;
+        stats->report_instructions = stats->instructions;
+        stats->report_io_ns = stats->io_ns;
+        stats->report_sleep_ns = stats->sleep_ns;
+    }
+
+    return (size_t)(p - stats->report);
+}
+
+static void stats_report(Stats *stats, uint64_t cycle) {
+    size_t n = stats_format(stats, cycle, true);
+
+    fwrite(stats->report, 1, n, stderr);
+    fputc('\n', stderr);
+}
+
+// Answers pending connections on the stats socket, never blocks.
+static void stats_serve(Stats *stats, uint64_t cycle) {
+    for (;;) {
+        int fd = accept(stats->listenfd, NULL, NULL);
+
+        if (fd < 0) return;
+
+        fcntl(fd, F_SETFL, 0); // Inherits O_NONBLOCK on some systems.
+
+        size_t n = stats_format(stats, cycle, false);
+
+        if (write(fd, stats->report, n) < 0) perror("stats write failed");
+
+        close(fd);
+    }
+}
+
+// Call every STATS_POLL_CYCLES, reports if interval seconds have passed and
+// serves the stats socket.
+static void stats_poll(Stats *stats, double interval, uint64_t cycle) {
+    if (interval > 0 && (double)(stats_now_ns() - stats->report_ns) / 1e9 >= interval)
+        stats_report(stats, cycle);
+
+    if (stats->listenfd >= 0) stats_serve(stats, cycle);
+}
@@ -0,0 +1,148 @@
+// Microcode step utilization, enabled with -u path.
+//
+// Every cycle is counted by control address (f, s, o) and whether C selects
+// the register file. At exit each counted step is put in a category from
+// its control word and a report ranks opcodes by cycles, with the share of
+// C setup and idle steps, the cycles a shorter microcode could win back.
+
+typedef enum {
+    STEP_FETCH,     // s == 0
+    STEP_REGISTER,  // Memory read or write of the register file at 0xfff0.
+    STEP_MEM_WRITE,
+    STEP_MEM_READ,
+    STEP_ALU_READ,
+    STEP_C_SETUP,   // Only loads C.
+    STEP_IDLE,      // Only OE_C, or only ends the instruction with LD_S.
+    STEP_OTHER,     // T, M or flags moves.
+    STEP_N_CATEGORIES
+} StepCategory;
+
+static const char *STEP_CATEGORY_NAME[STEP_N_CATEGORIES] = {
+    "fetch", "regfile", "mem write", "mem read", "alu read", "c setup", "idle", "other",
+};
+
+typedef struct {
+    uint64_t counts[2 * 0x10000]; // Control address << 1 | C selects the register file.
+} Steps;
+
+static inline void steps_count(Steps *steps, const State *state) {
+    ++steps->counts[(emulate_control_address(state) << 1) | ((state->c >> 3) & 1)];
+}
+
+static StepCategory steps_category(uint8_t s, uint16_t signals, bool register_file) {
+    const uint16_t c_fields = S_C0 | S_C1 | S_C2 | SEL_C;
+
+    if (s == 0) return STEP_FETCH;
+    if ((signals & (OE_MEM | LD_MEM)) && register_file) return STEP_REGISTER;
+    if (signals & LD_MEM) return STEP_MEM_WRITE;
+    if (signals & OE_MEM) return STEP_MEM_READ;
+    if (signals & OE_ALU) return STEP_ALU_READ;
+    if ((signals & OE_C) && (signals & LD_C) && !(signals & ~(c_fields | OE_C | LD_C))) return STEP_C_SETUP;
+    if ((signals & OE_C) && !(signals & LD_C) && !(signals & ~(c_fields | OE_C))) return STEP_IDLE;
+
+    return STEP_OTHER;
+}
+
+typedef struct {
+    uint8_t o;
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t categories[STEP_N_CATEGORIES];
+    uint64_t steps[16];
+    StepCategory step_category[16]; // Of the step's most frequent control word.
+    uint64_t step_category_count[16];
+} StepsOpcode;
+
+static int steps_opcode_compare(const void *a, const void *b) {
+    const StepsOpcode *oa = a;
+    const StepsOpcode *ob = b;
+
+    return oa->cycles < ob->cycles ? 1 : oa->cycles > ob->cycles ? -1 : 0;
+}
+
+static bool steps_write(const Steps *steps, const uint8_t control[CONTROL_ROM_SIZE], const char *path) {
+    static StepsOpcode opcodes[256];
+    uint64_t total = 0;
+    uint64_t categories[STEP_N_CATEGORIES] = {0};
+
+    for (int o = 0; o < 256; ++o) opcodes[o] = (StepsOpcode){ .o = (uint8_t)o };
+
+    for (uint32_t i = 0; i < 2 * 0x10000; ++i) {
+        uint64_t count = steps->counts[i];
+
+        if (count == 0) continue;
+
+        State at = { .o = (uint8_t)(i >> 1), .s = (uint8_t)((i >> 9) & 0xf), .f = (uint8_t)(i >> 13) };
+        StepCategory category = steps_category(at.s, emulate_control_signals(control, &at), i & 1);
+
+        // A fetch is counted with the opcode still in O, the instruction it
+        // follows. Every instruction has one, so cycles per instruction hold.
+        StepsOpcode *op = &opcodes[at.o];
+
+        op->cycles += count;
+        op->categories[category] += count;
+        op->steps[at.s] += count;
+        if (at.s == 0) op->instructions += count;
+
+        if (count > op->step_category_count[at.s]) {
+            op->step_category_count[at.s] = count;
+            op->step_category[at.s] = category;
+        }
+
+        categories[category] += count;
+        total += count;
+    }
+
+    qsort(opcodes, 256, sizeof(opcodes[0]), steps_opcode_compare);
+
+    FILE *f = fopen(path, "w");
+
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    fprintf(f, "%llu cycles\n", (unsigned long long)total);
+
+    for (int c = 0; c < STEP_N_CATEGORIES; ++c)
+        fprintf(f, "%10s %14llu %6.2f%%\n", STEP_CATEGORY_NAME[c], (unsigned long long)categories[c],
+            total > 0 ? 100.0 * (double)categories[c] / (double)total : 0);
+
+    fprintf(f, "\nopcode %14s %7s %6s %14s %7s", "cycles", "%", "cpi", "c setup+idle", "%");
+    for (int c = 0; c < STEP_N_CATEGORIES; ++c) fprintf(f, " %9s", STEP_CATEGORY_NAME[c]);
+    fprintf(f, "\n");
+
+    for (int i = 0; i < 256 && opcodes[i].cycles > 0; ++i) {
+        const StepsOpcode *op = &opcodes[i];
+        uint64_t reclaimable = op->categories[STEP_C_SETUP] + op->categories[STEP_IDLE];
+
+        fprintf(f, "    %02x %14llu %6.2f%% %6.2f %14llu %6.2f%%",
+            op->o, (unsigned long long)op->cycles, 100.0 * (double)op->cycles / (double)total,
+            op->instructions > 0 ? (double)op->cycles / (double)op->instructions : 0,
+            (unsigned long long)reclaimable, 100.0 * (double)reclaimable / (double)op->cycles);
+
+        for (int c = 0; c < STEP_N_CATEGORIES; ++c)
+            fprintf(f, " %8.1f%%", 100.0 * (double)op->categories[c] / (double)op->cycles);
+
+        fprintf(f, "\n");
+    }
+
+    fprintf(f, "\nsteps per opcode, cycles and category\n");
+
+    for (int i = 0; i < 256 && opcodes[i].cycles > 0; ++i) {
+        const StepsOpcode *op = &opcodes[i];
+
+        fprintf(f, "    %02x", op->o);
+
+        for (int s = 0; s < 16; ++s)
+            if (op->steps[s] > 0) fprintf(f, " %x:%llu:%s", s, (unsigned long long)op->steps[s], STEP_CATEGORY_NAME[op->step_category[s]]);
+
+        fprintf(f, "\n");
+    }
+
+    fclose(f);
+
+    printf("step utilization written to %s\n", path);
+
+    return true;
+}
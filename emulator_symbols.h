@@ -0,0 +1,114 @@
+// Symbols as printed by customasm with "-f symbols", one "name = 0x1234" per
+// line, see build_control_roms.zsh for build/rom/symbols.inc. Several files
+// can be read into the same Symbols, e.g. the boot rom and a program.
+
+#define SYMBOLS_DEFAULT_PATH "./build/rom/symbols.inc"
+
+typedef struct {
+    char name[64];
+    uint16_t address;
+} Symbol;
+
+typedef struct {
+    Symbol *symbols; // Sorted by address, an empty name ends the previous symbol.
+    size_t n;
+    size_t capacity;
+} Symbols;
+
+static int symbols_compare(const void *a, const void *b) {
+    const Symbol *sa = a;
+    const Symbol *sb = b;
+
+    if (sa->address != sb->address) return (int)sa->address - (int)sb->address;
+
+    return strcmp(sa->name, sb->name);
+}
+
+static void symbols_sort(Symbols *symbols) {
+    if (symbols->n > 0) qsort(symbols->symbols, symbols->n, sizeof(Symbol), symbols_compare);
+}
+
+// Appends without sorting.
+static void symbols_add(Symbols *symbols, const char *name, uint16_t address) {
+    if (symbols->n == symbols->capacity) {
+        symbols->capacity = symbols->capacity == 0 ? 256 : 2 * symbols->capacity;
+        symbols->symbols = realloc(symbols->symbols, symbols->capacity * sizeof(Symbol));
+
+        if (symbols->symbols == NULL) {
+            fprintf(stderr, "Failed to grow symbols\n");
+            exit(1);
+        }
+    }
+
+    Symbol *symbol = &symbols->symbols[symbols->n++];
+
+    snprintf(symbol->name, sizeof(symbol->name), "%s", name);
+    symbol->address = address;
+}
+
+// The last symbol read so far ends at address, so code after it, e.g. a
+// program after the boot rom, is not attributed to it.
+static void symbols_end(Symbols *symbols, uint16_t address) {
+    symbols_add(symbols, "", address);
+    symbols_sort(symbols);
+}
+
+static bool symbols_read(Symbols *symbols, const char *path) {
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) return false;
+
+    char line[256];
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char name[64];
+        unsigned address;
+
+        if (sscanf(line, "%63s = %x", name, &address) != 2 || address > 0xffff) continue;
+
+        symbols_add(symbols, name, (uint16_t)address);
+    }
+
+    fclose(f);
+
+    symbols_sort(symbols);
+
+    return true;
+}
+
+static bool symbols_find(const Symbols *symbols, const char *name, uint16_t *address) {
+    for (size_t i = 0; i < symbols->n; ++i) {
+        if (strcmp(symbols->symbols[i].name, name) == 0) {
+            *address = symbols->symbols[i].address;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// The closest symbol at or before address, NULL if there is none.
+static const Symbol *symbols_lookup(const Symbols *symbols, uint16_t address) {
+    size_t lo = 0;
+    size_t hi = symbols->n;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+
+        if (symbols->symbols[mid].address <= address) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo > 0 && symbols->symbols[lo - 1].name[0] != 0 ? &symbols->symbols[lo - 1] : NULL;
+}
+
+// Formats address as "name+offset", or as hex without a symbol.
+static const char *symbols_format(const Symbols *symbols, uint16_t address, char *buf, size_t size) {
+    const Symbol *symbol = symbols_lookup(symbols, address);
+
+    if (symbol == NULL)                    snprintf(buf, size, "%04x", address);
+    else if (symbol->address == address)   snprintf(buf, size, "%s", symbol->name);
+    else                                   snprintf(buf, size, "%s+%u", symbol->name, address - symbol->address);
+
+    return buf;
+}
@@ -0,0 +1,109 @@
+// Serial input timeline, recorded with -r and replayed with -R.
+//
+// The rx line is the only input the emulator models, the GPI level follows
+// from the byte being shifted in, so the rx bytes and the cycles they arrived
+// at reproduce a run exactly. A byte is injected at the first instruction
+// boundary on or after its cycle where the guest is about to sample rx, which
+// keeps a timeline recorded with one microcode usable with another.
+//
+// The file format is one event per line:
+//
+//     <cycle> rx <byte in hex>
+//     <cycle> end
+
+typedef struct {
+    uint64_t cycle;
+    uint8_t byte;
+} RxEvent;
+
+typedef struct {
+    RxEvent *events;
+    size_t n;
+    size_t capacity;
+    size_t cursor; // Next event to inject.
+    uint64_t end;  // Cycle the recording stopped at, UINT64_MAX if unknown.
+} Timeline;
+
+static bool timeline_rx_ready(const State *state) {
+    return state->rx_bits == 0 && state->mem[(uint16_t)(state->mh << 8) | state->ml] == O_IN_A_3;
+}
+
+static void timeline_push(Timeline *timeline, uint64_t cycle, uint8_t byte) {
+    if (timeline->n == timeline->capacity) {
+        size_t capacity = timeline->capacity == 0 ? 1024 : 2 * timeline->capacity;
+        RxEvent *events = realloc(timeline->events, capacity * sizeof(RxEvent));
+
+        if (events == NULL) {
+            fprintf(stderr, "Failed to grow rx timeline\n");
+            exit(1);
+        }
+
+        timeline->events = events;
+        timeline->capacity = capacity;
+    }
+
+    timeline->events[timeline->n++] = (RxEvent){ .cycle = cycle, .byte = byte };
+}
+
+// Moves the cursor to the first event at or after cycle.
+static void timeline_seek(Timeline *timeline, uint64_t cycle) {
+    size_t lo = 0;
+    size_t hi = timeline->n;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+
+        if (timeline->events[mid].cycle < cycle) lo = mid + 1;
+        else hi = mid;
+    }
+
+    timeline->cursor = lo;
+}
+
+// Call at instruction boundaries, returns true if a byte was injected.
+static bool timeline_inject(Timeline *timeline, State *state) {
+    if (timeline->cursor == timeline->n ||
+        timeline->events[timeline->cursor].cycle > state->cycle ||
+        !timeline_rx_ready(state)) return false;
+
+    state->rx = timeline->events[timeline->cursor++].byte;
+    state->rx_bits = 1;
+
+    return true;
+}
+
+static bool timeline_read(const char *path, Timeline *timeline) {
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    timeline->end = UINT64_MAX;
+
+    char line[128];
+    for (size_t line_nr = 1; fgets(line, sizeof(line), f) != NULL; ++line_nr) {
+        unsigned long long cycle;
+        unsigned byte;
+        char kind[8];
+
+        if (line[0] == '\n' || line[0] == '#') continue;
+
+        int n = sscanf(line, "%llu %7s %x", &cycle, kind, &byte);
+
+        if (n == 3 && strcmp(kind, "rx") == 0 && byte <= 0xff) {
+            timeline_push(timeline, cycle, (uint8_t)byte);
+        } else if (n == 2 && strcmp(kind, "end") == 0) {
+            timeline->end = cycle;
+        } else {
+            fprintf(stderr, "%s:%zu: expected '<cycle> rx <byte>' or '<cycle> end'\n", path, line_nr);
+            fclose(f);
+            return false;
+        }
+    }
+
+    fclose(f);
+
+    return true;
+}
@@ -0,0 +1,87 @@
+#include <fcntl.h> // open
+#include <sys/mman.h> // mmap
+
+// Micro-step trace written with -t, one TraceRecord per cycle into a ring
+// buffer in a memory mapped file. The file keeps the last records of the run
+// after the emulator exits, ./build/trace_decode prints them.
+
+#define TRACE_MAGIC "CPUTRACE"
+#define TRACE_DEFAULT_MIB 64
+
+typedef struct {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t capacity;  // Records, power of two.
+    uint64_t written;   // Records written in total, the oldest is overwritten first.
+} TraceHeader;
+
+typedef struct {
+    uint64_t cycle;
+    uint16_t control;   // Control signals, active high.
+    uint16_t m;         // Memory address, M or the register selected by C.
+    uint8_t o;
+    uint8_t s;
+    uint8_t f;
+    uint8_t bus;        // Data bus.
+} TraceRecord;
+
+_Static_assert(sizeof(TraceRecord) == 16, "TraceRecord is expected to be 16 bytes");
+
+typedef struct {
+    TraceHeader *header;
+    TraceRecord *records;
+    size_t size;
+} Trace;
+
+static bool trace_open(Trace *trace, const char *path, size_t mib) {
+    uint64_t capacity = 1;
+    while (capacity * 2 * sizeof(TraceRecord) <= (mib << 20)) capacity *= 2;
+
+    trace->size = sizeof(TraceHeader) + capacity * sizeof(TraceRecord);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0 || ftruncate(fd, (off_t)trace->size) < 0) {
+        fprintf(stderr, "Could not create %s\n", path);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    void *p = mmap(NULL, trace->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (p == MAP_FAILED) {
+        perror("mmap failed");
+        return false;
+    }
+
+    trace->header = p;
+    trace->records = (TraceRecord *)(trace->header + 1);
+
+    memcpy(trace->header->magic, TRACE_MAGIC, sizeof(trace->header->magic));
+    trace->header->record_size = sizeof(TraceRecord);
+    trace->header->capacity = capacity;
+    trace->header->written = 0;
+
+    return true;
+}
+
+// Fills in everything known before the cycle, the bus is set after it.
+static inline TraceRecord *trace_next(Trace *trace, const State *state, uint16_t control_signals) {
+    TraceHeader *header = trace->header;
+    TraceRecord *record = &trace->records[header->written++ & (header->capacity - 1)];
+
+    record->cycle = state->cycle;
+    record->control = control_signals;
+    record->m = emulate_mem_bus(state);
+    record->o = state->o;
+    record->s = state->s;
+    record->f = state->f;
+
+    return record;
+}
+
+static void trace_close(Trace *trace) {
+    munmap(trace->header, trace->size);
+}
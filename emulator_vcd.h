@@ -0,0 +1,269 @@
+// Value change dump of control lines, buses and serial io, written with -v.
+// One time unit is one cycle, the values at a time are those during that
+// cycle. Only changes are written, through an output buffer. When the cycle
+// goes back after a reload or a reverse step in gdb, the dump goes on from its
+// last time, time in a dump only moves forward.
+//
+// -V limits the capture, a comma separated list of:
+//
+//     start=<cycle>   begin at this cycle (default 0)
+//     gpo=<mask>      then wait until one of these gpo bits changes
+//     cycles=<n>      capture n cycles (default until exit)
+
+#define VCD_BUFFER_SIZE (1 << 20)
+
+typedef enum {
+    VCD_LD_MH, VCD_LD_ML, VCD_INC_M, VCD_OE_MEM, VCD_OE_T, VCD_OE_IO, VCD_LD_T, VCD_LD_MEM,
+    VCD_LD_F, VCD_OE_C, VCD_OE_ALU, VCD_LD_C, VCD_S_C0, VCD_S_C1, VCD_S_C2, VCD_SEL_C,
+    VCD_LD_O, VCD_LD_S, VCD_LD_IO,
+    VCD_DATA_BUS, VCD_M, VCD_O, VCD_S, VCD_F, VCD_GPO,
+    VCD_RX, VCD_TX, VCD_CTS, VCD_RTS,
+    VCD_N_SIGNALS
+} VcdSignal;
+
+// Control word bits come first, in bit order.
+static const struct {
+    const char *scope;
+    const char *name;
+    int width;
+} VCD_SIGNALS[VCD_N_SIGNALS] = {
+    [VCD_LD_MH]    = { "control", "LD_MH",    1 },
+    [VCD_LD_ML]    = { "control", "LD_ML",    1 },
+    [VCD_INC_M]    = { "control", "INC_M",    1 },
+    [VCD_OE_MEM]   = { "control", "OE_MEM",   1 },
+    [VCD_OE_T]     = { "control", "OE_T",     1 },
+    [VCD_OE_IO]    = { "control", "OE_IO",    1 },
+    [VCD_LD_T]     = { "control", "LD_T",     1 },
+    [VCD_LD_MEM]   = { "control", "LD_MEM",   1 },
+    [VCD_LD_F]     = { "control", "LD_F",     1 },
+    [VCD_OE_C]     = { "control", "OE_C",     1 },
+    [VCD_OE_ALU]   = { "control", "OE_ALU",   1 },
+    [VCD_LD_C]     = { "control", "LD_C",     1 },
+    [VCD_S_C0]     = { "control", "S_C0",     1 },
+    [VCD_S_C1]     = { "control", "S_C1",     1 },
+    [VCD_S_C2]     = { "control", "S_C2",     1 },
+    [VCD_SEL_C]    = { "control", "SEL_C",    1 },
+    [VCD_LD_O]     = { "control", "LD_O",     1 },
+    [VCD_LD_S]     = { "control", "LD_S",     1 },
+    [VCD_LD_IO]    = { "control", "LD_IO",    1 },
+    [VCD_DATA_BUS] = { "cpu",     "data_bus", 8 },
+    [VCD_M]        = { "cpu",     "M",        16 },
+    [VCD_O]        = { "cpu",     "O",        8 },
+    [VCD_S]        = { "cpu",     "S",        4 },
+    [VCD_F]        = { "cpu",     "F",        4 },
+    [VCD_GPO]      = { "io",      "gpo",      8 },
+    [VCD_RX]       = { "io",      "RX",       1 },
+    [VCD_TX]       = { "io",      "TX",       1 },
+    [VCD_CTS]      = { "io",      "CTS",      1 },
+    [VCD_RTS]      = { "io",      "RTS",      1 },
+};
+
+typedef struct {
+    FILE *f;
+    char buf[VCD_BUFFER_SIZE];
+    size_t n;
+
+    uint64_t start;
+    uint64_t cycles;    // 0 means until exit.
+    uint8_t gpo_mask;   // 0 means no trigger.
+    uint8_t last_gpo;   // Set to the gpo when emulation starts.
+
+    bool capturing;
+    bool finished;
+    uint64_t end;       // In dump time.
+    uint64_t offset;    // Dump time minus cycle.
+    uint64_t last_time;
+    uint32_t values[VCD_N_SIGNALS];
+} Vcd;
+
+// Only the values known before the cycle, the data bus is added after it.
+typedef struct {
+    uint16_t control_signals;
+    uint16_t m;
+    uint8_t o;
+    uint8_t s;
+    uint8_t f;
+    uint8_t gpo;
+    uint8_t rx;
+} VcdSample;
+
+static bool vcd_parse_options(Vcd *vcd, char *options) {
+    for (char *option = strtok(options, ","); option != NULL; option = strtok(NULL, ",")) {
+        char *value = strchr(option, '=');
+
+        if (value == NULL) return false;
+        *value++ = 0;
+
+        if      (strcmp(option, "start")  == 0) vcd->start = (uint64_t)strtod(value, NULL);
+        else if (strcmp(option, "cycles") == 0) vcd->cycles = (uint64_t)strtod(value, NULL);
+        else if (strcmp(option, "gpo")    == 0) vcd->gpo_mask = (uint8_t)strtoul(value, NULL, 0);
+        else return false;
+    }
+
+    return true;
+}
+
+static void vcd_flush(Vcd *vcd) {
+    fwrite(vcd->buf, 1, vcd->n, vcd->f);
+    vcd->n = 0;
+}
+
+static void vcd_put_u64(Vcd *vcd, uint64_t value) {
+    char digits[20];
+    int n = 0;
+
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+
+    while (n > 0) vcd->buf[vcd->n++] = digits[--n];
+}
+
+static void vcd_put_value(Vcd *vcd, VcdSignal signal, uint32_t value) {
+    int width = VCD_SIGNALS[signal].width;
+
+    if (width == 1) {
+        vcd->buf[vcd->n++] = value ? '1' : '0';
+    } else {
+        vcd->buf[vcd->n++] = 'b';
+        for (int bit = width - 1; bit >= 0; --bit) vcd->buf[vcd->n++] = (value >> bit) & 1 ? '1' : '0';
+        vcd->buf[vcd->n++] = ' ';
+    }
+
+    vcd->buf[vcd->n++] = (char)('!' + signal);
+    vcd->buf[vcd->n++] = '\n';
+}
+
+static bool vcd_open(Vcd *vcd, const char *path) {
+    vcd->f = fopen(path, "w");
+
+    if (vcd->f == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    fprintf(vcd->f, "$version custom-cpu emulator $end\n");
+    fprintf(vcd->f, "$comment one time unit is one cycle $end\n");
+    fprintf(vcd->f, "$timescale 1 ns $end\n");
+    fprintf(vcd->f, "$scope module custom_cpu $end\n");
+
+    const char *scope = NULL;
+
+    for (int i = 0; i < VCD_N_SIGNALS; ++i) {
+        if (scope == NULL || strcmp(scope, VCD_SIGNALS[i].scope) != 0) {
+            if (scope != NULL) fprintf(vcd->f, "$upscope $end\n");
+
+            scope = VCD_SIGNALS[i].scope;
+            fprintf(vcd->f, "$scope module %s $end\n", scope);
+        }
+
+        fprintf(vcd->f, "$var wire %d %c %s $end\n", VCD_SIGNALS[i].width, '!' + i, VCD_SIGNALS[i].name);
+    }
+
+    fprintf(vcd->f, "$upscope $end\n$upscope $end\n$enddefinitions $end\n");
+
+    return true;
+}
+
+static inline VcdSample vcd_before_cycle(const State *state, uint16_t control_signals) {
+    // The rx line as the guest samples it: start bit, data bits, stop bit.
+    uint8_t rx = state->rx_bits == 0 || state->rx_bits >= 10 ? 1
+               : state->rx_bits == 1                         ? 0
+               : (state->rx >> (state->rx_bits - 2)) & 1;
+
+    return (VcdSample){
+        .control_signals = control_signals,
+        .m = (uint16_t)((state->mh << 8) | state->ml),
+        .o = state->o,
+        .s = state->s,
+        .f = state->f,
+        .gpo = state->gpo,
+        .rx = rx,
+    };
+}
+
+static void vcd_capture(Vcd *vcd, uint64_t time, const VcdSample *sample, uint8_t data_bus) {
+    uint16_t c = sample->control_signals;
+    uint32_t values[VCD_N_SIGNALS];
+
+    for (int bit = 0; bit < 16; ++bit) values[bit] = (c >> bit) & 1;
+
+    values[VCD_LD_O]     = IS_LD_O(c) ? 1 : 0;
+    values[VCD_LD_S]     = IS_LD_S(c) ? 1 : 0;
+    values[VCD_LD_IO]    = IS_LD_IO(c) ? 1 : 0;
+    values[VCD_DATA_BUS] = data_bus;
+    values[VCD_M]        = sample->m;
+    values[VCD_O]        = sample->o;
+    values[VCD_S]        = sample->s;
+    values[VCD_F]        = sample->f;
+    values[VCD_GPO]      = sample->gpo;
+    values[VCD_RX]       = sample->rx;
+    values[VCD_TX]       = sample->gpo & GPO_MASK_BIT0_TX ? 1 : 0;
+    values[VCD_CTS]      = sample->gpo & GPO_MASK_BIT1_CTS ? 1 : 0;
+    values[VCD_RTS]      = 0; // GPI bit 6, the emulator always reads it as asserted.
+
+    bool first = !vcd->capturing;
+    bool time_written = false;
+
+    if (first) {
+        vcd->capturing = true;
+        vcd->buf[vcd->n++] = '#';
+        vcd_put_u64(vcd, time);
+        memcpy(vcd->buf + vcd->n, "\n$dumpvars\n", 11);
+        vcd->n += 11;
+        time_written = true;
+    }
+
+    for (int i = 0; i < VCD_N_SIGNALS; ++i) {
+        if (!first && values[i] == vcd->values[i]) continue;
+
+        if (!time_written) {
+            vcd->buf[vcd->n++] = '#';
+            vcd_put_u64(vcd, time);
+            vcd->buf[vcd->n++] = '\n';
+            time_written = true;
+        }
+
+        vcd_put_value(vcd, (VcdSignal)i, values[i]);
+        vcd->values[i] = values[i];
+    }
+
+    if (first) {
+        memcpy(vcd->buf + vcd->n, "$end\n", 5);
+        vcd->n += 5;
+    }
+
+    if (vcd->n > VCD_BUFFER_SIZE - 1024) vcd_flush(vcd);
+}
+
+// Call after each cycle with the sample taken before it.
+static inline void vcd_sample(Vcd *vcd, uint64_t cycle, const VcdSample *sample, uint8_t data_bus) {
+    if (vcd->capturing && cycle + vcd->offset <= vcd->last_time) vcd->offset = vcd->last_time + 1 - cycle;
+
+    uint64_t time = cycle + vcd->offset;
+
+    if (!vcd->capturing) {
+        bool triggered = vcd->gpo_mask == 0 || ((sample->gpo ^ vcd->last_gpo) & vcd->gpo_mask);
+
+        vcd->last_gpo = sample->gpo;
+
+        if (vcd->finished || cycle < vcd->start || !triggered) return;
+
+        vcd->end = vcd->cycles != 0 ? time + vcd->cycles : UINT64_MAX;
+    }
+
+    if (time >= vcd->end) {
+        vcd->capturing = false;
+        vcd->finished = true;
+        return;
+    }
+
+    vcd->last_time = time;
+    vcd_capture(vcd, time, sample, data_bus);
+}
+
+static void vcd_close(Vcd *vcd) {
+    vcd_flush(vcd);
+    fclose(vcd->f);
+}
@@ -0,0 +1,76 @@
+// Breakpoints and watchpoints as flags per 256 byte page and per address.
+//
+// Every cycle is checked with a single test against the page flags, only
+// accesses to a watched page look at the per address flags. Registers
+// selected through C are kept as their own page, so watching the register
+// file does not slow down stack or program accesses to page 0xff and the
+// other way around.
+
+typedef enum {
+    WATCH_FETCH = 1 << 0,
+    WATCH_READ  = 1 << 1,
+    WATCH_WRITE = 1 << 2,
+    WATCH_STACK = 1 << 3, // Any read or write through M.
+} WatchKind;
+
+#define WATCH_REGISTERS      0x10000 // Index of register 0 when selected through C.
+#define WATCH_N_ADDRESSES    (WATCH_REGISTERS + 8)
+#define WATCH_N_PAGES        ((WATCH_N_ADDRESSES + 0xff) >> 8)
+
+typedef struct {
+    uint8_t pages[WATCH_N_PAGES];
+    uint8_t addresses[WATCH_N_ADDRESSES];
+    bool stack_guard;
+} WatchMap;
+
+static void watch_set_index(WatchMap *map, uint32_t index, uint8_t kinds) {
+    map->addresses[index] |= kinds;
+    map->pages[index >> 8] |= kinds;
+}
+
+// Watches a memory address, register file addresses are also watched when
+// accessed through C.
+static void watch_set(WatchMap *map, uint16_t address, uint8_t kinds) {
+    watch_set_index(map, address, kinds);
+
+    if (address >= 0xfff0 && address < 0xfff8 && (kinds & (WATCH_READ | WATCH_WRITE)))
+        watch_set_index(map, WATCH_REGISTERS | (address & 0x7), kinds & (WATCH_READ | WATCH_WRITE));
+}
+
+// The stack is at 0xff00 + SP and grows up, an access through M to the
+// register file at 0xfff0 (but not to SP itself at 0xffff) is an overflow.
+static void watch_set_stack_guard(WatchMap *map) {
+    map->stack_guard = true;
+
+    for (uint32_t address = 0xfff0; address < 0xffff; ++address)
+        watch_set_index(map, address, WATCH_STACK);
+}
+
+// Removes all breakpoints and watchpoints, keeping the stack guard.
+static void watch_reset(WatchMap *map) {
+    bool stack_guard = map->stack_guard;
+
+    memset(map, 0, sizeof(*map));
+
+    if (stack_guard) watch_set_stack_guard(map);
+}
+
+// Index into the map for the memory access of the next cycle.
+static inline uint32_t watch_index(const State *state) {
+    return (state->c & 0x8)
+            ? (WATCH_REGISTERS | (state->c & 0x7))
+            : (uint32_t)((state->mh << 8) | state->ml);
+}
+
+// Returns the watch kinds hit by the next cycle, 0 in the common case.
+static inline uint8_t watch_check(const WatchMap *map, const State *state, uint16_t signals) {
+    uint8_t kind = (uint8_t)((((signals & OE_MEM) ? 1 : 0) << 1) | (((signals & LD_MEM) ? 1 : 0) << 2));
+
+    kind = (state->s == 0) ? WATCH_FETCH : (uint8_t)(kind | (kind ? WATCH_STACK : 0));
+
+    uint32_t index = watch_index(state);
+
+    if (!(map->pages[index >> 8] & kind)) return 0;
+
+    return map->addresses[index] & kind;
+}
@@ -0,0 +1,437 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h> // offsetof
+#include <string.h> // memcpy
+#include <getopt.h> // getopt
+#include <sys/stat.h> // mkdir
+
+#include "emulate.h"
+#include "tools.h"
+#include "opcodes.h"
+#include "emulator_coverage.h"
+
+// Coverage guided fuzzer of the microcode and the emulator:
+//
+//     fuzz [-o dir] [-t seconds] [-c cycles] [-s seed] [corpus files...]
+//     fuzz -r input
+//
+// An input is an instruction stream run at 0x1000 and bytes fed to the guest
+// over rx whenever it is about to sample it. Every run starts from a snapshot
+// taken once after init. Only the 256 byte pages written during a run are
+// copied back from the snapshot, so a reset costs about as much as the pages
+// the input touched. Inputs that reach a control address or pc edge no run
+// has reached before join the corpus.
+//
+// Before each cycle the control word is checked for what would stop or
+// confuse the emulator: no or several outputs on the bus, io on a port other
+// than 3 and stack instructions reaching into the register file at 0xfff0.
+// Inputs that reach new coverage are run twice and the states compared, with
+// a single engine this catches state leaking between runs through the reset.
+//
+// With -o the corpus goes to dir/queue, findings to dir/findings, one per
+// kind and opcode, and the control address coverage to dir/coverage.bin with
+// the report of `emulator -k`. Input files are a two byte big endian length
+// of the instruction stream followed by the stream and the rx bytes.
+
+#define FUZZ_PROGRAM_START 0x1000
+#define FUZZ_MAX_INPUT 512
+#define FUZZ_MAX_CORPUS 65536
+#define FUZZ_EDGES (1 << 16)
+
+typedef enum {
+    FINDING_NONE,
+    FINDING_BUS_CONFLICT,
+    FINDING_UNSUPPORTED_PORT,
+    FINDING_STACK_CORRUPTION,
+    FINDING_DIVERGENCE,
+    N_FINDINGS
+} FindingKind;
+
+static const char *FINDING_NAME[N_FINDINGS] = { "none", "bus-conflict", "unsupported-port", "stack-corruption", "divergence" };
+
+typedef struct {
+    uint8_t data[FUZZ_MAX_INPUT];
+    uint16_t size;
+    uint16_t code_size;
+} Input;
+
+typedef struct {
+    FindingKind kind;
+    uint8_t o;
+    uint16_t pc;
+    uint64_t cycles;
+} RunResult;
+
+static uint8_t control[CONTROL_ROM_SIZE];
+static uint8_t alu[ALU_ROM_SIZE];
+
+static State snapshot;
+static State state;
+static uint8_t dirty[0x100];
+
+static Coverage run_coverage;
+static uint8_t run_edges[FUZZ_EDGES / 8];
+static Coverage total_coverage;
+static uint8_t total_edges[FUZZ_EDGES / 8];
+
+// Copies back the pages written since the last reset and everything in State
+// besides memory.
+static void reset(void) {
+    for (int page = 0; page < 0x100; ++page)
+        if (dirty[page]) {
+            memcpy(state.mem + (page << 8), snapshot.mem + (page << 8), 0x100);
+            dirty[page] = 0;
+        }
+
+    const size_t mem_end = offsetof(State, mem) + sizeof(state.mem);
+
+    memcpy(&state, &snapshot, offsetof(State, mem));
+    memcpy((uint8_t *)&state + mem_end, (const uint8_t *)&snapshot + mem_end, sizeof(State) - mem_end);
+}
+
+static uint8_t io_port(uint8_t c) {
+    return (c & 1) ? 0 : (c & 2) ? 1 : (c & 4) ? 2 : (c & 8) ? 3 : 0xff;
+}
+
+static bool stack_opcode(uint8_t o) {
+    return (o >= O_PUSH_A && o <= O_POP_E) || o == O_CALL_I16_END || o == O_RET;
+}
+
+// What emulate_next_cycle would exit on, or stack corruption.
+static FindingKind check_cycle(uint16_t signals) {
+    int n_oe = ((signals & OE_MEM) ? 1 : 0)
+             + ((signals & OE_T)   ? 1 : 0)
+             + ((signals & OE_IO)  ? 1 : 0)
+             + ((signals & OE_C)   ? 1 : 0)
+             + ((signals & OE_ALU) ? 1 : 0);
+
+    if (n_oe != 1) return FINDING_BUS_CONFLICT;
+
+    if ((signals & OE_IO) && io_port(state.c) != 3) return FINDING_UNSUPPORTED_PORT;
+    if (IS_LD_IO(signals) && io_port((uint8_t)~state.c) != 3) return FINDING_UNSUPPORTED_PORT;
+
+    if ((signals & (OE_MEM | LD_MEM)) && !(state.c & 0x8) && state.s != 0 && stack_opcode(state.o)) {
+        uint16_t address = emulate_mem_bus(&state);
+
+        if (address >= 0xfff0 && address < 0xffff) return FINDING_STACK_CORRUPTION;
+    }
+
+    return FINDING_NONE;
+}
+
+static RunResult run(const Input *input, uint64_t max_cycles) {
+    RunResult result = {0};
+
+    reset();
+
+    memcpy(state.mem + FUZZ_PROGRAM_START, input->data, input->code_size);
+    for (uint32_t page = FUZZ_PROGRAM_START >> 8; page <= (uint32_t)(FUZZ_PROGRAM_START + input->code_size) >> 8; ++page)
+        dirty[page] = 1;
+
+    memset(run_coverage.bits, 0, sizeof(run_coverage.bits));
+    memset(run_edges, 0, sizeof(run_edges));
+
+    size_t rx = input->code_size;
+    uint16_t previous_pc = FUZZ_PROGRAM_START;
+
+    for (uint64_t cycle = 0; cycle < max_cycles; ++cycle) {
+        uint16_t signals = emulate_control_signals(control, &state);
+
+        result.kind = check_cycle(signals);
+
+        if (result.kind != FINDING_NONE) {
+            result.o = state.o;
+            result.pc = previous_pc; // Of the instruction.
+            result.cycles = cycle;
+            return result;
+        }
+
+        coverage_mark(&run_coverage, &state);
+        if (signals & LD_MEM) dirty[emulate_mem_bus(&state) >> 8] = 1;
+
+        if (emulate_next_cycle(false, control, alu, &state)) {
+            uint16_t pc = (uint16_t)((state.mh << 8) | state.ml);
+            uint16_t edge = (uint16_t)((previous_pc >> 1) ^ pc);
+
+            run_edges[edge >> 3] |= (uint8_t)(1 << (edge & 7));
+            previous_pc = pc;
+
+            state.tx_bits = state.tx_bits == 9 ? 0 : state.tx_bits;
+
+            if (rx < input->size && state.rx_bits == 0 && state.mem[pc] == O_IN_A_3) {
+                state.rx = input->data[rx++];
+                state.rx_bits = 1;
+            }
+        }
+    }
+
+    result.cycles = max_cycles;
+
+    return result;
+}
+
+// Merges the last run into the totals, returns the number of new bits.
+static int merge_new(void) {
+    int new_bits = 0;
+
+    for (size_t i = 0; i < sizeof(total_coverage.bits); ++i) {
+        new_bits += __builtin_popcount(run_coverage.bits[i] & ~total_coverage.bits[i]);
+        total_coverage.bits[i] |= run_coverage.bits[i];
+    }
+
+    for (size_t i = 0; i < sizeof(total_edges); ++i) {
+        new_bits += __builtin_popcount(run_edges[i] & ~total_edges[i]);
+        total_edges[i] |= run_edges[i];
+    }
+
+    return new_bits;
+}
+
+static int count_bits(const uint8_t *bits, size_t n) {
+    int count = 0;
+
+    for (size_t i = 0; i < n; ++i) count += __builtin_popcount(bits[i]);
+
+    return count;
+}
+
+static void mutate(Input *input, const Input *corpus, size_t n_corpus) {
+    int mutations = 1 + (int)(rng() % 8);
+
+    for (int m = 0; m < mutations; ++m) {
+        size_t at = input->size > 0 ? rng() % input->size : 0;
+
+        switch (rng() % 7) {
+        case 0: // Flip a bit.
+            if (input->size > 0) input->data[at] ^= (uint8_t)(1 << (rng() % 8));
+            break;
+        case 1: // Random byte.
+            if (input->size > 0) input->data[at] = (uint8_t)rng();
+            break;
+        case 2: // Insert an opcode, with operands that point back into the program.
+        case 3: {
+            if (input->size + 3 > FUZZ_MAX_INPUT) break;
+
+            size_t insert = input->code_size > 0 ? rng() % input->code_size : 0;
+            uint8_t bytes[3] = { (uint8_t)rng(), FUZZ_PROGRAM_START >> 8, (uint8_t)(rng() % 64) };
+
+            memmove(input->data + insert + 3, input->data + insert, input->size - insert);
+            memcpy(input->data + insert, bytes, 3);
+            input->size = (uint16_t)(input->size + 3);
+            input->code_size = (uint16_t)(input->code_size + 3);
+            break;
+        }
+        case 4: // Delete a byte.
+            if (input->size > 1) {
+                memmove(input->data + at, input->data + at + 1, input->size - at - 1);
+                --input->size;
+                if (at < input->code_size) --input->code_size;
+            }
+            break;
+        case 5: // Append an rx byte.
+            if (input->size < FUZZ_MAX_INPUT) input->data[input->size++] = (uint8_t)rng();
+            break;
+        case 6: { // Splice in the code of another input.
+            const Input *other = &corpus[rng() % n_corpus];
+
+            if (other->code_size == 0 || input->size + other->code_size > FUZZ_MAX_INPUT) break;
+
+            size_t insert = input->code_size > 0 ? rng() % input->code_size : 0;
+            size_t length = 1 + rng() % other->code_size;
+
+            memmove(input->data + insert + length, input->data + insert, input->size - insert);
+            memcpy(input->data + insert, other->data, length);
+            input->size = (uint16_t)(input->size + length);
+            input->code_size = (uint16_t)(input->code_size + length);
+            break;
+        }
+        }
+    }
+}
+
+static bool write_input(const char *path, const Input *input) {
+    FILE *f = fopen(path, "wb");
+
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    uint8_t header[2] = { (uint8_t)(input->code_size >> 8), (uint8_t)input->code_size };
+
+    fwrite(header, 1, 2, f);
+    fwrite(input->data, 1, input->size, f);
+    fclose(f);
+
+    return true;
+}
+
+static bool read_input(const char *path, Input *input) {
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    uint8_t header[2];
+    bool ok = fread(header, 1, 2, f) == 2;
+
+    input->size = ok ? (uint16_t)fread(input->data, 1, FUZZ_MAX_INPUT, f) : 0;
+    input->code_size = (uint16_t)((header[0] << 8) | header[1]);
+    fclose(f);
+
+    if (!ok || input->code_size > input->size) {
+        fprintf(stderr, "%s is not a fuzz input\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+static void print_result(const RunResult *result) {
+    if (result->kind == FINDING_NONE) printf("ran %llu cycles without findings\n", (unsigned long long)result->cycles);
+    else printf("%s at pc %04x, opcode %02x, cycle %llu\n", FINDING_NAME[result->kind], result->pc, result->o, (unsigned long long)result->cycles);
+}
+
+int main(int argc, char **argv) {
+    const char *dir = NULL;
+    const char *reproduce_path = NULL;
+    double seconds = 60;
+    uint64_t max_cycles = 20000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:t:c:s:r:")) != -1) {
+        switch (opt) {
+        case 'o': dir = optarg; break;
+        case 't': seconds = strtod(optarg, NULL); break;
+        case 'c': max_cycles = strtoull(optarg, NULL, 10); break;
+        case 's': rng_state = strtoull(optarg, NULL, 10) | 1; break;
+        case 'r': reproduce_path = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-o dir] [-t seconds] [-c cycles] [-s seed] [corpus files...]\n", argv[0]);
+            fprintf(stderr, "       %s -r input\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (!read_rom("./build/custom-cpu_control.bin", CONTROL_ROM_SIZE, control) ||
+        !read_rom("./build/custom-cpu_alu.bin",     ALU_ROM_SIZE,     alu)) return 1;
+
+    while (!(snapshot.f & F_I))
+        emulate_next_cycle(false, control, alu, &snapshot);
+
+    // jmp {i:i16} => 0x1c @ i, as the emulator does for a program.
+    snapshot.mem[0] = O_JMP_I16;
+    snapshot.mem[1] = FUZZ_PROGRAM_START >> 8;
+    snapshot.mem[2] = FUZZ_PROGRAM_START & 0xff;
+
+    state = snapshot;
+
+    if (reproduce_path != NULL) {
+        static Input input;
+
+        if (!read_input(reproduce_path, &input)) return 1;
+
+        RunResult result = run(&input, max_cycles);
+        print_result(&result);
+
+        return result.kind == FINDING_NONE ? 0 : 1;
+    }
+
+    static Input corpus[FUZZ_MAX_CORPUS];
+    size_t n_corpus = 0;
+
+    for (int i = optind; i < argc && n_corpus < FUZZ_MAX_CORPUS; ++i)
+        if (!read_input(argv[i], &corpus[n_corpus++])) return 1;
+
+    if (n_corpus == 0) corpus[n_corpus++] = (Input){ .data = { O_NOP }, .size = 1, .code_size = 1 };
+
+    for (size_t i = 0; i < n_corpus; ++i) {
+        run(&corpus[i], max_cycles);
+        merge_new();
+    }
+
+    char path[1024];
+
+    if (dir != NULL) {
+        snprintf(path, sizeof(path), "%s/queue", dir);
+        mkdir(dir, 0755);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/findings", dir);
+        mkdir(path, 0755);
+    }
+
+    static bool found[N_FINDINGS][256];
+    int n_findings = 0;
+    uint64_t execs = 0;
+    uint64_t start = now_ns();
+    uint64_t next_report = start + 1000000000;
+
+    for (;;) {
+        uint64_t now = now_ns();
+
+        if (now >= next_report) {
+            double elapsed = (double)(now - start) / 1e9;
+
+            printf("%6.0f s %10llu execs %8.0f/s corpus %zu control addresses %d edges %d findings %d\n",
+                elapsed, (unsigned long long)execs, (double)execs / elapsed, n_corpus,
+                count_bits(total_coverage.bits, sizeof(total_coverage.bits)), count_bits(total_edges, sizeof(total_edges)), n_findings);
+            fflush(stdout);
+
+            next_report = now + 1000000000;
+
+            if (seconds > 0 && elapsed >= seconds) break;
+        }
+
+        static Input input;
+        input = corpus[rng() % n_corpus];
+        mutate(&input, corpus, n_corpus);
+
+        RunResult result = run(&input, max_cycles);
+        ++execs;
+
+        if (merge_new() > 0) {
+            static State first;
+            first = state;
+
+            RunResult again = run(&input, max_cycles);
+
+            if (again.kind != result.kind || memcmp(&first, &state, sizeof(State)) != 0)
+                result = (RunResult){ .kind = FINDING_DIVERGENCE, .o = result.o, .pc = result.pc, .cycles = result.cycles };
+
+            if (n_corpus < FUZZ_MAX_CORPUS) {
+                corpus[n_corpus] = input;
+
+                if (dir != NULL) {
+                    snprintf(path, sizeof(path), "%s/queue/%06zu.bin", dir, n_corpus);
+                    write_input(path, &input);
+                }
+
+                ++n_corpus;
+            }
+        }
+
+        if (result.kind != FINDING_NONE && !found[result.kind][result.o]) {
+            found[result.kind][result.o] = true;
+            ++n_findings;
+
+            printf("finding: ");
+            print_result(&result);
+
+            if (dir != NULL) {
+                snprintf(path, sizeof(path), "%s/findings/%s-%02x-%04x.bin", dir, FINDING_NAME[result.kind], result.o, result.pc);
+                write_input(path, &input);
+            }
+        }
+    }
+
+    if (dir != NULL) {
+        snprintf(path, sizeof(path), "%s/coverage.bin", dir);
+        coverage_write(&total_coverage, control, path);
+    }
+
+    return 0;
+}
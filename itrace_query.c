@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h> // memcmp
+#include <unistd.h> // usleep
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "emulate.h"
+#include "emulator_itrace.h"
+#include "emulator_symbols.h"
+
+// Answers queries on a trace written by `emulator -T path` by inflating only
+// the blocks the index points at:
+//
+//     itrace_query trace cycles <first> [count]
+//     itrace_query trace pc <address or symbol>
+
+static ItraceRecord records[ITRACE_BLOCK_RECORDS];
+static uint8_t raw[ITRACE_RAW_BOUND];
+
+static uint64_t parse_number(const char *s) {
+    return (uint64_t)strtod(s, NULL); // Accepts 8e9 as well as 0x1234.
+}
+
+// Reads the index from the footer, or scans the block headers when the run
+// ended without writing it.
+static ItraceBlockHeader *read_index(FILE *f, const char *path, size_t *n_blocks) {
+    ItraceFileHeader file_header;
+
+    if (fread(&file_header, sizeof(file_header), 1, f) != 1 ||
+        memcmp(file_header.magic, ITRACE_MAGIC, sizeof(file_header.magic)) != 0) {
+        fprintf(stderr, "%s is not an itrace file\n", path);
+        return NULL;
+    }
+
+    ItraceFooter footer;
+
+    if (fseeko(f, -(off_t)sizeof(footer), SEEK_END) == 0 &&
+        fread(&footer, sizeof(footer), 1, f) == 1 &&
+        memcmp(footer.magic, ITRACE_INDEX_MAGIC, sizeof(footer.magic)) == 0) {
+
+        ItraceBlockHeader *index = malloc(footer.n_blocks * sizeof(ItraceBlockHeader) + 1);
+
+        if (index != NULL &&
+            fseeko(f, (off_t)footer.index_offset, SEEK_SET) == 0 &&
+            fread(index, sizeof(ItraceBlockHeader), footer.n_blocks, f) == footer.n_blocks) {
+            *n_blocks = footer.n_blocks;
+            return index;
+        }
+
+        free(index);
+    }
+
+    fprintf(stderr, "%s has no index, scanning blocks\n", path);
+
+    size_t capacity = 1024;
+    ItraceBlockHeader *index = malloc(capacity * sizeof(ItraceBlockHeader));
+    *n_blocks = 0;
+
+    fseeko(f, sizeof(ItraceFileHeader), SEEK_SET);
+
+    for (ItraceBlockHeader header; index != NULL && fread(&header, sizeof(header), 1, f) == 1;) {
+        if (header.raw_size > ITRACE_RAW_BOUND || header.n_records > ITRACE_BLOCK_RECORDS ||
+            fseeko(f, header.compressed_size, SEEK_CUR) != 0) break;
+
+        if (*n_blocks == capacity) {
+            capacity *= 2;
+            index = realloc(index, capacity * sizeof(ItraceBlockHeader));
+            if (index == NULL) break;
+        }
+
+        index[(*n_blocks)++] = header;
+    }
+
+    if (index == NULL) fprintf(stderr, "Failed to allocate index\n");
+
+    return index;
+}
+
+static long read_block(FILE *f, const ItraceBlockHeader *header) {
+    static uint8_t compressed[ITRACE_RAW_BOUND * 2];
+    uLongf raw_size = sizeof(raw);
+
+    if (header->compressed_size > sizeof(compressed) ||
+        fseeko(f, (off_t)(header->offset + sizeof(ItraceBlockHeader)), SEEK_SET) != 0 ||
+        fread(compressed, 1, header->compressed_size, f) != header->compressed_size ||
+        uncompress(raw, &raw_size, compressed, header->compressed_size) != Z_OK) return -1;
+
+    return itrace_decode(raw, raw_size, header, records);
+}
+
+static void print_record(const ItraceRecord *r, const Symbols *symbols) {
+    char name[96];
+
+    printf("%12llu %04x %-24s", (unsigned long long)r->cycle, r->pc, symbols_format(symbols, r->pc, name, sizeof(name)));
+
+    for (int reg = 0; reg < ITRACE_N_REGS; ++reg)
+        printf(" %s: %02x", ITRACE_REG_NAME[reg], r->regs[reg]);
+
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4 || (strcmp(argv[2], "cycles") != 0 && strcmp(argv[2], "pc") != 0)) {
+        fprintf(stderr, "usage: %s trace cycles <first> [count]\n", argv[0]);
+        fprintf(stderr, "       %s trace pc <address or symbol>\n", argv[0]);
+        return 1;
+    }
+
+    const char *path = argv[1];
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return 1;
+    }
+
+    Symbols symbols = {0};
+
+    if (symbols_read(&symbols, SYMBOLS_DEFAULT_PATH)) symbols_end(&symbols, BOOT_ROM_SIZE);
+
+    size_t n_blocks;
+    ItraceBlockHeader *index = read_index(f, path, &n_blocks);
+
+    if (index == NULL) return 1;
+
+    bool by_cycle = strcmp(argv[2], "cycles") == 0;
+    uint64_t first = 0, last = 0;
+    uint16_t pc = 0;
+
+    if (by_cycle) {
+        first = parse_number(argv[3]);
+        last = first + (argc > 4 ? parse_number(argv[4]) : 1000) - 1;
+    } else if (!symbols_find(&symbols, argv[3], &pc)) {
+        char *end;
+        unsigned long address = strtoul(argv[3], &end, 0);
+
+        if (*end != 0 || address > 0xffff) {
+            fprintf(stderr, "Unknown symbol %s\n", argv[3]);
+            return 1;
+        }
+
+        pc = (uint16_t)address;
+    }
+
+    size_t n_inflated = 0;
+    uint64_t n_found = 0;
+
+    for (size_t i = 0; i < n_blocks; ++i) {
+        const ItraceBlockHeader *header = &index[i];
+
+        if (by_cycle) {
+            // Blocks are out of cycle order after a reload or a reverse step in gdb.
+            if (header->last_cycle < first || header->first_cycle > last) continue;
+        } else {
+            if (!(header->pcs[pc >> (ITRACE_PC_SHIFT + 3)] & (1 << ((pc >> ITRACE_PC_SHIFT) & 7)))) continue;
+        }
+
+        long n = read_block(f, header);
+        ++n_inflated;
+
+        if (n < 0) {
+            fprintf(stderr, "Block at %llu is corrupt\n", (unsigned long long)header->offset);
+            continue;
+        }
+
+        for (long j = 0; j < n; ++j) {
+            const ItraceRecord *r = &records[j];
+
+            if (by_cycle ? (r->cycle < first || r->cycle > last) : r->pc != pc) continue;
+
+            print_record(r, &symbols);
+            ++n_found;
+        }
+    }
+
+    fprintf(stderr, "%llu records, inflated %zu of %zu blocks\n", (unsigned long long)n_found, n_inflated, n_blocks);
+
+    fclose(f);
+
+    return 0;
+}
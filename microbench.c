@@ -0,0 +1,356 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // sched_setaffinity
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h> // memcpy
+#include <getopt.h> // getopt
+#include <unistd.h> // fork
+#include <sys/wait.h> // waitpid
+#ifdef __linux__
+#include <sched.h> // sched_setaffinity
+#endif
+
+#include "emulate.h"
+#include "tools.h"
+#include "opcodes.h"
+
+// Measures host time per emulated cycle and per instruction of every opcode
+// in opcodes.h, each on its own in a loop, and ranks instruction classes:
+//
+//     microbench [-c cycles] [-n repeats] [-p cpu]
+//
+// Run from the repository root, it reads the roms from ./build and the opcode
+// names from ./opcodes.h.
+//
+// The loop starts at LOOP_START with every register 0x20, so memory through
+// registers or immediates lands in scratch memory at 0x2020, and flags clear.
+// An opcode is first run once with operands of 0x10: if it ends up back at
+// LOOP_START it is a jump, call or ret (the stack page holds 0x10) and loops
+// on its own. Otherwise its length is taken from a run with operands of 0x20
+// and it is repeated LOOP_COPIES times followed by a jmp back. The end of a
+// call is measured with its begin, a call to LOOP_START. Each opcode
+// runs in a child process as the emulator exits on unsupported io ports.
+
+#define LOOP_START 0x1010
+#define LOOP_COPIES 64
+
+typedef enum {
+    CLASS_ALU,
+    CLASS_LOAD,
+    CLASS_MEMORY,
+    CLASS_PUSH_POP,
+    CLASS_CALL_RET,
+    CLASS_JUMP,
+    CLASS_IO,
+    CLASS_OTHER,
+    N_CLASSES
+} Class;
+
+static const char *CLASS_NAME[N_CLASSES] = { "alu", "load", "memory", "push/pop", "call/ret", "jump", "io", "other" };
+
+typedef enum {
+    RESULT_SEQUENTIAL,
+    RESULT_LOOPS,          // Jumps back to LOOP_START on its own.
+    RESULT_LEAVES_LOOP,
+    RESULT_WRITES_CODE,
+    RESULT_UNSUPPORTED,    // The emulator exited.
+} ResultKind;
+
+static const char *RESULT_NAME[] = { "sequential", "loops", "leaves the loop", "writes code", "unsupported" };
+
+typedef struct {
+    ResultKind kind;
+    double ns_per_cycle;    // Best of the repeats.
+    double ns_per_instruction;
+    double cycles_per_instruction;
+} Result;
+
+typedef struct {
+    Class class;
+    bool defined;
+} Opcode;
+
+static char opcode_names[256][32];
+static Opcode opcodes[256];
+
+static Class class_from_name(const char *name) {
+    static const char *alu[] = { "O_DEC", "O_INC", "O_SHL", "O_SHR", "O_AND", "O_OR", "O_XOR", "O_ADD", "O_SUB", "O_CMP", "O_NOT" };
+
+    if (strncmp(name, "O_PUSH", 6) == 0 || strncmp(name, "O_POP", 5) == 0) return CLASS_PUSH_POP;
+    if (strncmp(name, "O_CALL", 6) == 0 || strcmp(name, "O_RET") == 0) return CLASS_CALL_RET;
+    if (name[2] == 'J') return CLASS_JUMP;
+    if (strncmp(name, "O_IN_", 5) == 0 || strncmp(name, "O_OUT_", 6) == 0) return CLASS_IO;
+
+    for (size_t i = 0; i < sizeof(alu) / sizeof(alu[0]); ++i)
+        if (strncmp(name, alu[i], strlen(alu[i])) == 0) return CLASS_ALU;
+
+    if (strstr(name, "_AT_") != NULL) return CLASS_MEMORY;
+    if (strncmp(name, "O_LD_", 5) == 0) return CLASS_LOAD;
+
+    return CLASS_OTHER;
+}
+
+// Classes of the opcodes named in opcodes.h.
+static void classify_opcodes(void) {
+    for (int o = 0; o < 256; ++o) {
+        opcodes[o].defined = opcode_names[o][0] != 0;
+        if (opcodes[o].defined) opcodes[o].class = class_from_name(opcode_names[o]);
+    }
+}
+
+static uint8_t control[CONTROL_ROM_SIZE];
+static uint8_t alu[ALU_ROM_SIZE];
+static State init_state;
+
+static void seed(State *state, uint8_t o, uint8_t operand) {
+    *state = init_state;
+
+    memset(state->mem + 0xff00, 0x10, 0xf0); // Stack page, ret goes to LOOP_START.
+    memset(state->mem + 0xfff0, 0x20, 8);    // Register file.
+    state->mem[0xffff] = 0x80;               // SP
+
+    state->f = F_I;
+    state->s = 0;
+    state->mh = LOOP_START >> 8;
+    state->ml = LOOP_START & 0xff;
+
+    state->mem[LOOP_START] = o;
+    memset(state->mem + LOOP_START + 1, operand, 4);
+}
+
+static uint16_t run_instruction(State *state) {
+    for (int cycle = 0; cycle < 64; ++cycle)
+        if (emulate_next_cycle(false, control, alu, state)) break;
+
+    return (uint16_t)((state->mh << 8) | state->ml);
+}
+
+static Result measure(uint8_t o, uint64_t cycles, int repeats) {
+    Result result = { .ns_per_cycle = 1e30 };
+    static State state;
+    static State start;
+
+    seed(&start, o, 0x10);
+    state = start;
+
+    if (o == O_CALL_I16_END) {
+        // Only runs after O_CALL_I16_BEGIN, measured as a whole call.
+        start.mem[LOOP_START] = O_CALL_I16_BEGIN;
+        start.mem[LOOP_START + 3] = O_CALL_I16_END;
+
+        result.kind = RESULT_LOOPS;
+    } else if (run_instruction(&state) == LOOP_START) {
+        result.kind = RESULT_LOOPS;
+    } else {
+        seed(&start, o, 0x20);
+        state = start;
+
+        int length = run_instruction(&state) - LOOP_START;
+
+        if (length < 1 || length > 5) {
+            result.kind = RESULT_LEAVES_LOOP;
+            return result;
+        }
+
+        if (memcmp(state.mem + LOOP_START, start.mem + LOOP_START, 5) != 0) {
+            result.kind = RESULT_WRITES_CODE;
+            return result;
+        }
+
+        uint16_t pc = LOOP_START;
+
+        for (int i = 0; i < LOOP_COPIES; ++i) {
+            start.mem[pc] = o;
+            memset(start.mem + pc + 1, 0x20, (size_t)length - 1);
+            pc = (uint16_t)(pc + length);
+        }
+
+        start.mem[pc++] = O_JMP_I16;
+        start.mem[pc++] = LOOP_START >> 8;
+        start.mem[pc++] = LOOP_START & 0xff;
+
+        result.kind = RESULT_SEQUENTIAL;
+    }
+
+    for (int r = 0; r < repeats; ++r) {
+        state = start;
+
+        uint64_t instructions = 0;
+        uint64_t t0 = now_ns();
+
+        for (uint64_t i = 0; i < cycles; ++i)
+            instructions += emulate_next_cycle(false, control, alu, &state);
+
+        double ns = (double)(now_ns() - t0);
+
+        if (ns / (double)cycles < result.ns_per_cycle) {
+            result.ns_per_cycle = ns / (double)cycles;
+            result.ns_per_instruction = instructions > 0 ? ns / (double)instructions : 0;
+            result.cycles_per_instruction = instructions > 0 ? (double)cycles / (double)instructions : 0;
+        }
+    }
+
+    return result;
+}
+
+// In a child process, an unsupported port exits the emulator.
+static Result measure_isolated(uint8_t o, uint64_t cycles, int repeats) {
+    Result result = { .kind = RESULT_UNSUPPORTED };
+    int fds[2];
+
+    fflush(stdout);
+
+    if (pipe(fds) != 0) {
+        perror("pipe failed");
+        exit(1);
+    }
+
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("fork failed");
+        exit(1);
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        freopen("/dev/null", "w", stderr);
+
+        Result child_result = measure(o, cycles, repeats);
+
+        _exit(write(fds[1], &child_result, sizeof(child_result)) == sizeof(child_result) ? 0 : 1);
+    }
+
+    close(fds[1]);
+
+    Result child_result;
+    int status;
+
+    if (read(fds[0], &child_result, sizeof(child_result)) == sizeof(child_result)) result = child_result;
+
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+
+    return result;
+}
+
+static void pin(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) perror("sched_setaffinity failed, not pinned");
+    else printf("pinned to cpu %d\n", cpu);
+#else
+    (void)cpu;
+    printf("pinning is not supported on this platform\n");
+#endif
+}
+
+typedef struct {
+    uint8_t o;
+    Result result;
+} Measured;
+
+static int measured_compare(const void *a, const void *b) {
+    const Measured *ma = a;
+    const Measured *mb = b;
+
+    return ma->result.ns_per_instruction < mb->result.ns_per_instruction ? 1
+         : ma->result.ns_per_instruction > mb->result.ns_per_instruction ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+    uint64_t cycles = 2000000;
+    int repeats = 5;
+    int cpu = -1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:p:")) != -1) {
+        switch (opt) {
+        case 'c': cycles = strtoull(optarg, NULL, 10); break;
+        case 'n': repeats = atoi(optarg); break;
+        case 'p': cpu = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-c cycles] [-n repeats] [-p cpu]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (cycles == 0 || repeats < 1) return 1;
+
+    if (!read_opcodes("./opcodes.h", opcode_names) ||
+        !read_rom("./build/custom-cpu_control.bin", CONTROL_ROM_SIZE, control) ||
+        !read_rom("./build/custom-cpu_alu.bin",     ALU_ROM_SIZE,     alu)) return 1;
+
+    classify_opcodes();
+
+    if (cpu >= 0) pin(cpu);
+
+    while (!(init_state.f & F_I))
+        emulate_next_cycle(false, control, alu, &init_state);
+
+    static Measured measured[256];
+    size_t n = 0;
+
+    for (int o = 0; o < 256; ++o) {
+        if (!opcodes[o].defined) continue;
+
+        Result result = measure_isolated((uint8_t)o, cycles, repeats);
+
+        if (result.kind == RESULT_SEQUENTIAL || result.kind == RESULT_LOOPS) {
+            measured[n++] = (Measured){ (uint8_t)o, result };
+        } else {
+            printf("skipped %02x %s, %s\n", o, opcode_names[o], RESULT_NAME[result.kind]);
+        }
+    }
+
+    qsort(measured, n, sizeof(measured[0]), measured_compare);
+
+    printf("\n%-24s %-9s %-10s %8s %9s %9s\n", "opcode", "class", "loop", "cycles", "ns/cycle", "ns/instr");
+
+    double class_ns[N_CLASSES] = {0};
+    double class_cycle_ns[N_CLASSES] = {0};
+    int class_n[N_CLASSES] = {0};
+
+    for (size_t i = 0; i < n; ++i) {
+        const Opcode *op = &opcodes[measured[i].o];
+        const Result *r = &measured[i].result;
+
+        printf("%02x %-21s %-9s %-10s %8.2f %9.2f %9.2f\n", measured[i].o, opcode_names[measured[i].o], CLASS_NAME[op->class],
+            RESULT_NAME[r->kind], r->cycles_per_instruction, r->ns_per_cycle, r->ns_per_instruction);
+
+        class_ns[op->class] += r->ns_per_instruction;
+        class_cycle_ns[op->class] += r->ns_per_cycle;
+        ++class_n[op->class];
+    }
+
+    // Classes by mean ns per instruction, slowest first.
+    int order[N_CLASSES];
+    int n_classes = 0;
+
+    for (int c = 0; c < N_CLASSES; ++c)
+        if (class_n[c] > 0) order[n_classes++] = c;
+
+    for (int i = 1; i < n_classes; ++i)
+        for (int j = i; j > 0 && class_ns[order[j]] / class_n[order[j]] > class_ns[order[j - 1]] / class_n[order[j - 1]]; --j) {
+            int swap = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = swap;
+        }
+
+    printf("\n%-9s %8s %9s %9s\n", "class", "opcodes", "ns/cycle", "ns/instr");
+
+    for (int i = 0; i < n_classes; ++i) {
+        int c = order[i];
+
+        printf("%-9s %8d %9.2f %9.2f\n", CLASS_NAME[c], class_n[c], class_cycle_ns[c] / class_n[c], class_ns[c] / class_n[c]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,700 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h> // strcasecmp
+#include <ctype.h> // tolower
+#include <getopt.h> // getopt
+
+#include "emulate.h"
+#include "tools.h"
+#include "opcodes.h"
+#include "control_roms_reference.h"
+
+// Searches for the shortest microcode of one instruction and prints it as an
+// instr_* function for control_roms.c:
+//
+//     superopt [-d max steps] [-k keep steps] [-n max nodes] [-f flags] opcode
+//
+// opcode is a name from opcodes.h with or without O_, like push_a, or its
+// value in hex. Run from the repository root, it reads the roms from ./build
+// and the opcode names from ./opcodes.h.
+//
+// What the instruction has to do is what the reference model in
+// control_roms_reference.h does. The search runs candidate steps on
+// SUPEROPT_TESTS random machines at once and deepens one step at a time, so
+// the first sequence found is the shortest one. Every step has exactly one
+// output enable and no io. The last step loads S, the one before it leaves C
+// selecting M so the next fetch reads the pc. Memory may only be written at
+// the addresses the instruction writes and the scratch at 0xfff6 and 0xfff7,
+// which keeps the search away from sequences that save and restore other
+// registers. A state reached before with at least as many steps left is not
+// searched again, nor one that needs more writes than there are steps left,
+// nor a step that loads a register the step before loaded for nothing. Each
+// step more costs about a hundred times the time.
+//
+// The search only looks for sequences shorter than the current microcode,
+// -d lowers that further. -k keeps the first steps of the current microcode
+// and searches the rest, the longest instructions are out of reach otherwise.
+// -f fixes the flags, for instructions whose microcode depends on them.
+//
+// A sequence found is run through emulate_next_cycle on a copy of the control
+// rom with the instruction replaced, against the reference model, on
+// SUPEROPT_VERIFY random machines. The end of call is searched and verified
+// as the second half of call, after the current microcode of its begin.
+//
+// The printed function is for the one opcode. Registers are printed as that
+// opcode's own, make them parameters by hand as in instr_push_r8.
+
+#define SUPEROPT_TESTS      8
+#define SUPEROPT_VERIFY     4096
+#define SUPEROPT_MAX_STEPS  15
+#define SUPEROPT_MAX_WRITES 6
+#define SUPEROPT_TABLE_SIZE (1 << 21) // Power of two.
+
+#define SUPEROPT_SP_MIN 0x02
+#define SUPEROPT_SP_MAX 0xed
+
+#define SUPEROPT_IS_SCRATCH(address) ((address) == 0xfff6 || (address) == 0xfff7)
+
+// One test machine during the search, the test's memory plus what has been
+// written. Writes are sorted by address and only kept while they differ, so
+// equal machines compare equal.
+typedef struct {
+    uint8_t c;
+    uint8_t t;
+    uint8_t ml;
+    uint8_t mh;
+    uint8_t f;
+    uint8_t n_writes;
+    uint16_t write_address[SUPEROPT_MAX_WRITES];
+    uint8_t write_value[SUPEROPT_MAX_WRITES];
+} Machine;
+
+typedef struct {
+    uint8_t mem[0x10000]; // Before the instruction.
+
+    // What the reference model leaves, writes that change memory only.
+    uint16_t pc;
+    uint8_t f;
+    int n_expected;
+    uint16_t expected_address[REFERENCE_MAX_WRITES];
+    uint8_t expected_value[REFERENCE_MAX_WRITES];
+} Test;
+
+typedef struct {
+    uint64_t hash;
+    uint8_t steps_left; // Searched from here with this many steps, none found.
+} TableEntry;
+
+static const char *C_NAME[8] = { "C_A", "C_B", "C_C", "C_D", "C_E", "C_T", "C_T_ML", "C_T_MH" };
+static const char *A_NAME[8] = { "A_BOOT", "A_ADD", "A_ADD_F", "A_NAND", "A_OR", "A_UNARY", "A_LS", "A_RS" };
+
+static char opcode_names[256][32];
+
+static uint8_t control[CONTROL_ROM_SIZE];
+static uint8_t alu[ALU_ROM_SIZE];
+
+static Test tests[SUPEROPT_TESTS];
+static TableEntry *table;
+
+static uint16_t mid_steps[4 * 32 * 2 * 17];
+static int n_mid_steps;
+static uint16_t last_steps[4 * 32 * 2];
+static int n_last_steps;
+
+static uint16_t path[SUPEROPT_MAX_STEPS];
+static uint64_t nodes;
+static uint64_t max_nodes = 200000000;
+
+static int find_opcode(const char *arg) {
+    char *end;
+    long value = strtol(arg, &end, 16);
+
+    if (*end == 0 && value >= 0 && value <= 0xff) return (int)value;
+
+    for (int o = 0; o < 0x100; ++o) {
+        const char *name = opcode_names[o];
+
+        if (name[0] == 0) continue;
+        if (strncasecmp(arg, "O_", 2) != 0) name += 2;
+        if (strcasecmp(arg, name) == 0) return o;
+    }
+
+    return -1;
+}
+
+static uint16_t rom_signals(const uint8_t rom[CONTROL_ROM_SIZE], uint8_t o, uint8_t s, uint8_t f) {
+    uint16_t address = (uint16_t)((f << 12) | (s << 8) | o);
+
+    return (uint16_t)((rom[(1 << 16) | address] << 8) | rom[address]) ^ S_ACTIVE_LOW_MASK;
+}
+
+static void set_rom_signals(uint8_t rom[CONTROL_ROM_SIZE], uint8_t o, uint8_t s, uint8_t f, uint16_t signals) {
+    uint16_t address = (uint16_t)((f << 12) | (s << 8) | o);
+    uint16_t unmasked = (uint16_t)(signals ^ S_ACTIVE_LOW_MASK);
+
+    rom[address] = (uint8_t)(unmasked & 0xff);
+    rom[(1 << 16) | address] = (uint8_t)(unmasked >> 8);
+}
+
+// Steps after the fetch up to and including the one loading S, 15 if the
+// instruction runs until s wraps.
+static int current_steps(uint8_t o, uint8_t f) {
+    for (uint8_t s = 1; s <= SUPEROPT_MAX_STEPS; ++s)
+        if (IS_LD_S(rom_signals(control, o, s, f))) return s;
+
+    return SUPEROPT_MAX_STEPS;
+}
+
+static uint8_t random_flags(int flags) {
+    return (uint8_t)(F_I | (flags >= 0 ? flags : (int)(rng() & 0x7)));
+}
+
+// A random machine with the instruction at pc, in memory and in the state of
+// the emulator before its fetch.
+static uint16_t setup_machine(uint8_t o, int flags, uint8_t mem[0x10000], State *state) {
+    for (int i = 0; i < 0x10000; i += 8) {
+        uint64_t r = rng();
+        memcpy(&mem[i], &r, 8);
+    }
+
+    uint16_t pc = (uint16_t)(0x1000 + rng() % 0xdffc);
+
+    mem[REFERENCE_SP] = (uint8_t)(SUPEROPT_SP_MIN + rng() % (SUPEROPT_SP_MAX - SUPEROPT_SP_MIN + 1));
+
+    if (o == O_CALL_I16_END) {
+        mem[pc] = O_CALL_I16_BEGIN;
+        mem[(uint16_t)(pc + 3)] = O_CALL_I16_END;
+    } else {
+        mem[pc] = o;
+    }
+
+    memcpy(state->mem, mem, 0x10000);
+
+    state->o = 0;
+    state->s = 0;
+    state->f = random_flags(flags);
+    state->c = (uint8_t)(rng() & 0x7);
+    state->t = (uint8_t)rng();
+    state->ml = (uint8_t)pc;
+    state->mh = (uint8_t)(pc >> 8);
+    state->gpo = 0xff;
+
+    return pc;
+}
+
+static bool run_reference(const uint8_t mem[0x10000], uint16_t pc, uint8_t f, Reference *ref) {
+    *ref = (Reference){ .mem = mem, .pc = pc, .f = f, .in = { 0, 0, 0, GPI_MASK_BIT7_RX } };
+
+    if (!reference_step(ref)) return false;
+
+    for (int port = 0; port < 4; ++port)
+        if (ref->out_written[port]) return false;
+
+    return true;
+}
+
+static uint8_t machine_read(const Test *test, const Machine *m, uint16_t address) {
+    for (int i = 0; i < m->n_writes; ++i)
+        if (m->write_address[i] == address) return m->write_value[i];
+
+    return test->mem[address];
+}
+
+static bool is_expected_address(const Test *test, uint16_t address) {
+    for (int i = 0; i < test->n_expected; ++i)
+        if (test->expected_address[i] == address) return true;
+
+    return false;
+}
+
+static bool machine_write(const Test *test, Machine *m, uint16_t address, uint8_t value) {
+    int i = 0;
+
+    while (i < m->n_writes && m->write_address[i] < address) ++i;
+
+    bool found = i < m->n_writes && m->write_address[i] == address;
+
+    if (value == test->mem[address]) {
+        if (found) {
+            memmove(&m->write_address[i], &m->write_address[i + 1], (size_t)(m->n_writes - i - 1) * sizeof(m->write_address[0]));
+            memmove(&m->write_value[i], &m->write_value[i + 1], (size_t)(m->n_writes - i - 1));
+            --m->n_writes;
+        }
+
+        return true;
+    }
+
+    if (!SUPEROPT_IS_SCRATCH(address) && !is_expected_address(test, address)) return false;
+
+    if (!found) {
+        if (m->n_writes == SUPEROPT_MAX_WRITES) return false;
+
+        memmove(&m->write_address[i + 1], &m->write_address[i], (size_t)(m->n_writes - i) * sizeof(m->write_address[0]));
+        memmove(&m->write_value[i + 1], &m->write_value[i], (size_t)(m->n_writes - i));
+        m->write_address[i] = address;
+        ++m->n_writes;
+    }
+
+    m->write_value[i] = value;
+
+    return true;
+}
+
+// One cycle as emulate_next_cycle runs it. False for a write the search does
+// not allow and for leaving the init stage.
+static bool machine_step(const Test *test, Machine *m, uint16_t signals) {
+    uint16_t mem_bus = (m->c & 0x8) ? (uint16_t)(0xfff0 | (m->c & 0x7)) : (uint16_t)((m->mh << 8) | m->ml);
+    uint8_t bus;
+
+    if      (signals & OE_MEM) bus = machine_read(test, m, mem_bus);
+    else if (signals & OE_T)   bus = m->t;
+    else if (signals & OE_C)   bus = (uint8_t)((0xf8 * ((m->c >> 2) & 1)) | (m->c & 0x7));
+    else                       bus = alu[((m->c & 0x7) << 16) | (m->mh << 8) | m->ml];
+
+    if ((signals & LD_MEM) && !machine_write(test, m, mem_bus, bus)) return false;
+    if ((signals & LD_F) && !(bus & F_I)) return false;
+
+    if (signals & LD_ML) m->ml = bus;
+    if (signals & LD_MH) m->mh = bus;
+    if (signals & LD_T)  m->t = bus;
+    if (signals & LD_F)  m->f = bus & 0x0f;
+    if (signals & LD_C)  m->c = (uint8_t)(((signals & SEL_C) ? 8 : 0) |
+                                          ((signals & S_C2)  ? 4 : 0) |
+                                          ((signals & S_C1)  ? 2 : 0) |
+                                          ((signals & S_C0)  ? 1 : 0));
+
+    if ((signals & INC_M) && !(signals & LD_ML)) {
+        m->ml = (uint8_t)(m->ml + 1);
+        if (m->ml == 0 && !(signals & LD_MH)) m->mh = (uint8_t)(m->mh + 1);
+    }
+
+    return true;
+}
+
+static bool machine_equal(const Machine *a, const Machine *b) {
+    return a->c == b->c && a->t == b->t && a->ml == b->ml && a->mh == b->mh && a->f == b->f
+        && a->n_writes == b->n_writes
+        && memcmp(a->write_address, b->write_address, a->n_writes * sizeof(a->write_address[0])) == 0
+        && memcmp(a->write_value, b->write_value, a->n_writes) == 0;
+}
+
+// Memory writes still missing or wrong, each takes a step of its own.
+static int machine_wrong_writes(const Test *test, const Machine *m) {
+    int wrong = 0;
+
+    for (int i = 0; i < test->n_expected; ++i)
+        if (machine_read(test, m, test->expected_address[i]) != test->expected_value[i]) ++wrong;
+
+    return wrong;
+}
+
+static bool machine_done(const Test *test, const Machine *m) {
+    if ((uint16_t)((m->mh << 8) | m->ml) != test->pc || (m->c & 0x8) || m->f != test->f) return false;
+
+    for (int i = 0; i < m->n_writes; ++i)
+        if (!SUPEROPT_IS_SCRATCH(m->write_address[i]) && !is_expected_address(test, m->write_address[i])) return false;
+
+    return machine_wrong_writes(test, m) == 0;
+}
+
+static uint64_t hash_mix(uint64_t hash, uint64_t value) {
+    hash ^= value;
+    hash ^= (hash & 0x0007ffffffffffff) << 13;
+    hash ^= hash >> 7;
+    hash ^= (hash & 0x00007fffffffffff) << 17;
+
+    return hash;
+}
+
+static uint64_t machines_hash(const Machine machines[SUPEROPT_TESTS]) {
+    uint64_t hash = 0x2545f4914f6cdd1d;
+
+    for (int i = 0; i < SUPEROPT_TESTS; ++i) {
+        const Machine *m = &machines[i];
+
+        hash = hash_mix(hash, (uint64_t)m->c | (uint64_t)m->t << 8 | (uint64_t)m->ml << 16 | (uint64_t)m->mh << 24 | (uint64_t)m->f << 32 | (uint64_t)m->n_writes << 40);
+
+        for (int w = 0; w < m->n_writes; ++w)
+            hash = hash_mix(hash, (uint64_t)m->write_address[w] | (uint64_t)m->write_value[w] << 16);
+    }
+
+    return hash;
+}
+
+static uint16_t step_c(int c) {
+    return (uint16_t)(LD_C | ((c & 8) ? SEL_C : SEL_M) | ((c & 4) ? S_C2 : 0) | ((c & 2) ? S_C1 : 0) | ((c & 1) ? S_C0 : 0));
+}
+
+// Every step with one output enable, no io and no load of O, those with the
+// fewest loads first so the sequence printed is the simplest of its length.
+// The last step loads S, so C keeps its value through it.
+static void enumerate_steps(bool flags_change) {
+    static const uint16_t oes[] = { OE_C, OE_MEM, OE_T, OE_ALU };
+    static const uint16_t loads[] = { LD_MEM, LD_T, LD_ML, LD_MH, LD_F };
+    int n_loads = flags_change ? 5 : 4;
+
+    for (int n_set = 0; n_set <= n_loads; ++n_set)
+    for (int oe = 0; oe < 4; ++oe)
+    for (int set = 0; set < (1 << n_loads); ++set)
+    for (int inc = 0; inc < 2; ++inc) {
+        if (__builtin_popcount((unsigned)set) != n_set) continue;
+
+        uint16_t signals = oes[oe];
+
+        for (int i = 0; i < n_loads; ++i)
+            if (set & (1 << i)) signals |= loads[i];
+
+        if (inc) signals |= INC_M;
+
+        if ((signals & OE_MEM) && (signals & LD_MEM)) continue; // Writes what it read.
+        if ((signals & INC_M) && (signals & LD_ML)) continue;   // Same without INC_M.
+
+        // Without loads the output enable does not matter.
+        if (set == 0 && oes[oe] != OE_C) continue;
+
+        last_steps[n_last_steps++] = (uint16_t)(signals | S_C1);
+
+        for (int c = -1; c < 16; ++c) {
+            if (c < 0 && set == 0 && !inc) continue; // No effect.
+
+            mid_steps[n_mid_steps++] = c < 0 ? signals : (uint16_t)(signals | step_c(c));
+        }
+    }
+}
+
+// Steps left is at least one per missing write, one to load S and one more
+// before it to select M, and two to load both halves of the pc unless one
+// value or an increment does.
+static int lower_bound(const Machine machines[SUPEROPT_TESTS]) {
+    int bound = 0;
+
+    for (int i = 0; i < SUPEROPT_TESTS; ++i) {
+        const Machine *m = &machines[i];
+        uint8_t lo = (uint8_t)tests[i].pc;
+        uint8_t hi = (uint8_t)(tests[i].pc >> 8);
+        bool carry = m->ml == 0xff && lo == 0 && (uint8_t)(m->mh + 1) == hi;
+
+        int wrong = machine_wrong_writes(&tests[i], m);
+        int steps = (m->c & 0x8) ? 2 : 1;
+
+        if (m->ml != lo && m->mh != hi && lo != hi && !carry && steps < 2) steps = 2;
+        if (wrong > steps) steps = wrong;
+        if (steps > bound) bound = steps;
+    }
+
+    return bound;
+}
+
+static bool apply(const Machine from[SUPEROPT_TESTS], Machine to[SUPEROPT_TESTS], uint16_t signals) {
+    bool changed = false;
+
+    for (int i = 0; i < SUPEROPT_TESTS; ++i) {
+        to[i] = from[i];
+
+        if (!machine_step(&tests[i], &to[i], signals)) return false;
+
+        changed = changed || !machine_equal(&from[i], &to[i]);
+    }
+
+    return changed;
+}
+
+// True if signals load a register the step before loaded and nothing reads in
+// between. The same sequence without that load is searched as well.
+static bool overwrites_unread(uint16_t before, uint16_t signals, uint8_t c) {
+    bool reads_m = ((signals & (OE_MEM | LD_MEM)) && !(c & 0x8)) || (signals & (OE_ALU | INC_M));
+    bool reads_c = signals & (OE_MEM | LD_MEM | OE_C | OE_ALU);
+
+    if ((before & LD_C)  && (signals & LD_C)  && !reads_c) return true;
+    if ((before & LD_T)  && (signals & LD_T)  && !(signals & OE_T)) return true;
+    if ((before & LD_ML) && (signals & LD_ML) && !reads_m) return true;
+    if ((before & LD_MH) && (signals & LD_MH) && !reads_m) return true;
+    if ((before & INC_M) && (signals & LD_ML) && (signals & LD_MH) && !reads_m) return true;
+
+    return false;
+}
+
+static bool search(const Machine machines[SUPEROPT_TESTS], int step, int steps_left, uint16_t before) {
+    Machine next[SUPEROPT_TESTS];
+
+    if (++nodes > max_nodes) return false;
+
+    if (steps_left == 1) {
+        for (int i = 0; i < n_last_steps; ++i) {
+            bool done = true;
+
+            for (int t = 0; done && t < SUPEROPT_TESTS; ++t) {
+                next[t] = machines[t];
+                done = machine_step(&tests[t], &next[t], last_steps[i]) && machine_done(&tests[t], &next[t]);
+            }
+
+            if (done) {
+                path[step] = last_steps[i];
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    if (lower_bound(machines) > steps_left) return false;
+
+    uint64_t hash = machines_hash(machines);
+    TableEntry *entry = &table[hash & (SUPEROPT_TABLE_SIZE - 1)];
+
+    if (entry->hash == hash && entry->steps_left >= steps_left) return false;
+
+    for (int i = 0; i < n_mid_steps; ++i) {
+        if (overwrites_unread(before, mid_steps[i], machines[0].c)) continue;
+        if (!apply(machines, next, mid_steps[i])) continue;
+        if (lower_bound(next) > steps_left - 1) continue;
+
+        if (search(next, step + 1, steps_left - 1, mid_steps[i])) {
+            path[step] = mid_steps[i];
+            return true;
+        }
+
+        if (nodes > max_nodes) return false;
+    }
+
+    *entry = (TableEntry){ hash, (uint8_t)steps_left };
+
+    return false;
+}
+
+// Runs the instruction, with steps in place of its microcode, through the
+// emulator against the reference model. Returns the number of cases that
+// differ.
+static int verify(uint8_t o, int flags, const uint16_t steps[], int n_steps, char *message, size_t size) {
+    static uint8_t patched[CONTROL_ROM_SIZE];
+    static uint8_t mem[0x10000];
+    static uint8_t expected[0x10000];
+    static State state;
+    int failed = 0;
+
+    memcpy(patched, control, CONTROL_ROM_SIZE);
+
+    for (uint8_t f = F_I; f < 0x10; ++f)
+        for (uint8_t s = 1; s <= SUPEROPT_MAX_STEPS; ++s)
+            set_rom_signals(patched, o, s, f, s <= n_steps ? steps[s - 1] : (uint16_t)OE_C);
+
+    for (int i = 0; i < SUPEROPT_VERIFY; ++i) {
+        uint16_t pc = setup_machine(o, flags, mem, &state);
+        Reference ref;
+
+        if (!run_reference(mem, pc, state.f, &ref)) {
+            snprintf(message, size, "not an instruction of the reference model");
+            return SUPEROPT_VERIFY;
+        }
+
+        memcpy(expected, mem, 0x10000);
+        for (int w = 0; w < ref.n_writes; ++w) expected[ref.write_address[w]] = ref.write_value[w];
+
+        for (int instruction = 0; instruction < (o == O_CALL_I16_END ? 2 : 1); ++instruction)
+            while (!emulate_next_cycle(false, patched, alu, &state)) {}
+
+        uint16_t pc_after = (uint16_t)((state.mh << 8) | state.ml);
+        int address = 0;
+
+        while (address < 0x10000 && (SUPEROPT_IS_SCRATCH(address) || state.mem[address] == expected[address])) ++address;
+
+        if (pc_after != ref.pc || state.f != ref.f || address < 0x10000) {
+            if (failed++ == 0) {
+                if (address < 0x10000)
+                    snprintf(message, size, "pc %04x: %04x is %02x, expected %02x", pc, address, state.mem[address], expected[address]);
+                else
+                    snprintf(message, size, "pc %04x: pc is %04x, expected %04x, flags are %x, expected %x", pc, pc_after, ref.pc, state.f, ref.f);
+            }
+        }
+    }
+
+    return failed;
+}
+
+static void print_step(uint8_t s, uint16_t signals) {
+    char line[256];
+    int n = 0;
+
+    line[0] = 0;
+
+    if      (signals & OE_MEM) n += snprintf(line + n, sizeof(line) - (size_t)n, "OE_MEM");
+    else if (signals & OE_T)   n += snprintf(line + n, sizeof(line) - (size_t)n, "OE_T  ");
+    else if (signals & OE_C)   n += snprintf(line + n, sizeof(line) - (size_t)n, "OE_C  ");
+    else                       n += snprintf(line + n, sizeof(line) - (size_t)n, "OE_ALU");
+
+    if (signals & LD_MEM) n += snprintf(line + n, sizeof(line) - (size_t)n, " | LD_MEM");
+    if (signals & LD_T)   n += snprintf(line + n, sizeof(line) - (size_t)n, " | LD_T");
+    if (signals & LD_ML)  n += snprintf(line + n, sizeof(line) - (size_t)n, " | LD_ML");
+    if (signals & LD_MH)  n += snprintf(line + n, sizeof(line) - (size_t)n, " | LD_MH");
+    if (signals & LD_F)   n += snprintf(line + n, sizeof(line) - (size_t)n, " | LD_F");
+
+    if (signals & LD_C) {
+        int c = ((signals & S_C2) ? 4 : 0) | ((signals & S_C1) ? 2 : 0) | ((signals & S_C0) ? 1 : 0);
+
+        n += snprintf(line + n, sizeof(line) - (size_t)n, " | S_C(%s) | %s | LD_C",
+            (signals & SEL_C) ? C_NAME[c] : A_NAME[c], (signals & SEL_C) ? "SEL_C" : "SEL_M");
+    }
+
+    if (signals & INC_M) n += snprintf(line + n, sizeof(line) - (size_t)n, " | INC_M");
+    if (IS_LD_S(signals)) snprintf(line + n, sizeof(line) - (size_t)n, " | C_LD_S");
+
+    printf("    case 0x%x: return %s;\n", s, line);
+}
+
+int main(int argc, char **argv) {
+    int max_steps = SUPEROPT_MAX_STEPS;
+    int keep = 0;
+    int flags = -1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:k:n:f:")) != -1) {
+        switch (opt) {
+        case 'd': max_steps = atoi(optarg); break;
+        case 'k': keep = atoi(optarg); break;
+        case 'n': max_nodes = strtoull(optarg, NULL, 10); break;
+        case 'f': flags = (int)strtol(optarg, NULL, 16) & 0x7; break;
+        default:
+            fprintf(stderr, "usage: %s [-d max steps] [-k keep steps] [-n max nodes] [-f flags] opcode\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-d max steps] [-k keep steps] [-n max nodes] [-f flags] opcode\n", argv[0]);
+        return 1;
+    }
+
+    if (!read_opcodes("./opcodes.h", opcode_names) ||
+        !read_rom("./build/custom-cpu_control.bin", CONTROL_ROM_SIZE, control) ||
+        !read_rom("./build/custom-cpu_alu.bin",     ALU_ROM_SIZE,     alu)) return 1;
+
+    int found_o = find_opcode(argv[optind]);
+
+    if (found_o < 0) {
+        fprintf(stderr, "Unknown opcode %s\n", argv[optind]);
+        return 1;
+    }
+
+    uint8_t o = (uint8_t)found_o;
+    const char *name = opcode_names[o][0] ? opcode_names[o] + 2 : argv[optind];
+    int current = current_steps(o, random_flags(flags));
+
+    if (max_steps > current - 1) max_steps = current - 1;
+
+    if (keep < 0 || keep >= max_steps) {
+        fprintf(stderr, "Keeping %d steps leaves nothing to search below %d steps\n", keep, current);
+        return 1;
+    }
+
+    // Tests, with the machines after the fetch, the begin of call and the
+    // steps kept.
+    static State state;
+    Machine start[SUPEROPT_TESTS];
+    bool flags_change = false;
+
+    for (int i = 0; i < SUPEROPT_TESTS; ++i) {
+        Test *test = &tests[i];
+        uint16_t pc = setup_machine(o, flags, test->mem, &state);
+        Reference ref;
+
+        if (!run_reference(test->mem, pc, state.f, &ref)) {
+            fprintf(stderr, "%s is not an instruction of the reference model without io\n", name);
+            return 1;
+        }
+
+        test->pc = ref.pc;
+        test->f = ref.f;
+        test->n_expected = 0;
+
+        for (int w = 0; w < ref.n_writes; ++w)
+            if (!SUPEROPT_IS_SCRATCH(ref.write_address[w]) && ref.write_value[w] != test->mem[ref.write_address[w]]) {
+                test->expected_address[test->n_expected] = ref.write_address[w];
+                test->expected_value[test->n_expected] = ref.write_value[w];
+                ++test->n_expected;
+            }
+
+        if (o == O_CALL_I16_END)
+            while (!emulate_next_cycle(false, control, alu, &state)) {}
+
+        emulate_next_cycle(false, control, alu, &state);
+
+        Machine *m = &start[i];
+        *m = (Machine){ .c = state.c, .t = state.t, .ml = state.ml, .mh = state.mh, .f = state.f };
+
+        for (int address = 0; address < 0x10000; ++address)
+            if (state.mem[address] != test->mem[address] && !machine_write(test, m, (uint16_t)address, state.mem[address])) {
+                fprintf(stderr, "Unexpected write to %04x before the search\n", address);
+                return 1;
+            }
+
+        for (uint8_t s = 1; s <= keep; ++s) {
+            path[s - 1] = rom_signals(control, o, s, state.f);
+
+            if (!machine_step(test, m, path[s - 1])) {
+                fprintf(stderr, "Kept step %x writes outside what the search allows\n", s);
+                return 1;
+            }
+        }
+
+        flags_change = flags_change || test->f != state.f;
+    }
+
+    enumerate_steps(flags_change);
+
+    table = calloc(SUPEROPT_TABLE_SIZE, sizeof(TableEntry));
+
+    if (table == NULL) {
+        fprintf(stderr, "Failed to allocate the transposition table\n");
+        return 1;
+    }
+
+    printf("%s: %d steps now, searching %d to %d steps, keeping %d\n", name, current, keep + 1, max_steps, keep);
+    fflush(stdout);
+
+    uint64_t start_ns = now_ns();
+    int found = 0;
+
+    for (int steps = keep + 1; steps <= max_steps && !found && nodes <= max_nodes; ++steps) {
+        if (search(start, keep, steps - keep, keep > 0 ? path[keep - 1] : 0)) found = steps;
+
+        printf("    %2d steps: %s, %llu nodes, %.1f s\n", steps, found ? "found" : nodes > max_nodes ? "node limit" : "none",
+            (unsigned long long)nodes, (double)(now_ns() - start_ns) / 1e9);
+        fflush(stdout);
+    }
+
+    if (!found) {
+        printf("No sequence shorter than %d steps found\n", current);
+        return 1;
+    }
+
+    char message[128];
+    int failed = verify(o, flags, path, found, message, sizeof(message));
+
+    if (failed > 0) {
+        printf("%d steps failed %d of %d cases on the emulator, first %s\n", found, failed, SUPEROPT_VERIFY, message);
+        return 1;
+    }
+
+    printf("%d steps instead of %d, verified on %d cases\n\n", found, current, SUPEROPT_VERIFY);
+
+    char function[32];
+    int n = 0;
+
+    for (const char *q = name; *q && n < (int)sizeof(function) - 1; ++q) function[n++] = (char)tolower(*q);
+    function[n] = 0;
+
+    printf("static uint16_t instr_%s(uint8_t s) {\n", function);
+    printf("    switch (s) {\n");
+
+    for (int s = 0; s < found; ++s) print_step((uint8_t)(s + 1), path[s]);
+
+    printf("    default:  return OE_C;\n");
+    printf("    }\n");
+    printf("}\n");
+
+    return 0;
+}
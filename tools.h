@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h> // strncmp
+#include <time.h> // clock_gettime
+
+// Helpers shared by the host tools: benchmark, microbench, fuzz and superopt.
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15;
+
+// xorshift64. Bits shifted out are masked off first, -fsanitize=integer traps
+// on those.
+static uint64_t rng(void) {
+    rng_state ^= (rng_state & 0x0007ffffffffffff) << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= (rng_state & 0x00007fffffffffff) << 17;
+
+    return rng_state;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Reads the enumerator names of opcodes.h into names by value, the enum
+// counts on from the last explicit value. Unused values are left empty.
+static bool read_opcodes(const char *path, char names[256][32]) {
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    char line[256];
+    int value = -1;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char name[32];
+        unsigned explicit_value;
+        int n = sscanf(line, " %31[A-Z0-9_] = %x", name, &explicit_value);
+
+        if (n < 1 || strncmp(name, "O_", 2) != 0) continue;
+
+        value = n == 2 ? (int)explicit_value : value + 1;
+
+        if (value < 0 || value > 0xff) continue;
+
+        snprintf(names[value], 32, "%s", name);
+    }
+
+    fclose(f);
+
+    return true;
+}
+
+static bool read_rom(const char *filepath, size_t rom_size, uint8_t rom[rom_size]) {
+    FILE *file = fopen(filepath, "r");
+
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open rom %s\n", filepath);
+        return false;
+    }
+
+    size_t read_bytes = fread(rom, sizeof(rom[0]), rom_size, file);
+    fclose(file);
+
+    if (read_bytes != rom_size) {
+        fprintf(stderr, "Only read %zd byte out of expected %zd bytes\n", read_bytes, rom_size);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h> // memcmp
+#include <unistd.h> // close
+
+#include "emulate.h"
+#include "emulator_trace.h"
+
+// Prints a trace written by `emulator -t path` in the format of
+// emulate_next_cycle with print_debug_info, prefixed with cycle, M and the
+// data bus.
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace [first cycle] [last cycle]\n", argv[0]);
+        return 1;
+    }
+
+    const char *path = argv[1];
+    uint64_t first = argc > 2 ? strtoull(argv[2], NULL, 0) : 0;
+    uint64_t last = argc > 3 ? strtoull(argv[3], NULL, 0) : UINT64_MAX;
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return 1;
+    }
+
+    off_t size = lseek(fd, 0, SEEK_END);
+
+    if (size < (off_t)sizeof(TraceHeader)) {
+        fprintf(stderr, "%s is too small to be a trace\n", path);
+        return 1;
+    }
+
+    const TraceHeader *header = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (header == MAP_FAILED) {
+        perror("mmap failed");
+        return 1;
+    }
+
+    if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->record_size != sizeof(TraceRecord) ||
+        sizeof(TraceHeader) + header->capacity * sizeof(TraceRecord) > (uint64_t)size) {
+        fprintf(stderr, "%s is not a trace\n", path);
+        return 1;
+    }
+
+    const TraceRecord *records = (const TraceRecord *)(header + 1);
+    uint64_t oldest = header->written > header->capacity ? header->written - header->capacity : 0;
+
+    printf("%llu records, cycles %llu..%llu\n",
+        (unsigned long long)(header->written - oldest),
+        (unsigned long long)(header->written > 0 ? records[oldest & (header->capacity - 1)].cycle : 0),
+        (unsigned long long)(header->written > 0 ? records[(header->written - 1) & (header->capacity - 1)].cycle : 0));
+
+    for (uint64_t i = oldest; i < header->written; ++i) {
+        const TraceRecord *r = &records[i & (header->capacity - 1)];
+
+        if (r->cycle < first) continue;
+        if (r->cycle > last) break;
+
+        printf("%llu m: %04x bus: %02x ", (unsigned long long)r->cycle, r->m, r->bus);
+        if (r->s > 0) printf("opcode: %02x - flags: %x ", r->o, r->f);
+        emulate_print_control_signals(r->s, r->control);
+    }
+
+    return 0;
+}